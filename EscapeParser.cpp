@@ -0,0 +1,220 @@
+#include "EscapeParser.h"
+
+static const unsigned char ESC = 27;
+static const unsigned char BEL = 7;
+static const unsigned char CAN = 24;
+static const unsigned char SUB = 26;
+
+EscapeParser::EscapeParser() {
+	state = Ground;
+	numParams = 0;
+}
+
+int EscapeParser::feed( unsigned char c ) {
+	//CAN and SUB abort any sequence
+	if( c == CAN || c == SUB ) {
+		state = Ground;
+		return None;
+	}
+
+	switch( state ) {
+		case Ground:
+			if( c == ESC ) {
+				state = Escape;
+				return None;
+			}
+			return c;
+
+		case Escape:
+			if( c == '[' ) {
+				state = Csi;
+				numParams = 0;
+				params[0] = 0;
+				return None;
+			}
+			if( c == 'O' ) {
+				state = Ss3;
+				return None;
+			}
+			if( c == ']' || c == 'P' || c == '^' || c == '_' || c == 'X' ) {
+				state = String;
+				return None;
+			}
+			if( c == ESC ) {
+				return None;
+			}
+			if( c >= 0x20 && c <= 0x2f ) {
+				state = EscapeIntermediate;
+				return None;
+			}
+			if( c < 0x20 ) {
+				//Controls are executed in the middle of a sequence
+				return c;
+			}
+			//Any other final byte ends a two character sequence, e.g. ESC c
+			state = Ground;
+			return None;
+
+		case EscapeIntermediate:
+			if( c == ESC ) {
+				state = Escape;
+				return None;
+			}
+			if( c < 0x20 ) {
+				return c;
+			}
+			if( c >= 0x30 ) {
+				state = Ground;
+			}
+			return None;
+
+		case Csi:
+		case CsiIgnore:
+			if( c == ESC ) {
+				state = Escape;
+				return None;
+			}
+			if( c < 0x20 ) {
+				return c;
+			}
+			if( c >= 0x40 && c <= 0x7e ) {
+				bool ignored = ( state == CsiIgnore );
+				state = Ground;
+				return ignored ? None : csiKey( c );
+			}
+			if( state == CsiIgnore ) {
+				return None;
+			}
+			if( c >= '0' && c <= '9' ) {
+				if( numParams < MaxParams ) {
+					unsigned int value = params[numParams] * 10 + ( c - '0' );
+					params[numParams] = value > 0xffff ? 0xffff : value;
+				}
+			} else if( c == ';' ) {
+				if( numParams < MaxParams ) {
+					numParams++;
+					if( numParams < MaxParams ) {
+						params[numParams] = 0;
+					}
+				}
+			} else {
+				//Private parameters (< = > ?) and intermediates only show up in
+				//	reports and mouse events, never in keys
+				state = CsiIgnore;
+			}
+			return None;
+
+		case Ss3:
+			if( c < 0x20 && c != ESC ) {
+				return c;
+			}
+			state = Ground;
+			if( c == ESC ) {
+				state = Escape;
+				return None;
+			}
+			return ss3Key( c );
+
+		case String:
+			//Everything up to BEL or ST (ESC \) is the string, which we drop.
+			//	A client never sends a line break inside one, so CR or LF means
+			//	it was left unterminated, end it there rather than eat the line.
+			if( c == '\r' || c == '\n' ) {
+				state = Ground;
+				return c;
+			}
+			if( c == BEL ) {
+				state = Ground;
+			} else if( c == ESC ) {
+				state = StringEscape;
+			}
+			return None;
+
+		case StringEscape:
+			if( c == '\r' || c == '\n' ) {
+				state = Ground;
+				return c;
+			}
+			if( c == '\\' ) {
+				state = Ground;
+				return None;
+			}
+			//An unterminated string, the ESC starts a new sequence
+			state = Escape;
+			return feed( c );
+	}
+
+	state = Ground;
+	return None;
+}
+
+bool EscapeParser::idle() const {
+	return state == Ground;
+}
+
+int EscapeParser::csiKey( unsigned char final ) {
+	switch( final ) {
+		case 'A': return KeyUp;
+		case 'B': return KeyDown;
+		case 'C': return KeyRight;
+		case 'D': return KeyLeft;
+		case 'H': return KeyHome;
+		case 'F': return KeyEnd;
+		case 'P': return KeyF1;
+		case 'Q': return KeyF2;
+		case 'R': return KeyF3;
+		case 'S': return KeyF4;
+		case '~': break;
+		default: return None;
+	}
+
+	//ESC [ n ~ as sent by vt220 style keyboards
+	switch( params[0] ) {
+		case 1: case 7: return KeyHome;
+		case 2: return KeyInsert;
+		case 3: return KeyDelete;
+		case 4: case 8: return KeyEnd;
+		case 5: return KeyPageUp;
+		case 6: return KeyPageDown;
+		case 11: return KeyF1;
+		case 12: return KeyF2;
+		case 13: return KeyF3;
+		case 14: return KeyF4;
+		case 15: return KeyF5;
+		case 17: return KeyF6;
+		case 18: return KeyF7;
+		case 19: return KeyF8;
+		case 20: return KeyF9;
+		case 21: return KeyF10;
+		case 23: return KeyF11;
+		case 24: return KeyF12;
+		default: return None;
+	}
+}
+
+int EscapeParser::ss3Key( unsigned char final ) {
+	switch( final ) {
+		case 'A': return KeyUp;
+		case 'B': return KeyDown;
+		case 'C': return KeyRight;
+		case 'D': return KeyLeft;
+		case 'H': return KeyHome;
+		case 'F': return KeyEnd;
+		case 'P': return KeyF1;
+		case 'Q': return KeyF2;
+		case 'R': return KeyF3;
+		case 'S': return KeyF4;
+		default: return None;
+	}
+}
+
+const char* EscapeParser::keyName( int key ) {
+	static const char* names[] = {
+		"up", "down", "right", "left", "home", "end", "insert", "delete", "page-up", "page-down",
+		"f1", "f2", "f3", "f4", "f5", "f6", "f7", "f8", "f9", "f10", "f11", "f12"
+	};
+	if( key < KeyUp || key > KeyF12 ) {
+		return "unknown";
+	}
+	return names[key - KeyUp];
+}
@@ -0,0 +1,52 @@
+#ifndef __ESCAPEPARSER_H
+#define __ESCAPEPARSER_H
+
+//Splits terminal input into characters and keys, following the VT100/ECMA-48
+//	input syntax: ESC sequences, CSI (ESC [ params intermediates final), SS3
+//	(ESC O final) and control strings (OSC, DCS, PM, APC) terminated by BEL,
+//	ESC \ or a line break. It is fed one byte at a time and keeps a few bytes
+//	of state, so sequences may be split across reads and can be of any length.
+//
+//	8-bit C1 controls aren't recognised, those bytes are UTF-8 more often.
+class EscapeParser {
+    public:
+	//Keys are reported above the range of characters
+	enum Key {
+		None = -1,
+		KeyUp = 0x100,
+		KeyDown,
+		KeyRight,
+		KeyLeft,
+		KeyHome,
+		KeyEnd,
+		KeyInsert,
+		KeyDelete,
+		KeyPageUp,
+		KeyPageDown,
+		KeyF1, KeyF2, KeyF3, KeyF4, KeyF5, KeyF6,
+		KeyF7, KeyF8, KeyF9, KeyF10, KeyF11, KeyF12
+	};
+
+	EscapeParser();
+
+	//Returns the character or Key c completes, or None while inside a sequence
+	int feed( unsigned char c );
+
+	//Whether the parser is outside of any sequence, so plain text can skip feed()
+	bool idle() const;
+
+	static const char* keyName( int key );
+
+    protected:
+	enum State { Ground, Escape, EscapeIntermediate, Csi, CsiIgnore, Ss3, String, StringEscape };
+	enum { MaxParams = 2 };
+
+	int csiKey( unsigned char final );
+	int ss3Key( unsigned char final );
+
+	unsigned char state;
+	unsigned char numParams;
+	unsigned short params[MaxParams];
+};
+
+#endif
@@ -0,0 +1,318 @@
+#include "TelnetNegotiation.h"
+
+#include <cstring>
+#include <cstdlib>
+#include <string>
+using namespace std;
+
+#include "TelnetOptions.h"
+#include "TelnetCommands.h"
+
+unsigned char TelnetNegotiation::policy[256];
+unsigned char TelnetNegotiation::slot[256];
+int TelnetNegotiation::numSlots = 0;
+string TelnetNegotiation::offers;
+
+//Slot of options the policy refuses
+static const unsigned char NO_SLOT = 0xff;
+
+//Subnegotiation codes we send when an option gets turned on
+static const unsigned char SB_SEND = 1;
+static const unsigned char LINEMODE_MODE = 1;
+
+struct OptionName {
+	const char* name;
+	unsigned char option;
+};
+
+static const OptionName optionNames[] = {
+	{ "binary", TELNET_OPTION_BINARY_TRANS },
+	{ "echo", TELNET_OPTION_ECHO },
+	{ "sga", TELNET_OPTION_SGA },
+	{ "status", TELNET_OPTION_STATUS },
+	{ "timing-mark", TELNET_OPTION_TIMING_MARK },
+	{ "logout", TELNET_OPTION_LOGOUT },
+	{ "ttype", TELNET_OPTION_TERM_TYPE },
+	{ "eor", TELNET_OPTION_EOR },
+	{ "naws", TELNET_OPTION_NEG_WINDOW_SIZE },
+	{ "tspeed", TELNET_OPTION_TERM_SPEED },
+	{ "lflow", TELNET_OPTION_REMOTE_FLOW_CONTROL },
+	{ "linemode", TELNET_OPTION_LINEMODE },
+	{ "xdisploc", TELNET_OPTION_X_DISP_LOCATION },
+	{ "environ", TELNET_OPTION_ENV },
+	{ "auth", TELNET_OPTION_AUTH },
+	{ "new-environ", TELNET_OPTION_NEW_ENV },
+	{ "charset", TELNET_OPTION_CHARSET },
+};
+
+int TelnetNegotiation::optionByName( const string& name ) {
+	for( size_t i = 0; i < sizeof(optionNames) / sizeof(optionNames[0]); i++ ) {
+		if( name == optionNames[i].name ) {
+			return optionNames[i].option;
+		}
+	}
+
+	//Anything else has to be the option number
+	char* end;
+	long option = strtol( name.c_str(), &end, 10 );
+	if( name.empty() || *end != '\0' || option < 0 || option > 255 ) {
+		return -1;
+	}
+	return option;
+}
+
+//Sets flag on every option named in list
+static void applyPolicy( const string& list, unsigned char flag, unsigned char* policy ) {
+	size_t pos = 0;
+	while( pos < list.size() ) {
+		size_t end = list.find_first_of( " ,", pos );
+		if( end == string::npos ) {
+			end = list.size();
+		}
+		string name = list.substr( pos, end - pos );
+		pos = end + 1;
+		if( name.empty() ) {
+			continue;
+		}
+
+		int option = TelnetNegotiation::optionByName( name );
+		if( option == -1 ) {
+			throw string("Unknown telnet option ") + name;
+		}
+		policy[option] |= flag;
+	}
+}
+
+void TelnetNegotiation::setPolicy( const string& will, const string& allowWill, const string& doOptions, const string& allowDo ) {
+	memset( policy, 0, sizeof(policy) );
+	applyPolicy( will, OfferLocal | AllowLocal, policy );
+	applyPolicy( allowWill, AllowLocal, policy );
+	applyPolicy( doOptions, OfferRemote | AllowRemote, policy );
+	applyPolicy( allowDo, AllowRemote, policy );
+
+	//Give every allowed option a slot, and render the offers in one buffer
+	numSlots = 0;
+	offers.clear();
+	for( int option = 0; option < 256; option++ ) {
+		slot[option] = NO_SLOT;
+		if( policy[option] == 0 ) {
+			continue;
+		}
+		if( numSlots == MaxAllowed ) {
+			throw string("Too many telnet options allowed");
+		}
+		slot[option] = numSlots++;
+
+		if( policy[option] & OfferRemote ) {
+			offers += (char)TELNET_COMMAND_IAC;
+			offers += (char)TELNET_COMMAND_DO;
+			offers += (char)option;
+		}
+		if( policy[option] & OfferLocal ) {
+			offers += (char)TELNET_COMMAND_IAC;
+			offers += (char)TELNET_COMMAND_WILL;
+			offers += (char)option;
+		}
+	}
+}
+
+const string& TelnetNegotiation::initialOffers() {
+	return offers;
+}
+
+TelnetNegotiation::TelnetNegotiation() {
+	numErrors = 0;
+
+	//The initial offers are on their way, so those options are awaiting an answer
+	for( int option = 0; option < 256; option++ ) {
+		if( slot[option] == NO_SLOT ) {
+			continue;
+		}
+		states[slot[option]] = 0;
+		if( policy[option] & OfferLocal ) {
+			setSide( option, LocalShift, WantYes, false );
+		}
+		if( policy[option] & OfferRemote ) {
+			setSide( option, RemoteShift, WantYes, false );
+		}
+	}
+}
+
+int TelnetNegotiation::sideState( unsigned char option, int shift ) const {
+	if( slot[option] == NO_SLOT ) {
+		return No;
+	}
+	return ( states[slot[option]] >> shift ) & 3;
+}
+
+void TelnetNegotiation::setSide( unsigned char option, int shift, int state, bool queued ) {
+	unsigned char& s = states[slot[option]];
+	s &= ~( 7 << shift );
+	s |= ( state | ( queued ? QueueBit : 0 ) ) << shift;
+}
+
+//Writes IAC cmd option
+static size_t command( unsigned char* reply, unsigned char cmd, unsigned char option ) {
+	reply[0] = TELNET_COMMAND_IAC;
+	reply[1] = cmd;
+	reply[2] = option;
+	return 3;
+}
+
+//What we send to turn a side on or off
+static unsigned char verb( int shift, bool positive ) {
+	if( shift == 0 ) {
+		return positive ? TELNET_COMMAND_WILL : TELNET_COMMAND_WONT;
+	}
+	return positive ? TELNET_COMMAND_DO : TELNET_COMMAND_DONT;
+}
+
+size_t TelnetNegotiation::received( unsigned char cmd, unsigned char option, unsigned char* reply ) {
+	switch( cmd ) {
+		case TELNET_COMMAND_DO: return receivedSide( option, LocalShift, true, reply );
+		case TELNET_COMMAND_DONT: return receivedSide( option, LocalShift, false, reply );
+		case TELNET_COMMAND_WILL: return receivedSide( option, RemoteShift, true, reply );
+		case TELNET_COMMAND_WONT: return receivedSide( option, RemoteShift, false, reply );
+		default: return 0;
+	}
+}
+
+size_t TelnetNegotiation::receivedSide( unsigned char option, int shift, bool positive, unsigned char* reply ) {
+	unsigned char allow = ( shift == LocalShift ) ? AllowLocal : AllowRemote;
+
+	//Refused options are always NO, turn them down and never answer a refusal
+	if( slot[option] == NO_SLOT || !( policy[option] & allow ) ) {
+		return positive ? command( reply, verb(shift, false), option ) : 0;
+	}
+
+	int s = ( states[slot[option]] >> shift ) & 7;
+	int state = s & 3;
+	bool queued = ( s & QueueBit ) != 0;
+
+	if( positive ) {
+		switch( state ) {
+			case No:
+				setSide( option, shift, Yes, false );
+				return command( reply, verb(shift, true), option ) + enabled( option, shift, reply + 3 );
+			case Yes:
+				return 0;
+			case WantNo:
+				//They answered our refusal with an offer
+				numErrors++;
+				setSide( option, shift, queued ? Yes : No, false );
+				return queued ? enabled( option, shift, reply ) : 0;
+			case WantYes:
+				if( queued ) {
+					setSide( option, shift, WantNo, false );
+					return command( reply, verb(shift, false), option );
+				}
+				setSide( option, shift, Yes, false );
+				return enabled( option, shift, reply );
+		}
+	} else {
+		switch( state ) {
+			case No:
+				return 0;
+			case Yes:
+				setSide( option, shift, No, false );
+				return command( reply, verb(shift, false), option );
+			case WantNo:
+				if( queued ) {
+					setSide( option, shift, WantYes, false );
+					return command( reply, verb(shift, true), option );
+				}
+				setSide( option, shift, No, false );
+				return 0;
+			case WantYes:
+				setSide( option, shift, No, false );
+				return 0;
+		}
+	}
+	return 0;
+}
+
+size_t TelnetNegotiation::requestLocal( unsigned char option, bool enable, unsigned char* reply ) {
+	return requestSide( option, LocalShift, enable, reply );
+}
+
+size_t TelnetNegotiation::requestRemote( unsigned char option, bool enable, unsigned char* reply ) {
+	return requestSide( option, RemoteShift, enable, reply );
+}
+
+size_t TelnetNegotiation::requestSide( unsigned char option, int shift, bool enable, unsigned char* reply ) {
+	//We don't ask for what the policy would refuse
+	if( slot[option] == NO_SLOT ) {
+		return 0;
+	}
+
+	int state = ( states[slot[option]] >> shift ) & 3;
+
+	switch( state ) {
+		case No:
+			if( enable ) {
+				setSide( option, shift, WantYes, false );
+				return command( reply, verb(shift, true), option );
+			}
+			return 0;
+		case Yes:
+			if( !enable ) {
+				setSide( option, shift, WantNo, false );
+				return command( reply, verb(shift, false), option );
+			}
+			return 0;
+		case WantNo:
+			//Ask again once the current negotiation is over
+			setSide( option, shift, WantNo, enable );
+			return 0;
+		case WantYes:
+			setSide( option, shift, WantYes, !enable );
+			return 0;
+	}
+	return 0;
+}
+
+size_t TelnetNegotiation::enabled( unsigned char option, int shift, unsigned char* reply ) {
+	if( shift != RemoteShift ) {
+		return 0;
+	}
+
+	unsigned char* p = reply;
+	switch( option ) {
+		case TELNET_OPTION_LINEMODE:
+			//An empty mode mask, this way characters are sent as the user types them without
+			//	allowing remote editing, which totally screws up local echo
+			*p++ = TELNET_COMMAND_IAC;
+			*p++ = TELNET_COMMAND_SB;
+			*p++ = TELNET_OPTION_LINEMODE;
+			*p++ = LINEMODE_MODE;
+			*p++ = 0;
+			*p++ = TELNET_COMMAND_IAC;
+			*p++ = TELNET_COMMAND_SE;
+			break;
+
+		case TELNET_OPTION_TERM_TYPE:
+		case TELNET_OPTION_NEW_ENV:
+			//Ask for the terminal type, or all of the environment
+			*p++ = TELNET_COMMAND_IAC;
+			*p++ = TELNET_COMMAND_SB;
+			*p++ = option;
+			*p++ = SB_SEND;
+			*p++ = TELNET_COMMAND_IAC;
+			*p++ = TELNET_COMMAND_SE;
+			break;
+	}
+	return p - reply;
+}
+
+bool TelnetNegotiation::localEnabled( unsigned char option ) const {
+	int state = sideState( option, LocalShift );
+	return state == Yes || state == WantYes;
+}
+
+bool TelnetNegotiation::remoteEnabled( unsigned char option ) const {
+	return sideState( option, RemoteShift ) == Yes;
+}
+
+int TelnetNegotiation::errors() const {
+	return numErrors;
+}
@@ -0,0 +1,76 @@
+#ifndef __TELNETNEGOTIATION_H
+#define __TELNETNEGOTIATION_H
+
+#include <string>
+using namespace std;
+
+//Option negotiation following the Q method of RFC 1143, which can't loop no
+//	matter what the client sends. Each option has a state for our side
+//	(WILL/WONT) and the client's side (DO/DONT).
+//
+//	What we agree to comes from a process wide policy. Options the policy
+//	refuses never leave the NO state, so they need no state at all: only the
+//	options the policy allows get a slot, one byte each, which keeps a
+//	session's negotiation state to a few dozen bytes while every one of the
+//	256 options is still answered properly.
+class TelnetNegotiation {
+    public:
+	//Most options the policy can allow
+	enum { MaxAllowed = 24 };
+
+	//Largest reply a single received command or request can produce
+	enum { MaxReply = 32 };
+
+	//Set the policy from lists of option names or numbers, separated by
+	//	spaces or commas. will/doOptions are offered when the session
+	//	starts, allowWill/allowDo are only agreed to when the client asks.
+	static void setPolicy( const string& will, const string& allowWill, const string& doOptions, const string& allowDo );
+
+	//The offers every session starts with, as one buffer
+	static const string& initialOffers();
+
+	//Parse an option name such as "echo", "naws" or "34", -1 if unknown
+	static int optionByName( const string& name );
+
+	TelnetNegotiation();
+
+	//Handle a received WILL, WONT, DO or DONT, writing the reply (if any) to
+	//	reply and returning its length
+	size_t received( unsigned char cmd, unsigned char option, unsigned char* reply );
+
+	//Ask to turn an option on or off on our side (local) or the client's
+	size_t requestLocal( unsigned char option, bool enable, unsigned char* reply );
+	size_t requestRemote( unsigned char option, bool enable, unsigned char* reply );
+
+	//Whether the option is on, or has been offered and not refused yet
+	bool localEnabled( unsigned char option ) const;
+	bool remoteEnabled( unsigned char option ) const;
+
+	//Protocol errors seen, e.g. answers to questions we never asked
+	int errors() const;
+
+    protected:
+	enum State { No = 0, Yes = 1, WantNo = 2, WantYes = 3 };
+
+	//A side is two bits of State plus a queue bit, which is set when the
+	//	opposite of the current negotiation was requested meanwhile
+	enum { LocalShift = 0, RemoteShift = 3, QueueBit = 4 };
+
+	int sideState( unsigned char option, int shift ) const;
+	void setSide( unsigned char option, int shift, int state, bool queued );
+	size_t receivedSide( unsigned char option, int shift, bool positive, unsigned char* reply );
+	size_t requestSide( unsigned char option, int shift, bool enable, unsigned char* reply );
+	size_t enabled( unsigned char option, int shift, unsigned char* reply );
+
+	unsigned char states[MaxAllowed];
+	unsigned char numErrors;
+
+	//Per option: which policy flags apply, and its slot in states
+	enum { OfferLocal = 1, AllowLocal = 2, OfferRemote = 4, AllowRemote = 8 };
+	static unsigned char policy[256];
+	static unsigned char slot[256];
+	static int numSlots;
+	static string offers;
+};
+
+#endif
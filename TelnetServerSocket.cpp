@@ -1,236 +1,406 @@
 #include "TelnetServerSocket.h"
 
 #include <map>
-#include <sstream>
 #include <string>
-#include <deque>
+#include <cstring>
 using namespace std;
 
 #include "logger.h"
+#include "stats.h"
+#include "inputscan.h"
+#include "persona.h"
 #include "TelnetOptions.h"
 #include "TelnetCommands.h"
 
-TelnetServerSocket::TelnetServerSocket( int port ) : ServerSocket( port ) {
-	localEcho = -1;
-	peerEcho = -1;
+size_t TelnetServerSocket::maxLineLength = 512;
+
+TelnetServerSocket::TelnetServerSocket( int port ) : ServerSocket( port ), persona( NULL ) {
 }
 
 TelnetServerSocket::~TelnetServerSocket() {
+	if( negotiation.errors() > 0 ) {
+		Stats::increment( Stats::NegotiationErrors, negotiation.errors() );
+	}
 }
 
-unsigned char TelnetServerSocket::getChar() {
-	unsigned char c; //Return value
-	deque<unsigned char> history; //We will store a log of characters received here
-	deque<unsigned char> rawHistory; //We will store a log of characters received here, even control codes
+int TelnetServerSocket::getKey() {
+	unsigned char c; //Byte read
+	
+	//The session's first read sends the greeting, unless a hook already
+	//	made it go out, and then waits for the peer
+	bool first = !trace.reached( Trace::FirstByte );
+	if( first && !trace.reached(Trace::Greeting) ) {
+		flush();
+		trace.mark( Trace::Greeting );
+	}
 	
 	while( true ) {
 		//Read a character from the stream
 		(*this) >> c;
-		rawHistory.push_front( c );
+		if( first ) {
+			trace.mark( Trace::FirstByte );
+			first = false;
+		}
 		
 		//Handle telnet IAC's
 		if( c == TELNET_COMMAND_IAC ) {
-			//Build a debug string for this telnet command
-			stringstream debugStr;
-			debugStr << "received control code: IAC ";
-			
-			//Read the command byte
+			//Read the command byte, and remember which option it was about for the debug log
 			unsigned char cmd;
 			(*this) >> cmd;
-			debugStr << telnetCommandAsStr(cmd);
+			int option = -1;
 			
 			//These commands will send a 3rd byte, the argument
 			unsigned char arg = 0;
 			if( cmd == TELNET_COMMAND_DO || cmd == TELNET_COMMAND_DONT || cmd == TELNET_COMMAND_WILL || cmd == TELNET_COMMAND_WONT ) {
 				//Read the arg
 				(*this) >> arg;
-				debugStr << " " << telnetOptionAsStr(arg);
+				option = arg;
 				
-				//Handle echo negociation
-				if( arg == TELNET_OPTION_ECHO ) {
-					switch( cmd ) {
-						case TELNET_COMMAND_WONT:
-							setPeerEcho( false );
-							break;
-						case TELNET_COMMAND_WILL:
-							setPeerEcho( true );
-							break;
-						
-						case TELNET_COMMAND_DO:
-							setLocalEcho( true );
-							break;
-						
-						case TELNET_COMMAND_DONT:
-							setLocalEcho( false );
-							break;
-					}
-				}
-				
-				if( arg == TELNET_OPTION_LINEMODE && cmd == TELNET_COMMAND_WILL ) {
+				//Let the negotiation engine answer, the reply goes out with our next write
+				unsigned char reply[TelnetNegotiation::MaxReply];
+				size_t replyLength = negotiation.received( cmd, arg, reply );
+				if( replyLength > 0 ) {
+					defer( (const char*)reply, replyLength );
 				}
 			}
 
 			//Handle subparam negociations
 			if( cmd == TELNET_COMMAND_SB ) {
-				vector<unsigned char> sbSequence;
+				//Collect the sequence into a fixed buffer, anything past its end is dropped
+				unsigned char sbSequence[MAX_SB_LENGTH];
+				size_t sbLength = 0;
+				bool escaped = false;
 				while( true ) {
 					unsigned char sbParam;
 					*this >> sbParam;
-					sbSequence.push_back( sbParam );
-					rawHistory.push_front( sbParam );
-
-					//When we see 'IAC SE' the negociation sequence is over
-					if( rawHistory[1] == TELNET_COMMAND_IAC && rawHistory[0] == TELNET_COMMAND_SE ) {
-						//Pull 'IAC SE' out of the sbSequence, our handlers don't care about this
-						sbSequence.erase( sbSequence.end()-1 );
-						sbSequence.erase( sbSequence.end()-2 );
-						break;
+
+					if( escaped ) {
+						escaped = false;
+						
+						//When we see 'IAC SE' the negociation sequence is over, 'IAC IAC' is a 255 data byte
+						if( sbParam == TELNET_COMMAND_SE ) {
+							break;
+						}
+						if( sbParam != TELNET_COMMAND_IAC ) {
+							continue;
+						}
+					} else if( sbParam == TELNET_COMMAND_IAC ) {
+						escaped = true;
+						continue;
+					}
+
+					if( sbLength < MAX_SB_LENGTH ) {
+						sbSequence[sbLength++] = sbParam;
 					}
 				}
 
-				if( sbSequence[0] == TELNET_OPTION_LINEMODE ) {
-					sbSequence.erase( sbSequence.begin() );
-					handleSbLinemode( sbSequence );
+				if( sbLength > 0 ) {
+					option = sbSequence[0];
+					handleSb( sbSequence, sbLength );
 				}
 			}
 			
 			//Send the debug message to the log
-			Logger::debug() << debugStr.str() << endl;
-		} else {
-			//Put this character into the history log
-			history.push_front( c );
-			
-			//Handle escape sequences
-			if( c == 27 ) {
-				continue;
-			}
-			
-			if( history[1] == 27 ) {
-				continue;
-			}
-			
-			if( history[1] == '[' && history[2] == 27 ) {
-				continue;
-			}
-			
-			if( history[1] == '1' && history[2] == '[' && history[3] == 27 ) {
-				continue;
-			}
-			
-			if( history[2] == '1' && history[3] == '[' && history[4] == 27 ) {
-				continue;
-			}
-			
-			if( history[1] == '3' && history[2] == '[' && history[3] == 27 ) {
-				continue;
+			if( option != -1 ) {
+				LOG_DEBUG( "received control code: IAC {} {}", telnetCommandAsStr(cmd), telnetOptionAsStr(option) );
+			} else {
+				LOG_DEBUG( "received control code: IAC {}", telnetCommandAsStr(cmd) );
 			}
-			
-			if( history[1] == 'O' && history[2] == 27 ) {
-				continue;
+		} else {
+			//Run it through the escape sequence parser, which tells us when there's a character or key
+			int key = escapes.feed( c );
+			if( key != EscapeParser::None ) {
+				return key;
 			}
-			//End handling escape sequences
-			
-			//Return the character
-			return c;
 		}
 	}
 }
 
-string TelnetServerSocket::getLine( bool hidden ) {
-	string line; //The return value
+unsigned char TelnetServerSocket::getChar() {
 	while( true ) {
-		//Get a formatted character
-		unsigned char c = getChar();
+		int key = getKey();
+		if( key < EscapeParser::KeyUp ) {
+			return key;
+		}
+	}
+}
+
+void TelnetServerSocket::getLine( ArenaString& line, bool hidden ) {
+	line.clear();
+	
+	//Where in the line characters are inserted and erased
+	size_t cursor = 0;
+	
+	//Remember whether we've already counted this line as truncated
+	bool truncated = false;
+	
+	while( true ) {
+		bool echo = getLocalEcho() && !hidden;
 		
-		//Remember whether or not we erased a character from the line
-		bool erasedChar = false;
+		//Plain text typed at the end of the line is copied out of the receive
+		//	buffer in runs, only the bytes InputScan flags go through getKey()
+		if( cursor == line.size() && escapes.idle() && line.size() < maxLineLength ) {
+			const char* data;
+			size_t length = buffered( data );
+			if( length > maxLineLength - line.size() ) {
+				length = maxLineLength - line.size();
+			}
+			size_t run = InputScan::findSpecial( data, length );
+			if( run > 0 ) {
+				line.append( data, run );
+				if( echo ) {
+					defer( data, run );
+				}
+				consume( run );
+				cursor += run;
+				continue;
+			}
+		}
+		
+		//Get a character or key
+		int c = getKey();
 		
 		//Handle line endings
 		if( c == '\r' ) {
 			//Read another character after we receive \r, because telnet always does either \r\n or \r\0
-			(*this) >> c;
+			unsigned char next;
+			(*this) >> next;
 			
 			//If we are supposed to be doing the echo'ing, send end-of-line to the client
+			//	along with whatever we send next, usually the prompt
 			if( getLocalEcho() ) {
-				(*this) << "\r\n";
+				defer( "\r\n" );
 			}
 			
 			//Since we received end-of-line, return the string as it is
-			return line;
-		} else {
-			//Handle backspace and ^H
-			if( c == 127 || c == 8 ) {
-				//Replace the last character in the line with nothing
-				if( !line.empty() ) {
-					line.replace( line.size()-1, 1, "" );
-					erasedChar = true;
-				}
-			} else {
-				//Add the character to the end of line
-				line += c;
-			}
+			return;
 		}
 		
-		if( getLocalEcho() && !hidden ) {
-			//Handle character erasing (backspace) by moving left, printing a space, and moving left again
-			// This is either the way it's supposed to be done or a hack, I couldn't find any info on
-			// "the right way" to do backspaces so I have no clue.
-			if( erasedChar ) {
-				(*this) << '\x08' << ' ' << '\x08';
-			} else if( c != 127 && c != 8 ) {
-				//If this has nothing to do with backspaces than echo the character
-				(*this) << c;
-			}
+		//The echo is deferred so a pasted line is echoed with one send once
+		//	the buffered input runs dry, rather than one send per character.
+		//	Edits in the middle of the line redraw the rest of it and move
+		//	the cursor back with backspaces, which every terminal understands.
+		switch( c ) {
+			case 127:
+			case 8:
+				//Handle backspace and ^H by removing the character left of the cursor
+				if( cursor > 0 ) {
+					cursor--;
+					line.erase( cursor, 1 );
+					if( echo ) {
+						defer( "\x08" );
+						redrawTail( line, cursor, 1 );
+					}
+				}
+				break;
+			
+			case EscapeParser::KeyDelete:
+				if( cursor < line.size() ) {
+					line.erase( cursor, 1 );
+					if( echo ) {
+						redrawTail( line, cursor, 1 );
+					}
+				}
+				break;
+			
+			case EscapeParser::KeyLeft:
+				if( cursor > 0 ) {
+					cursor--;
+					if( echo ) {
+						defer( "\x08" );
+					}
+				}
+				break;
+			
+			case EscapeParser::KeyRight:
+				if( cursor < line.size() ) {
+					//Moving right is printing the character we move over
+					if( echo ) {
+						defer( line.data() + cursor, 1 );
+					}
+					cursor++;
+				}
+				break;
+			
+			case EscapeParser::KeyHome:
+				if( echo ) {
+					for( ; cursor > 0; cursor-- ) {
+						defer( "\x08" );
+					}
+				}
+				cursor = 0;
+				break;
+			
+			case EscapeParser::KeyEnd:
+				if( echo && cursor < line.size() ) {
+					defer( line.data() + cursor, line.size() - cursor );
+				}
+				cursor = line.size();
+				break;
+			
+			default:
+				//The fake shell has no history or completion, other keys do nothing
+				if( c >= EscapeParser::KeyUp ) {
+					LOG_DEBUG( "ignoring key {}", EscapeParser::keyName( c ) );
+					break;
+				}
+				
+				//Drop anything past the maximum line length, without echoing it
+				if( line.size() >= maxLineLength ) {
+					if( !truncated ) {
+						Stats::increment( Stats::LinesTruncated );
+						truncated = true;
+					}
+					break;
+				}
+				
+				line.insert( cursor, 1, (char)c );
+				cursor++;
+				if( echo ) {
+					defer( line.data() + cursor - 1, 1 );
+					redrawTail( line, cursor, 0 );
+				}
+				break;
 		}
 	}
 }
 
-TelnetServerSocket* TelnetServerSocket::accept() {
-	//Create an unbinded TelnetServerSocket
-	TelnetServerSocket* sock = new TelnetServerSocket( -1 );
+void TelnetServerSocket::redrawTail( const ArenaString& line, size_t cursor, size_t erased ) {
+	size_t tail = line.size() - cursor;
+	if( tail == 0 && erased == 0 ) {
+		return;
+	}
+	
+	//Print the rest of the line, blank out what it used to cover, and go back to the cursor
+	defer( line.data() + cursor, tail );
+	for( size_t i = 0; i < erased; i++ ) {
+		defer( " " );
+	}
+	for( size_t i = 0; i < tail + erased; i++ ) {
+		defer( "\x08" );
+	}
+}
+
+TelnetServerSocket* TelnetServerSocket::accept( int wakeFd ) {
+	//Create an unbinded TelnetServerSocket, in the arena the session will use
+	TelnetServerSocket* sock = new( SessionArena::acquire() ) TelnetServerSocket( -1 );
 	
 	//Accept a connection, using the socket we created
-	ServerSocket::accept( sock );
+	try {
+		if( ServerSocket::accept( sock, wakeFd ) == NULL ) {
+			delete sock;
+			return NULL;
+		}
+		sock->persona = persona;
+		sock->trace.start();
+	} catch(...) {
+		delete sock;
+		throw;
+	}
 	
 	//Return the socket
 	return sock;
 }
 
+//Every TelnetServerSocket is preceded by a header naming the arena it lives
+//	in, or NULL when it came from the heap
+static const size_t ARENA_HEADER = 16;
+
+void* TelnetServerSocket::operator new( size_t size ) {
+	char* mem = (char*) ::operator new( size + ARENA_HEADER );
+	*(SessionArena**)mem = NULL;
+	return mem + ARENA_HEADER;
+}
+
+void* TelnetServerSocket::operator new( size_t size, SessionArena* arena ) {
+	char* mem = (char*) arena->allocate( size + ARENA_HEADER );
+	*(SessionArena**)mem = arena;
+	return mem + ARENA_HEADER;
+}
+
+void TelnetServerSocket::operator delete( void* p ) {
+	if( p == NULL ) {
+		return;
+	}
+	
+	char* mem = (char*)p - ARENA_HEADER;
+	SessionArena* arena = *(SessionArena**)mem;
+	if( arena != NULL ) {
+		//The connection is gone, so is everything else the session allocated
+		SessionArena::release( arena );
+	} else {
+		::operator delete( mem );
+	}
+}
+
+void TelnetServerSocket::operator delete( void* p, SessionArena* arena ) {
+	SessionArena::release( arena );
+}
+
+SessionArena* TelnetServerSocket::getArena() {
+	return *(SessionArena**)( (char*)this - ARENA_HEADER );
+}
+
+void TelnetServerSocket::setMaxLineLength( size_t length ) {
+	maxLineLength = length;
+}
+
 void TelnetServerSocket::setPeerEcho( bool val ) {
-	if( (int)val != peerEcho || peerEcho == -1 ) {
-		if( val ) {
-			(*this) << TELNET_COMMAND_IAC << TELNET_COMMAND_DO << TELNET_OPTION_ECHO;
-		} else {
-			(*this) << TELNET_COMMAND_IAC << TELNET_COMMAND_DONT << TELNET_OPTION_ECHO;
-		}
-		peerEcho = val;
+	unsigned char request[TelnetNegotiation::MaxReply];
+	size_t length = negotiation.requestRemote( TELNET_OPTION_ECHO, val, request );
+	if( length > 0 ) {
+		defer( (const char*)request, length );
 	}
 }
 
 void TelnetServerSocket::setLocalEcho( bool val ) {
-	if( (int)val != localEcho || localEcho == -1 ) {
-		if( val ) {
-			(*this) << TELNET_COMMAND_IAC << TELNET_COMMAND_WILL << TELNET_OPTION_ECHO;
-		} else {
-			(*this) << TELNET_COMMAND_IAC << TELNET_COMMAND_WONT << TELNET_OPTION_ECHO;
-		}
-		localEcho = val;
+	unsigned char request[TelnetNegotiation::MaxReply];
+	size_t length = negotiation.requestLocal( TELNET_OPTION_ECHO, val, request );
+	if( length > 0 ) {
+		defer( (const char*)request, length );
 	}
 }
 
 bool TelnetServerSocket::getLocalEcho() {
-	return (bool) localEcho;
+	return negotiation.localEnabled( TELNET_OPTION_ECHO );
 }
 
 bool TelnetServerSocket::getPeerEcho() {
-	return (bool) peerEcho;
+	return negotiation.remoteEnabled( TELNET_OPTION_ECHO );
 }
 
 void TelnetServerSocket::requestLineModeNegociation() {
-	*this << TELNET_COMMAND_IAC << TELNET_COMMAND_DO << TELNET_OPTION_LINEMODE;
+	unsigned char request[TelnetNegotiation::MaxReply];
+	size_t length = negotiation.requestRemote( TELNET_OPTION_LINEMODE, true, request );
+	if( length > 0 ) {
+		defer( (const char*)request, length );
+	}
+}
+
+void TelnetServerSocket::handleSb( const unsigned char* sbSequence, size_t sbLength ) {
+	//Only listen to subnegotiations of options the client agreed to
+	unsigned char option = sbSequence[0];
+	if( !negotiation.remoteEnabled(option) ) {
+		return;
+	}
+	
+	switch( option ) {
+		case TELNET_OPTION_LINEMODE:
+			handleSbLinemode( sbSequence+1, sbLength-1 );
+			break;
+		case TELNET_OPTION_NEG_WINDOW_SIZE:
+			handleSbNaws( sbSequence+1, sbLength-1 );
+			break;
+		case TELNET_OPTION_TERM_TYPE:
+			handleSbTerminalType( sbSequence+1, sbLength-1 );
+			break;
+		case TELNET_OPTION_NEW_ENV:
+			handleSbEnviron( sbSequence+1, sbLength-1 );
+			break;
+	}
 }
 
-void TelnetServerSocket::handleSbLinemode( const vector<unsigned char>& sbSequence ) {
+void TelnetServerSocket::handleSbLinemode( const unsigned char* sbSequence, size_t sbLength ) {
 	enum LineModeCommands {
 		LINEMODE_MODE = 1,
 		LINEMODE_FORWARDMASK = 2,
@@ -245,15 +415,81 @@ void TelnetServerSocket::handleSbLinemode( const vector<unsigned char>& sbSequen
 		MODE_LIT_ECHO = 16,
 	};
 	
-	//Request an empty mode mask, this way characters are sent as the user types them without allowing remote editing, which totally screws up local echo
-	unsigned char requestedMode = 0;
-	*this << TELNET_COMMAND_IAC << TELNET_COMMAND_SB << TELNET_OPTION_LINEMODE << LINEMODE_MODE << requestedMode << TELNET_COMMAND_IAC << TELNET_COMMAND_SE;
-	return;
+	//The empty mode mask was requested when LINEMODE got enabled. Never answer a
+	//	MODE here: a client proposing a different mode would get ours back, and
+	//	could answer that in turn, forever.
+	if( sbLength >= 2 && sbSequence[0] == LINEMODE_MODE ) {
+		LOG_DEBUG( "client linemode mode {}{}", (int)sbSequence[1], ( (sbSequence[1] & MODE_ACK) ? " (ack)" : "" ) );
+	}
+}
+
+void TelnetServerSocket::handleSbNaws( const unsigned char* sbSequence, size_t sbLength ) {
+	//Width and height, 16 bits each
+	if( sbLength < 4 ) {
+		return;
+	}
+	int width = ( sbSequence[0] << 8 ) | sbSequence[1];
+	int height = ( sbSequence[2] << 8 ) | sbSequence[3];
+	LOG_INFO( "{} window size {}x{}", addressAsString(), width, height );
+}
+
+void TelnetServerSocket::handleSbTerminalType( const unsigned char* sbSequence, size_t sbLength ) {
+	enum { TTYPE_IS = 0 };
+	
+	if( sbLength < 1 || sbSequence[0] != TTYPE_IS ) {
+		return;
+	}
+	LOG_INFO( "{} terminal type {}", addressAsString(), string( (const char*)sbSequence+1, sbLength-1 ) );
+}
+
+void TelnetServerSocket::handleSbEnviron( const unsigned char* sbSequence, size_t sbLength ) {
+	enum { ENV_IS = 0, ENV_INFO = 2 };
+	enum { ENV_VAR = 0, ENV_VALUE = 1, ENV_ESC = 2, ENV_USERVAR = 3 };
+	
+	if( sbLength < 1 || (sbSequence[0] != ENV_IS && sbSequence[0] != ENV_INFO) ) {
+		return;
+	}
+	
+	//A list of VAR or USERVAR name, optionally followed by VALUE value, ESC quotes the next byte
+	string variables;
+	for( size_t i = 1; i < sbLength; i++ ) {
+		unsigned char c = sbSequence[i];
+		if( c == ENV_VAR || c == ENV_USERVAR ) {
+			if( !variables.empty() ) {
+				variables += ' ';
+			}
+		} else if( c == ENV_VALUE ) {
+			variables += '=';
+		} else {
+			if( c == ENV_ESC && i + 1 < sbLength ) {
+				c = sbSequence[++i];
+			}
+			variables += c;
+		}
+	}
+	LOG_INFO( "{} environment {}", addressAsString(), variables );
+}
+
+void TelnetServerSocket::setPersona( const Persona* persona ) {
+	this->persona = persona;
+}
+
+const Persona* TelnetServerSocket::getPersona() {
+	return persona;
+}
+
+Trace& TelnetServerSocket::getTrace() {
+	return trace;
 }
 
 void TelnetServerSocket::init() {
-	requestLineModeNegociation();
-	setPeerEcho( false );
-	setLocalEcho( true );
+	//Queue the shared negotiation and banner, it goes out with the first prompt
+	defer_shared( persona->greeting );
+}
+
+void TelnetServerSocket::sendPrompt( const PromptTemplate& prompt, const char* value ) {
+	defer( prompt.prefix );
+	defer( value, strlen(value) );
+	defer( prompt.suffix );
 }
 
@@ -7,18 +7,54 @@
 using namespace std;
 
 #include "libsocket++/ServerSocket.h"
+#include "arena.h"
 #include "TelnetOptions.h"
 #include "TelnetCommands.h"
+#include "TelnetNegotiation.h"
+#include "EscapeParser.h"
+#include "trace.h"
+
+class Persona;
+
+//A prompt made of a fixed prefix and suffix around a per-session value,
+//	e.g. "C:\Documents and Settings\" + username + ">"
+struct PromptTemplate {
+	string prefix;
+	string suffix;
+};
 
 class TelnetServerSocket : public ServerSocket {
 	public:
 		TelnetServerSocket( int port = 23 );
 		virtual ~TelnetServerSocket();
 		
+		//Read the next character or EscapeParser::Key, with telnet commands
+		//	handled and other escape sequences dropped
+		int getKey();
+		
+		//Like getKey(), skipping the keys
 		unsigned char getChar();
-		string getLine( bool hidden=false );
 		
-		TelnetServerSocket* accept();
+		//Read a line into line, reusing its storage. The cursor keys, home,
+		//	end and delete edit it. Characters past the maximum line length
+		//	are dropped.
+		void getLine( ArenaString& line, bool hidden=false );
+		static void setMaxLineLength( size_t length );
+		
+		//The returned connection lives in its own SessionArena, which is
+		//	returned to the pool when the connection is deleted, and has the
+		//	persona of the listening socket. Returns NULL if woken through
+		//	wakeFd first.
+		TelnetServerSocket* accept( int wakeFd=-1 );
+		SessionArena* getArena();
+		
+		//The timing of the session's stages, started when it was accepted
+		Trace& getTrace();
+		
+		static void* operator new( size_t size );
+		static void* operator new( size_t size, SessionArena* arena );
+		static void operator delete( void* p );
+		static void operator delete( void* p, SessionArena* arena );
 		
 		static enum {
 			BELL=7,
@@ -34,13 +70,33 @@ class TelnetServerSocket : public ServerSocket {
 		void setLocalEcho( bool val );
 		bool getLocalEcho();
 		bool getPeerEcho();
+		//Queue the greeting of the persona, which every session shares
 		void init();
+		void sendPrompt( const PromptTemplate& prompt, const char* value="" );
+		
+		//Set on a listening socket, the connections it accepts get it too
+		void setPersona( const Persona* persona );
+		const Persona* getPersona();
 
 		void requestLineModeNegociation();
-		void handleSbLinemode( const vector<unsigned char>& sbSequence );
+		void handleSb( const unsigned char* sbSequence, size_t sbLength );
+		void handleSbLinemode( const unsigned char* sbSequence, size_t sbLength );
+		void handleSbNaws( const unsigned char* sbSequence, size_t sbLength );
+		void handleSbTerminalType( const unsigned char* sbSequence, size_t sbLength );
+		void handleSbEnviron( const unsigned char* sbSequence, size_t sbLength );
 	protected:
-		int peerEcho;
-		int localEcho;
+		//Echo the line from the cursor on, over erased characters that were past its end
+		void redrawTail( const ArenaString& line, size_t cursor, size_t erased );
+		
+		TelnetNegotiation negotiation;
+		EscapeParser escapes;
+		const Persona* persona;
+		Trace trace;
+		
+		static size_t maxLineLength;
+		
+		//getKey() drops subnegotiation bytes beyond MAX_SB_LENGTH
+		enum { MAX_SB_LENGTH = 256 };
 };
 
 #endif
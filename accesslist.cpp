@@ -0,0 +1,388 @@
+#include "accesslist.h"
+
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "logger.h"
+
+typedef unsigned __int128 Key;
+
+//Bits resolved by the direct table, and by each node below it
+static const int DIRECT_BITS = 16;
+static const int STRIDE = 6;
+
+//A direct entry with this bit set holds a rule, otherwise a node index
+static const unsigned int LEAF = 0x80000000;
+
+enum Family { V4, V6, NumFamilies };
+
+//vector marks the children that are nodes, found at base1, the others are
+//	leaves at base0. leafvec marks where a run of equal leaves starts.
+struct Node {
+	unsigned long long vector;
+	unsigned long long leafvec;
+	unsigned int base0;
+	unsigned int base1;
+};
+
+//Rule 0 stands for no rule
+struct AccessList::Table {
+	vector<unsigned int> direct[NumFamilies];
+	vector<Node> nodes;
+	vector<unsigned short> leaves;
+	vector<string> networks;
+	vector<Action> actions;
+	long* hits;
+
+	unsigned short find( int family, Key key ) const;
+};
+
+string AccessList::path;
+AccessList::Table* volatile AccessList::current = NULL;
+vector<AccessList::Table*> AccessList::retired;
+volatile long AccessList::readers = 0;
+volatile sig_atomic_t AccessList::reloadRequested = 0;
+
+unsigned short AccessList::Table::find( int family, Key key ) const {
+	unsigned int entry = direct[family][(unsigned int)( key >> (128 - DIRECT_BITS) )];
+	if( entry & LEAF ) {
+		return entry & ~LEAF;
+	}
+
+	const Node* node = &nodes[entry];
+	for( int pos = DIRECT_BITS; ; pos += STRIDE ) {
+		unsigned int index = (unsigned int)( ( key << pos ) >> (128 - STRIDE) );
+		unsigned long long upTo = ( 2ULL << index ) - 1;
+		if( node->vector & ( 1ULL << index ) ) {
+			node = &nodes[node->base1 + __builtin_popcountll(node->vector & upTo) - 1];
+		} else {
+			return leaves[node->base0 + __builtin_popcountll(node->leafvec & upTo) - 1];
+		}
+	}
+}
+
+//A binary trie of the rules, compiled into the Table's nodes
+struct TrieNode {
+	int child[2];
+	unsigned short rule;
+};
+
+class TableBuilder {
+    public:
+	TableBuilder( vector<TrieNode>& trie, vector<Node>& nodes, vector<unsigned short>& leaves )
+		: trie( trie ), nodes( nodes ), leaves( leaves ) {}
+
+	//Follow the top width bits of index down from node, keeping the last
+	//	rule passed in rule. Returns where it ended, or -1 off the trie.
+	int walk( int node, unsigned int index, int width, unsigned short& rule ) {
+		for( int b = width - 1; b >= 0 && node != -1; b-- ) {
+			node = trie[node].child[( index >> b ) & 1];
+			if( node != -1 && trie[node].rule != 0 ) {
+				rule = trie[node].rule;
+			}
+		}
+		return node;
+	}
+
+	bool hasChildren( int node ) {
+		return node != -1 && ( trie[node].child[0] != -1 || trie[node].child[1] != -1 );
+	}
+
+	//Build node number index from the trie node that leads to it, whose
+	//	longest matching rule so far is inherited
+	void fill( unsigned int index, int from, unsigned short inherited ) {
+		int ends[64];
+		unsigned short rules[64];
+		Node node = { 0, 0, 0, 0 };
+		int numChildren = 0;
+		for( int i = 0; i < 64; i++ ) {
+			rules[i] = inherited;
+			ends[i] = walk( from, i, STRIDE, rules[i] );
+			if( hasChildren(ends[i]) ) {
+				node.vector |= 1ULL << i;
+				numChildren++;
+			}
+		}
+
+		//The children sit together, so the next level can be reserved before it is built
+		node.base1 = nodes.size();
+		nodes.resize( nodes.size() + numChildren );
+		node.base0 = leaves.size();
+		bool first = true;
+		for( int i = 0; i < 64; i++ ) {
+			if( !( node.vector & ( 1ULL << i ) ) && ( first || rules[i] != leaves.back() ) ) {
+				node.leafvec |= 1ULL << i;
+				leaves.push_back( rules[i] );
+				first = false;
+			}
+		}
+		nodes[index] = node;
+
+		unsigned int child = node.base1;
+		for( int i = 0; i < 64; i++ ) {
+			if( node.vector & ( 1ULL << i ) ) {
+				fill( child++, ends[i], rules[i] );
+			}
+		}
+	}
+
+	void build( int root, vector<unsigned int>& direct ) {
+		direct.resize( 1 << DIRECT_BITS );
+		for( unsigned int i = 0; i < direct.size(); i++ ) {
+			unsigned short rule = trie[root].rule;
+			int end = walk( root, i, DIRECT_BITS, rule );
+			if( hasChildren(end) ) {
+				direct[i] = nodes.size();
+				nodes.resize( nodes.size() + 1 );
+				fill( direct[i], end, rule );
+			} else {
+				direct[i] = LEAF | rule;
+			}
+		}
+	}
+
+    protected:
+	vector<TrieNode>& trie;
+	vector<Node>& nodes;
+	vector<unsigned short>& leaves;
+};
+
+//Parse "address[/length]" into a family, a key with the address in its top bits, and a prefix length
+static bool parseNetwork( const string& network, int& family, Key& key, int& length ) {
+	size_t slash = network.find( '/' );
+	string address = network.substr( 0, slash );
+	unsigned char bytes[16];
+	int width;
+	if( inet_pton(AF_INET, address.c_str(), bytes) == 1 ) {
+		family = V4;
+		width = 32;
+	} else if( inet_pton(AF_INET6, address.c_str(), bytes) == 1 ) {
+		family = V6;
+		width = 128;
+	} else {
+		return false;
+	}
+
+	length = width;
+	if( slash != string::npos ) {
+		char* end;
+		length = strtol( network.c_str() + slash + 1, &end, 10 );
+		if( slash + 1 == network.size() || *end != '\0' || length < 0 || length > width ) {
+			return false;
+		}
+	}
+
+	key = 0;
+	for( int i = 0; i < width / 8; i++ ) {
+		key = ( key << 8 ) | bytes[i];
+	}
+	key <<= 128 - width;
+
+	//::ffff:a.b.c.d/96 and longer are IPv4 networks
+	if( family == V6 && length >= 96 && ( key >> 32 ) == 0xffff ) {
+		family = V4;
+		key <<= 96;
+		length -= 96;
+	}
+	return true;
+}
+
+void AccessList::load( const string& path ) {
+	ifstream in( path.c_str() );
+	if( !in ) {
+		throw string("Could not read the access list from ") + path;
+	}
+
+	Table* table = new Table();
+	table->networks.push_back( "" );
+	table->actions.push_back( Normal );
+
+	//Family roots first, then the rest of the binary trie
+	TrieNode empty = { { -1, -1 }, 0 };
+	vector<TrieNode> trie( NumFamilies, empty );
+
+	string line;
+	int lineNumber = 0;
+	while( getline(in, line) ) {
+		lineNumber++;
+		istringstream words( line );
+		string network, actionName;
+		if( !( words >> network ) || network[0] == '#' ) {
+			continue;
+		}
+		words >> actionName;
+
+		Action action;
+		int family, length;
+		Key key;
+		if( actionName == "drop" ) {
+			action = Drop;
+		} else if( actionName == "quiet" ) {
+			action = Quiet;
+		} else if( actionName == "tarpit" ) {
+			action = Tarpit;
+		} else if( actionName == "normal" ) {
+			action = Normal;
+		} else {
+			delete table;
+			stringstream error;
+			error << path << " line " << lineNumber << ": unknown action '" << actionName << "'";
+			throw error.str();
+		}
+		if( !parseNetwork(network, family, key, length) || table->actions.size() > 0xffff ) {
+			delete table;
+			stringstream error;
+			error << path << " line " << lineNumber << ": bad network '" << network << "'";
+			throw error.str();
+		}
+
+		int node = family;
+		for( int b = 0; b < length; b++ ) {
+			int bit = ( key >> (127 - b) ) & 1;
+			if( trie[node].child[bit] == -1 ) {
+				trie[node].child[bit] = trie.size();
+				trie.push_back( empty );
+			}
+			node = trie[node].child[bit];
+		}
+		trie[node].rule = table->actions.size();
+		table->networks.push_back( network );
+		table->actions.push_back( action );
+	}
+
+	TableBuilder builder( trie, table->nodes, table->leaves );
+	builder.build( V4, table->direct[V4] );
+	builder.build( V6, table->direct[V6] );
+	table->hits = new long[table->actions.size()]();
+
+	//Publish it, lookups starting from here on only see the new table
+	Table* previous = current;
+	if( previous != NULL ) {
+		log( previous );
+	}
+	__sync_synchronize();
+	current = table;
+	__sync_synchronize();
+	if( previous != NULL ) {
+		retired.push_back( previous );
+	}
+	freeRetired();
+	AccessList::path = path;
+
+	Logger::info() << "Loaded " << table->actions.size() - 1 << " access rules from " << path << " into "
+		<< table->nodes.size() << " nodes and " << table->leaves.size() << " leaves" << endl;
+}
+
+void AccessList::freeRetired() {
+	//A lookup takes well under a microsecond, so there's hardly ever one in
+	//	flight. If there always is, a later reload tries again.
+	for( int tries = 0; tries < 100 && readers != 0; tries++ ) {
+		usleep( 1000 );
+	}
+	if( __sync_fetch_and_add(&readers, 0) != 0 ) {
+		return;
+	}
+	for( size_t i = 0; i < retired.size(); i++ ) {
+		delete[] retired[i]->hits;
+		delete retired[i];
+	}
+	retired.clear();
+}
+
+void AccessList::reloadLater() {
+	reloadRequested = 1;
+}
+
+void AccessList::reloadIfRequested() {
+	if( !reloadRequested ) {
+		return;
+	}
+	reloadRequested = 0;
+	if( path.empty() ) {
+		return;
+	}
+	try {
+		load( path );
+	} catch( string& e ) {
+		Logger::info() << "Keeping the access rules in use: " << e << endl;
+	}
+}
+
+AccessList::Action AccessList::check( const sockaddr* address ) {
+	//Counted in before looking at the table, so a reload that sees no
+	//	lookups in flight knows nobody still uses the one it replaced
+	__sync_fetch_and_add( &readers, 1 );
+	Action action = lookup( current, address );
+	__sync_fetch_and_sub( &readers, 1 );
+	return action;
+}
+
+AccessList::Action AccessList::lookup( const Table* table, const sockaddr* address ) {
+	if( table == NULL ) {
+		return Normal;
+	}
+
+	int family;
+	Key key = 0;
+	if( address->sa_family == AF_INET ) {
+		family = V4;
+		key = (Key)ntohl( ((const sockaddr_in*) address)->sin_addr.s_addr ) << 96;
+	} else if( address->sa_family == AF_INET6 ) {
+		const unsigned char* bytes = ((const sockaddr_in6*) address)->sin6_addr.s6_addr;
+		family = IN6_IS_ADDR_V4MAPPED( &((const sockaddr_in6*) address)->sin6_addr ) ? V4 : V6;
+		for( int i = family == V4 ? 12 : 0; i < 16; i++ ) {
+			key = ( key << 8 ) | bytes[i];
+		}
+		key <<= family == V4 ? 96 : 0;
+	} else {
+		return Normal;
+	}
+
+	unsigned short rule = table->find( family, key );
+	if( rule == 0 ) {
+		return Normal;
+	}
+	__sync_fetch_and_add( &table->hits[rule], 1 );
+	return table->actions[rule];
+}
+
+bool AccessList::uses( Action action ) {
+	const Table* table = current;
+	if( table == NULL ) {
+		return false;
+	}
+	for( size_t i = 1; i < table->actions.size(); i++ ) {
+		if( table->actions[i] == action ) {
+			return true;
+		}
+	}
+	return false;
+}
+
+const char* AccessList::name( Action action ) {
+	switch( action ) {
+		case Drop: return "drop";
+		case Quiet: return "quiet";
+		case Tarpit: return "tarpit";
+		default: return "normal";
+	}
+}
+
+void AccessList::log() {
+	if( current != NULL ) {
+		log( current );
+	}
+}
+
+void AccessList::log( const Table* table ) {
+	for( size_t i = 1; i < table->actions.size(); i++ ) {
+		Logger::info() << "stat access_" << name(table->actions[i]) << "_" << table->networks[i]
+			<< "=" << __sync_fetch_and_add( &table->hits[i], 0 ) << endl;
+	}
+}
@@ -0,0 +1,71 @@
+#ifndef __ACCESSLIST_H
+#define __ACCESSLIST_H
+
+#include <string>
+#include <vector>
+#include <csignal>
+#include <sys/socket.h>
+using namespace std;
+
+//What happens to connections from listed networks, checked right after
+//	accept() so our own scanners, partners and research scanners cost
+//	nothing past it. The longest matching prefix decides:
+//	  drop    close the connection straight away
+//	  quiet   serve it, but leave no log lines, events or hook runs
+//	  tarpit  hand it to the Tarpit, which keeps it busy for hours
+//	  normal  serve it as usual, e.g. to carve a hole in a wider rule
+//
+//	The rules are compiled into a poptrie per address family: a direct
+//	table on the first 16 bits, then nodes of 64 way strides whose children
+//	and leaves are packed and found by popcount over a bitmap, with runs of
+//	equal leaves stored once. An IPv4 lookup is one or a few cache lines.
+//
+//	A reload builds a new table and publishes it by swapping one pointer,
+//	so lookups never lock. They only count themselves in and out, and the
+//	table a reload replaces is freed once it sees none in flight.
+//
+//	The file has one rule per line: an IPv4 or IPv6 network in CIDR notation
+//	(a bare address is a /32 or /128), whitespace and the action. A later
+//	rule for the same network replaces an earlier one. IPv4 mapped IPv6
+//	networks apply to IPv4 peers. Lines starting with # are comments.
+class AccessList {
+    public:
+	enum Action { Normal, Drop, Quiet, Tarpit };
+
+	//Compile the rules in path and start using them. Throws a string if
+	//	it can't be read or has a bad line, keeping the rules in use.
+	static void load( const string& path );
+
+	//Load the same file again on the next reloadIfRequested(). Safe to call
+	//	from a signal handler.
+	static void reloadLater();
+	static void reloadIfRequested();
+
+	//The action for a peer, counting a hit on the rule that matched
+	static Action check( const sockaddr* address );
+
+	//Whether any rule in use has action
+	static bool uses( Action action );
+
+	static const char* name( Action action );
+
+	//Write the hits of every rule to the info log
+	static void log();
+
+    protected:
+	struct Table;
+
+	static Action lookup( const Table* table, const sockaddr* address );
+	static void log( const Table* table );
+
+	//Free the replaced tables, unless a lookup might still be using them
+	static void freeRetired();
+
+	static string path;
+	static Table* volatile current;
+	static vector<Table*> retired;
+	static volatile long readers;
+	static volatile sig_atomic_t reloadRequested;
+};
+
+#endif
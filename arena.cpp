@@ -0,0 +1,141 @@
+#include "arena.h"
+
+#include <sstream>
+#include <pthread.h>
+using namespace std;
+
+#include "stats.h"
+
+size_t SessionArena::defaultBudget = 64 * 1024;
+
+//Arenas and spare blocks waiting for the next session
+static vector<SessionArena*> freeArenas;
+static vector<char*> freeBlocks;
+static pthread_mutex_t poolMutex = PTHREAD_MUTEX_INITIALIZER;
+
+//Don't hold on to more spare blocks than this, bursts get freed again
+static const size_t maxFreeBlocks = 1024;
+
+SessionArena::SessionArena() {
+	budget = defaultBudget;
+	usedBytes = 0;
+	cur = NULL;
+	curLeft = 0;
+}
+
+SessionArena::~SessionArena() {
+	for( size_t i = 0; i < blocks.size(); i++ ) {
+		delete[] blocks[i];
+	}
+}
+
+SessionArena* SessionArena::acquire() {
+	SessionArena* arena = NULL;
+
+	pthread_mutex_lock( &poolMutex );
+	if( !freeArenas.empty() ) {
+		arena = freeArenas.back();
+		freeArenas.pop_back();
+	}
+	pthread_mutex_unlock( &poolMutex );
+
+	if( arena == NULL ) {
+		arena = new SessionArena();
+	}
+	arena->budget = defaultBudget;
+	return arena;
+}
+
+void SessionArena::release( SessionArena* arena ) {
+	//Record how much the session needed
+	Stats::increment( Stats::ArenaSessions );
+	Stats::increment( Stats::ArenaBytes, arena->usedBytes );
+	Stats::max( Stats::ArenaBytesPeak, arena->usedBytes );
+
+	arena->reset();
+
+	pthread_mutex_lock( &poolMutex );
+	freeArenas.push_back( arena );
+	pthread_mutex_unlock( &poolMutex );
+}
+
+void SessionArena::setDefaultBudget( size_t bytes ) {
+	defaultBudget = bytes;
+}
+
+size_t SessionArena::getDefaultBudget() {
+	return defaultBudget;
+}
+
+void* SessionArena::allocate( size_t bytes ) {
+	//Keep everything 16 byte aligned
+	bytes = ( bytes + 15 ) & ~(size_t)15;
+
+	if( usedBytes + bytes > budget ) {
+		Stats::increment( Stats::ArenaBudgetExceeded );
+		stringstream ss;
+		ss << "Session memory budget of " << budget << " bytes exceeded";
+		throw ss.str();
+	}
+
+	if( bytes > curLeft ) {
+		//Oversized allocations get a block of their own, which isn't pooled
+		size_t size = bytes > BlockSize ? bytes : (size_t)BlockSize;
+		char* block = NULL;
+		if( size == BlockSize ) {
+			pthread_mutex_lock( &poolMutex );
+			if( !freeBlocks.empty() ) {
+				block = freeBlocks.back();
+				freeBlocks.pop_back();
+			}
+			pthread_mutex_unlock( &poolMutex );
+		}
+		if( block == NULL ) {
+			block = new char[size];
+		}
+
+		blocks.push_back( block );
+		blockSizes.push_back( size );
+		cur = block;
+		curLeft = size;
+	}
+
+	void* retVal = cur;
+	cur += bytes;
+	curLeft -= bytes;
+	usedBytes += bytes;
+	return retVal;
+}
+
+size_t SessionArena::used() const {
+	return usedBytes;
+}
+
+size_t SessionArena::reserved() const {
+	size_t total = 0;
+	for( size_t i = 0; i < blockSizes.size(); i++ ) {
+		total += blockSizes[i];
+	}
+	return total;
+}
+
+void SessionArena::reset() {
+	//Keep the first block for the next session, pool the rest
+	size_t keep = ( !blocks.empty() && blockSizes[0] == BlockSize ) ? 1 : 0;
+
+	pthread_mutex_lock( &poolMutex );
+	for( size_t i = keep; i < blocks.size(); i++ ) {
+		if( blockSizes[i] == BlockSize && freeBlocks.size() < maxFreeBlocks ) {
+			freeBlocks.push_back( blocks[i] );
+		} else {
+			delete[] blocks[i];
+		}
+	}
+	pthread_mutex_unlock( &poolMutex );
+
+	blocks.resize( keep );
+	blockSizes.resize( keep );
+	cur = keep ? blocks[0] : NULL;
+	curLeft = keep ? BlockSize : 0;
+	usedBytes = 0;
+}
@@ -0,0 +1,70 @@
+#ifndef __ARENA_H
+#define __ARENA_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+using namespace std;
+
+//A bump allocator holding everything that lives as long as one session.
+//	Memory is carved out of fixed size blocks and is only given back when
+//	the whole arena is released, at which point the arena and its blocks go
+//	back to a process wide pool for the next session. Allocating past the
+//	budget throws, which ends the session.
+class SessionArena {
+    public:
+	enum { BlockSize = 4096 };
+
+	//Take an arena from the pool, or make a new one
+	static SessionArena* acquire();
+
+	//Reset the arena and return it to the pool
+	static void release( SessionArena* arena );
+
+	//The budget given to arenas when they're acquired, in bytes
+	static void setDefaultBudget( size_t bytes );
+	static size_t getDefaultBudget();
+
+	void* allocate( size_t bytes );
+
+	//Bytes handed out, and bytes held in blocks
+	size_t used() const;
+	size_t reserved() const;
+
+    protected:
+	SessionArena();
+	~SessionArena();
+
+	void reset();
+
+	size_t budget;
+	size_t usedBytes;
+	vector<char*> blocks;
+	vector<size_t> blockSizes;
+	char* cur;
+	size_t curLeft;
+
+	static size_t defaultBudget;
+};
+
+//STL allocator drawing from a SessionArena, deallocate() is a no-op
+template <class T>
+class ArenaAllocator {
+    public:
+	typedef T value_type;
+
+	ArenaAllocator( SessionArena* useArena ) : arena( useArena ) {}
+	template <class U> ArenaAllocator( const ArenaAllocator<U>& other ) : arena( other.arena ) {}
+
+	T* allocate( size_t n ) { return (T*) arena->allocate( n * sizeof(T) ); }
+	void deallocate( T*, size_t ) {}
+
+	template <class U> bool operator==( const ArenaAllocator<U>& other ) const { return arena == other.arena; }
+	template <class U> bool operator!=( const ArenaAllocator<U>& other ) const { return arena != other.arena; }
+
+	SessionArena* arena;
+};
+
+typedef basic_string<char, char_traits<char>, ArenaAllocator<char> > ArenaString;
+
+#endif
@@ -0,0 +1,249 @@
+#include "credentials.h"
+
+#include <fstream>
+#include <vector>
+#include <cstring>
+#include <sys/mman.h>
+
+#include "logger.h"
+
+//The image is laid out as a Header, the Bloom filter's words, the buckets
+//	and the string pool, in that order
+struct Credentials::Header {
+	unsigned long long entries;
+	unsigned long long bloomMask;
+	unsigned long long bucketMask;
+	unsigned long long bloomOffset;
+	unsigned long long bucketOffset;
+	unsigned long long accept;
+};
+
+//hash 0 marks an empty bucket, the strings are user then password at offset in the pool
+struct Credentials::Bucket {
+	unsigned long long hash;
+	unsigned int offset;
+	unsigned short userLength;
+	unsigned short passLength;
+};
+
+//Bits per entry, and bits set per entry, in the Bloom filter (about 1% false positives)
+static const int BLOOM_BITS = 10;
+static const int BLOOM_HASHES = 4;
+
+//Longest user or password kept, longer lines are skipped
+static const size_t MAX_FIELD = 0xffff;
+
+const char* Credentials::image = NULL;
+size_t Credentials::imageLength = 0;
+int Credentials::acceptAfter = 0;
+
+struct Entry {
+	string user;
+	string pass;
+	int kind;
+};
+
+static size_t roundUp( size_t n ) {
+	size_t size = 1;
+	while( size < n ) {
+		size *= 2;
+	}
+	return size;
+}
+
+unsigned long long Credentials::hash( Kind kind, const char* user, size_t userLength, const char* pass, size_t passLength ) {
+	//FNV-1a over the kind, the user, its length and the password, then the murmur3 finalizer
+	unsigned long long h = 14695981039346656037ULL ^ kind;
+	for( size_t i = 0; i < userLength; i++ ) {
+		h = ( h ^ (unsigned char)user[i] ) * 1099511628211ULL;
+	}
+	h = ( h ^ userLength ) * 1099511628211ULL;
+	for( size_t i = 0; i < passLength; i++ ) {
+		h = ( h ^ (unsigned char)pass[i] ) * 1099511628211ULL;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h == 0 ? 1 : h;
+}
+
+void Credentials::load( const string& path, const string& validUser, const string& validPass, int acceptAfter ) {
+	Credentials::acceptAfter = acceptAfter;
+
+	vector<Entry> entries;
+	bool acceptAll = false;
+	if( !validUser.empty() ) {
+		Entry entry = { validUser, validPass, Exact };
+		entries.push_back( entry );
+	}
+
+	if( !path.empty() ) {
+		ifstream in( path.c_str() );
+		if( !in ) {
+			throw string("Could not read credentials from ") + path;
+		}
+		string line;
+		while( getline(in, line) ) {
+			if( !line.empty() && line[line.size() - 1] == '\r' ) {
+				line.erase( line.size() - 1 );
+			}
+			size_t colon = line.find( ':' );
+			if( line.empty() || line[0] == '#' || colon == string::npos ) {
+				continue;
+			}
+
+			Entry entry = { line.substr(0, colon), line.substr(colon + 1), Exact };
+			if( entry.user.size() > MAX_FIELD || entry.pass.size() > MAX_FIELD ) {
+				continue;
+			}
+			if( entry.user == "*" && entry.pass == "*" ) {
+				acceptAll = true;
+				continue;
+			}
+			if( entry.pass == "*" ) {
+				entry.kind = AnyPassword;
+				entry.pass.clear();
+			} else if( entry.user == "*" ) {
+				entry.kind = AnyUser;
+				entry.user.clear();
+			}
+			entries.push_back( entry );
+		}
+	}
+
+	//Half full buckets keep probe runs short
+	size_t numBuckets = roundUp( entries.size() * 2 + 1 );
+	size_t bloomWords = roundUp( ( entries.size() * BLOOM_BITS + 63 ) / 64 + 1 );
+	size_t poolLength = 0;
+	for( size_t i = 0; i < entries.size(); i++ ) {
+		poolLength += entries[i].user.size() + entries[i].pass.size();
+	}
+
+	size_t bloomOffset = sizeof(Header);
+	size_t bucketOffset = bloomOffset + bloomWords * sizeof(unsigned long long);
+	size_t poolOffset = bucketOffset + numBuckets * sizeof(Bucket);
+	size_t length = poolOffset + poolLength;
+	if( poolLength > 0xffffffffULL ) {
+		throw string("Credentials list too large");
+	}
+
+	char* mem = (char*) mmap( NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+	if( mem == MAP_FAILED ) {
+		throw string("Could not map the credentials table");
+	}
+
+	Header* header = (Header*) mem;
+	unsigned long long* bloom = (unsigned long long*)( mem + bloomOffset );
+	Bucket* buckets = (Bucket*)( mem + bucketOffset );
+	char* pool = mem + poolOffset;
+	header->bloomMask = bloomWords * 64 - 1;
+	header->bucketMask = numBuckets - 1;
+	header->bloomOffset = bloomOffset;
+	header->bucketOffset = bucketOffset;
+	header->accept = acceptAll;
+	header->entries = 0;
+
+	size_t poolUsed = 0;
+	for( size_t i = 0; i < entries.size(); i++ ) {
+		const Entry& entry = entries[i];
+		unsigned long long h = hash( (Kind)entry.kind, entry.user.data(), entry.user.size(), entry.pass.data(), entry.pass.size() );
+
+		//Find its bucket, skipping duplicates
+		size_t b = h & header->bucketMask;
+		bool duplicate = false;
+		while( buckets[b].hash != 0 ) {
+			const Bucket& bucket = buckets[b];
+			if( bucket.hash == h && bucket.userLength == entry.user.size() && bucket.passLength == entry.pass.size()
+				&& memcmp(pool + bucket.offset, entry.user.data(), entry.user.size()) == 0
+				&& memcmp(pool + bucket.offset + bucket.userLength, entry.pass.data(), entry.pass.size()) == 0 ) {
+				duplicate = true;
+				break;
+			}
+			b = ( b + 1 ) & header->bucketMask;
+		}
+		if( duplicate ) {
+			continue;
+		}
+
+		buckets[b].hash = h;
+		buckets[b].offset = poolUsed;
+		buckets[b].userLength = entry.user.size();
+		buckets[b].passLength = entry.pass.size();
+		memcpy( pool + poolUsed, entry.user.data(), entry.user.size() );
+		poolUsed += entry.user.size();
+		memcpy( pool + poolUsed, entry.pass.data(), entry.pass.size() );
+		poolUsed += entry.pass.size();
+
+		unsigned int h1 = h, h2 = ( h >> 32 ) | 1;
+		for( int k = 0; k < BLOOM_HASHES; k++ ) {
+			unsigned long long bit = ( h1 + k * h2 ) & header->bloomMask;
+			bloom[bit / 64] |= 1ULL << ( bit % 64 );
+		}
+		header->entries++;
+	}
+
+	//Sessions only ever read it
+	mprotect( mem, length, PROT_READ );
+	if( image != NULL ) {
+		munmap( (void*)image, imageLength );
+	}
+	image = mem;
+	imageLength = length;
+
+	Logger::info() << "Accepting " << header->entries << " credentials" << ( acceptAll ? " and any login" : "" )
+		<< " in a " << length << " byte table" << endl;
+}
+
+bool Credentials::mayContain( unsigned long long h ) {
+	const Header* header = (const Header*) image;
+	const unsigned long long* bloom = (const unsigned long long*)( image + header->bloomOffset );
+	unsigned int h1 = h, h2 = ( h >> 32 ) | 1;
+	for( int k = 0; k < BLOOM_HASHES; k++ ) {
+		unsigned long long bit = ( h1 + k * h2 ) & header->bloomMask;
+		if( !( bloom[bit / 64] & ( 1ULL << ( bit % 64 ) ) ) ) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool Credentials::find( Kind kind, const char* user, size_t userLength, const char* pass, size_t passLength ) {
+	unsigned long long h = hash( kind, user, userLength, pass, passLength );
+	if( !mayContain(h) ) {
+		return false;
+	}
+
+	const Header* header = (const Header*) image;
+	const Bucket* buckets = (const Bucket*)( image + header->bucketOffset );
+	const char* pool = image + header->bucketOffset + ( header->bucketMask + 1 ) * sizeof(Bucket);
+	for( size_t b = h & header->bucketMask; buckets[b].hash != 0; b = ( b + 1 ) & header->bucketMask ) {
+		const Bucket& bucket = buckets[b];
+		if( bucket.hash == h && bucket.userLength == userLength && bucket.passLength == passLength
+			&& memcmp(pool + bucket.offset, user, userLength) == 0
+			&& memcmp(pool + bucket.offset + userLength, pass, passLength) == 0 ) {
+			return true;
+		}
+	}
+	return false;
+}
+
+bool Credentials::accept( const char* user, size_t userLength, const char* pass, size_t passLength, int attempt ) {
+	if( acceptAfter > 0 && attempt >= acceptAfter ) {
+		return true;
+	}
+	if( image == NULL ) {
+		return false;
+	}
+	if( ((const Header*) image)->accept ) {
+		return true;
+	}
+	return find( Exact, user, userLength, pass, passLength )
+		|| find( AnyPassword, user, userLength, "", 0 )
+		|| find( AnyUser, "", 0, pass, passLength );
+}
+
+size_t Credentials::size() {
+	return image == NULL ? 0 : ((const Header*) image)->entries;
+}
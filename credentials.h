@@ -0,0 +1,46 @@
+#ifndef __CREDENTIALS_H
+#define __CREDENTIALS_H
+
+#include <string>
+using namespace std;
+
+//The logins the fake shell accepts. A list of thousands of default
+//	credentials is compiled at startup into one read-only memory mapping:
+//	a Bloom filter in front of an open addressing hash table of
+//	(user, password) pairs pointing into a string pool. Lookups hash the
+//	candidate in place, so they take constant time and allocate nothing
+//	whatever the size of the list.
+//
+//	The file has one user:password per line, split at the first colon. A *
+//	for the password accepts any password for that user, a * for the user
+//	accepts that password for any user, and *:* accepts everything. Lines
+//	starting with # are comments.
+class Credentials {
+    public:
+	//Build the set from path (if not empty) and the single validUser/validPass
+	//	pair (if not empty), and accept any login from attempt acceptAfter
+	//	on when it's above 0. Throws a string if the file can't be read.
+	static void load( const string& path, const string& validUser, const string& validPass, int acceptAfter );
+
+	//Whether attempt (counting from 1) with user and pass logs in
+	static bool accept( const char* user, size_t userLength, const char* pass, size_t passLength, int attempt );
+
+	//Entries in the set
+	static size_t size();
+
+    protected:
+	enum Kind { Exact, AnyPassword, AnyUser };
+
+	struct Header;
+	struct Bucket;
+
+	static unsigned long long hash( Kind kind, const char* user, size_t userLength, const char* pass, size_t passLength );
+	static bool mayContain( unsigned long long h );
+	static bool find( Kind kind, const char* user, size_t userLength, const char* pass, size_t passLength );
+
+	static const char* image;
+	static size_t imageLength;
+	static int acceptAfter;
+};
+
+#endif
@@ -0,0 +1,709 @@
+#include "events.h"
+
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+using namespace std;
+
+#include "logger.h"
+#include "stats.h"
+#include "geoip.h"
+#include "spscring.h"
+
+bool Events::enabled = false;
+string Events::collectorPath;
+Events::Format Events::wireFormat = Events::Json;
+int Events::batchCount = 64;
+int Events::batchMs = 200;
+size_t Events::queueLimit = 10000;
+Events::Overflow Events::overflow = Events::DropOldest;
+string Events::spillPath;
+SpscRing* Events::ring = NULL;
+
+deque<Events::Event> Events::queue;
+deque<Events::Event> Events::overflowed;
+pthread_mutex_t Events::queueMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t Events::queueCond = PTHREAD_COND_INITIALIZER;
+bool Events::stopping = false;
+bool Events::stopped = false;
+
+//Only the exporter thread touches these
+static int collectorFd = -1;
+static time_t lastConnectAttempt = 0;
+static deque<string> pending; //Formatted frames waiting to be written
+static size_t pendingOffset = 0; //How much of the front frame went out already
+static off_t replayOffset = 0; //How far into the spill file has been replayed
+static int drainTimeoutMs = 2000;
+static bool spillBacklog = false; //Whether the spill file has events left to replay
+
+static timespec deadlineAfter( int ms ) {
+	timespec ts;
+	clock_gettime( CLOCK_REALTIME, &ts );
+	ts.tv_sec += ms / 1000;
+	ts.tv_nsec += ( ms % 1000 ) * 1000000L;
+	if( ts.tv_nsec >= 1000000000L ) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+	return ts;
+}
+
+static long long monotonicMs() {
+	timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+void Events::init( string path, Format format, int useBatchCount, int useBatchMs,
+		int useQueueLimit, Overflow useOverflow, string useSpillPath ) {
+	collectorPath = path;
+	wireFormat = format;
+	batchCount = useBatchCount > 0 ? useBatchCount : 1;
+	batchMs = useBatchMs > 0 ? useBatchMs : 1;
+	queueLimit = useQueueLimit > batchCount ? useQueueLimit : batchCount;
+	overflow = useOverflow;
+	spillPath = useSpillPath;
+
+	if( overflow == Spill && spillPath.empty() ) {
+		throw string("event_overflow=spill needs event_spill_file");
+	}
+	
+	//Events spilled before a restart get replayed too
+	if( overflow == Spill && access(spillPath.c_str(), F_OK) == 0 ) {
+		spillBacklog = true;
+	}
+
+	pthread_t thread;
+	if( pthread_create(&thread, NULL, &Events::exporter, NULL) != 0 ) {
+		throw string("Could not start the event export thread");
+	}
+	pthread_detach( thread );
+	enabled = true;
+}
+
+void Events::initRing( SpscRing* useRing, int useBatchCount, int useBatchMs, int useQueueLimit ) {
+	ring = useRing;
+	batchCount = useBatchCount > 0 ? useBatchCount : 1;
+	batchMs = useBatchMs > 0 ? useBatchMs : 1;
+	queueLimit = useQueueLimit > batchCount ? useQueueLimit : batchCount;
+
+	//Only the supervisor spills, whatever it was set up with
+	overflow = DropOldest;
+	spillPath.clear();
+	spillBacklog = false;
+	replayOffset = 0;
+
+	//We were forked from the supervisor, maybe while its exporter held the lock
+	pthread_mutex_init( &queueMutex, NULL );
+	pthread_cond_init( &queueCond, NULL );
+	queue.clear();
+	overflowed.clear();
+	pending.clear();
+	if( collectorFd != -1 ) {
+		close( collectorFd );
+		collectorFd = -1;
+	}
+
+	pthread_t thread;
+	if( pthread_create(&thread, NULL, &Events::ringExporter, NULL) != 0 ) {
+		throw string("Could not start the event export thread");
+	}
+	pthread_detach( thread );
+	enabled = true;
+}
+
+void Events::relay( const char* record, size_t length ) {
+	Event event;
+	if( enabled && decodeRecord(record, length, event) ) {
+		enqueue( event );
+	}
+}
+
+void Events::emit( Type type, const string& ip, const Origin* origin, const char* user, const char* pass, const char* cmd, const char* tags ) {
+	if( !enabled ) {
+		return;
+	}
+
+	Event event;
+	event.type = type;
+	clock_gettime( CLOCK_REALTIME_COARSE, &event.wall );
+	clock_gettime( CLOCK_MONOTONIC_COARSE, &event.mono );
+	event.ip = ip;
+	event.origin = origin;
+	event.user = user;
+	event.pass = pass;
+	event.cmd = cmd;
+	event.tags = tags;
+	enqueue( event );
+}
+
+void Events::enqueue( const Event& event ) {
+	pthread_mutex_lock( &queueMutex );
+	if( queue.size() >= queueLimit && overflow == Spill && overflowed.empty() ) {
+		//The exporter is stuck, hand it the whole queue to spill rather than lose any of it
+		overflowed.swap( queue );
+	} else if( queue.size() >= queueLimit ) {
+		//The exporter is behind, make room by losing the oldest event
+		queue.pop_front();
+		Stats::increment( Stats::EventsDropped );
+	}
+	queue.push_back( event );
+	if( queue.size() >= (size_t)batchCount || !overflowed.empty() ) {
+		pthread_cond_signal( &queueCond );
+	}
+	pthread_mutex_unlock( &queueMutex );
+}
+
+void Events::shutdown( int timeoutMs ) {
+	if( !enabled ) {
+		return;
+	}
+
+	//The exporter flushes on its own deadline, give it a little extra to finish
+	timespec deadline = deadlineAfter( timeoutMs + 500 );
+	pthread_mutex_lock( &queueMutex );
+	drainTimeoutMs = timeoutMs;
+	stopping = true;
+	pthread_cond_broadcast( &queueCond );
+	while( !stopped ) {
+		if( pthread_cond_timedwait(&queueCond, &queueMutex, &deadline) == ETIMEDOUT ) {
+			break;
+		}
+	}
+	pthread_mutex_unlock( &queueMutex );
+}
+
+//Records only ever cross between processes forked from one binary, so
+//	they are in host byte order, and origin points into the IP database
+//	every process maps at the same address
+void Events::encodeRecord( const Event& event, string& out ) {
+	out += (char) event.type;
+	out.append( (const char*) &event.wall, sizeof(event.wall) );
+	out.append( (const char*) &event.mono, sizeof(event.mono) );
+	out.append( (const char*) &event.origin, sizeof(event.origin) );
+	const string* fields[] = { &event.ip, &event.user, &event.pass, &event.cmd, &event.tags };
+	for( size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++ ) {
+		unsigned short length = fields[i]->size() < 0xffff ? fields[i]->size() : 0xffff;
+		out.append( (const char*) &length, sizeof(length) );
+		out.append( fields[i]->data(), length );
+	}
+}
+
+bool Events::decodeRecord( const char* record, size_t length, Event& event ) {
+	size_t fixed = 1 + sizeof(event.wall) + sizeof(event.mono) + sizeof(event.origin);
+	if( length < fixed ) {
+		return false;
+	}
+	event.type = (Type) record[0];
+	memcpy( &event.wall, record + 1, sizeof(event.wall) );
+	memcpy( &event.mono, record + 1 + sizeof(event.wall), sizeof(event.mono) );
+	memcpy( &event.origin, record + 1 + sizeof(event.wall) + sizeof(event.mono), sizeof(event.origin) );
+	string* fields[] = { &event.ip, &event.user, &event.pass, &event.cmd, &event.tags };
+	size_t at = fixed;
+	for( size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++ ) {
+		unsigned short fieldLength;
+		if( at + sizeof(fieldLength) > length ) {
+			return false;
+		}
+		memcpy( &fieldLength, record + at, sizeof(fieldLength) );
+		at += sizeof(fieldLength);
+		if( at + fieldLength > length ) {
+			return false;
+		}
+		fields[i]->assign( record + at, fieldLength );
+		at += fieldLength;
+	}
+	return true;
+}
+
+const char* Events::typeName( Type type ) {
+	switch( type ) {
+		case Connect: return "connect";
+		case LoginSuccess: return "login_success";
+		case LoginFail: return "login_fail";
+		case Command: return "command";
+		case Disconnect: return "disconnect";
+		case Indicator: return "indicator";
+		case Trace: return "trace";
+		default: return "unknown";
+	}
+}
+
+static void appendJsonString( string& out, const string& s ) {
+	static const char hex[] = "0123456789abcdef";
+	out += '"';
+	for( size_t i = 0; i < s.size(); i++ ) {
+		unsigned char c = s[i];
+		if( c == '"' || c == '\\' ) {
+			out += '\\';
+			out += c;
+		} else if( c < 0x20 || c >= 0x7f ) {
+			//Clients send arbitrary bytes, keep them as latin-1 code points so the line stays valid JSON
+			out += "\\u00";
+			out += hex[c >> 4];
+			out += hex[c & 0xf];
+		} else {
+			out += c;
+		}
+	}
+	out += '"';
+}
+
+static void appendBigEndian( string& out, unsigned long long value, int bytes ) {
+	for( int i = bytes - 1; i >= 0; i-- ) {
+		out += (char)( ( value >> ( i * 8 ) ) & 0xff );
+	}
+}
+
+static void appendBinaryString( string& out, const string& s ) {
+	size_t length = s.size() > 0xffff ? 0xffff : s.size();
+	appendBigEndian( out, length, 2 );
+	out.append( s, 0, length );
+}
+
+void Events::format( const Event& event, string& out ) {
+	unsigned long long wallMs = event.wall.tv_sec * 1000ULL + event.wall.tv_nsec / 1000000;
+	unsigned long long monoMs = event.mono.tv_sec * 1000ULL + event.mono.tv_nsec / 1000000;
+
+	if( wireFormat == Binary ) {
+		string body;
+		body += (char)3;
+		body += (char)event.type;
+		appendBigEndian( body, wallMs, 8 );
+		appendBigEndian( body, monoMs, 8 );
+		appendBinaryString( body, event.ip );
+		appendBinaryString( body, event.user );
+		appendBinaryString( body, event.pass );
+		appendBinaryString( body, event.cmd );
+		appendBinaryString( body, event.tags );
+		appendBigEndian( body, event.origin != NULL ? event.origin->asn : 0, 4 );
+		appendBinaryString( body, event.origin != NULL ? event.origin->country : "" );
+		appendBinaryString( body, event.origin != NULL ? event.origin->org : "" );
+
+		appendBigEndian( out, body.size(), 4 );
+		out += body;
+		return;
+	}
+
+	char date[32];
+	tm parts;
+	gmtime_r( &event.wall.tv_sec, &parts );
+	strftime( date, sizeof(date), "%Y-%m-%dT%H:%M:%S", &parts );
+	char times[96];
+	snprintf( times, sizeof(times), "{\"time\":\"%s.%03dZ\",\"mono\":%llu.%03d,\"type\":\"",
+		date, (int)( wallMs % 1000 ), monoMs / 1000, (int)( monoMs % 1000 ) );
+
+	out += times;
+	out += typeName( event.type );
+	out += "\",\"ip\":";
+	appendJsonString( out, event.ip );
+	if( event.origin != NULL ) {
+		char asn[32];
+		snprintf( asn, sizeof(asn), ",\"asn\":%u", event.origin->asn );
+		out += asn;
+		if( event.origin->country[0] != '\0' ) {
+			out += ",\"country\":";
+			appendJsonString( out, event.origin->country );
+		}
+		if( event.origin->org[0] != '\0' ) {
+			out += ",\"as_org\":";
+			appendJsonString( out, event.origin->org );
+		}
+	}
+	bool login = event.type == LoginSuccess || event.type == LoginFail;
+	if( !event.user.empty() || login ) {
+		out += ",\"user\":";
+		appendJsonString( out, event.user );
+	}
+	if( login ) {
+		out += ",\"pass\":";
+		appendJsonString( out, event.pass );
+	}
+	if( event.type == Command ) {
+		out += ",\"cmd\":";
+		appendJsonString( out, event.cmd );
+	}
+	if( event.type == Indicator ) {
+		out += ",\"indicator\":";
+		appendJsonString( out, event.cmd );
+	}
+	if( event.type == Trace ) {
+		out += ",\"spans\":[";
+		size_t start = 0;
+		while( start < event.cmd.size() ) {
+			size_t equals = event.cmd.find( '=', start );
+			size_t comma = event.cmd.find( ',', start );
+			if( comma == string::npos ) {
+				comma = event.cmd.size();
+			}
+			if( equals == string::npos || equals > comma ) {
+				break;
+			}
+			out += start == 0 ? "[" : ",[";
+			appendJsonString( out, event.cmd.substr(start, equals - start) );
+			out += ',';
+			out += event.cmd.substr( equals + 1, comma - equals - 1 );
+			out += ']';
+			start = comma + 1;
+		}
+		out += ']';
+	}
+	if( !event.tags.empty() ) {
+		out += ",\"tags\":[";
+		size_t start = 0;
+		while( true ) {
+			size_t comma = event.tags.find( ',', start );
+			appendJsonString( out, event.tags.substr(start, comma == string::npos ? string::npos : comma - start) );
+			if( comma == string::npos ) {
+				break;
+			}
+			out += ',';
+			start = comma + 1;
+		}
+		out += ']';
+	}
+	out += "}\n";
+}
+
+bool Events::connectCollector() {
+	if( collectorFd != -1 ) {
+		return true;
+	}
+
+	//Don't hammer a collector that isn't there
+	time_t now = time( NULL );
+	if( now == lastConnectAttempt ) {
+		return false;
+	}
+	lastConnectAttempt = now;
+
+	sockaddr_un addr;
+	memset( &addr, 0, sizeof(addr) );
+	addr.sun_family = AF_UNIX;
+	strncpy( addr.sun_path, collectorPath.c_str(), sizeof(addr.sun_path) - 1 );
+
+	int fd = socket( AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+	if( fd == -1 ) {
+		return false;
+	}
+	if( connect(fd, (sockaddr*)&addr, sizeof(addr)) == -1 ) {
+		close( fd );
+		return false;
+	}
+
+	Logger::info() << "Connected to event collector " << collectorPath << endl;
+	collectorFd = fd;
+	return true;
+}
+
+void Events::disconnectCollector() {
+	Logger::info() << "Lost event collector " << collectorPath << ", errno " << errno << endl;
+	close( collectorFd );
+	collectorFd = -1;
+
+	//The collector saw part of the front frame, the rest would garble the next connection
+	if( pendingOffset > 0 ) {
+		pending.pop_front();
+		pendingOffset = 0;
+		Stats::increment( Stats::EventsDropped );
+	}
+}
+
+bool Events::sendPending( int timeoutMs ) {
+	long long deadline = monotonicMs() + timeoutMs;
+	while( !pending.empty() && collectorFd != -1 ) {
+		//Write as many frames as fit in one call
+		struct iovec iov[64];
+		int count = 0;
+		for( size_t i = 0; i < pending.size() && count < 64; i++, count++ ) {
+			size_t skip = ( i == 0 ) ? pendingOffset : 0;
+			iov[count].iov_base = (void*)( pending[i].data() + skip );
+			iov[count].iov_len = pending[i].size() - skip;
+		}
+
+		msghdr msg;
+		memset( &msg, 0, sizeof(msg) );
+		msg.msg_iov = iov;
+		msg.msg_iovlen = count;
+		ssize_t sent = sendmsg( collectorFd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT );
+
+		if( sent == -1 ) {
+			if( errno == EINTR ) {
+				continue;
+			}
+			if( errno != EAGAIN && errno != EWOULDBLOCK ) {
+				disconnectCollector();
+				return false;
+			}
+
+			//The collector is slow, wait for room until the deadline
+			int left = deadline - monotonicMs();
+			if( left <= 0 ) {
+				return false;
+			}
+			pollfd pfd;
+			pfd.fd = collectorFd;
+			pfd.events = POLLOUT;
+			pfd.revents = 0;
+			poll( &pfd, 1, left );
+			continue;
+		}
+
+		//Retire the frames that went out completely
+		size_t done = sent;
+		while( !pending.empty() && done >= pending.front().size() - pendingOffset ) {
+			done -= pending.front().size() - pendingOffset;
+			pending.pop_front();
+			pendingOffset = 0;
+			Stats::increment( Stats::EventsSent );
+		}
+		pendingOffset += done;
+	}
+	return pending.empty();
+}
+
+//Appends already formatted frames to the spill file
+static void writeSpill( const string& out, size_t count, const string& spillPath ) {
+	int fd = open( spillPath.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600 );
+	if( fd == -1 || write(fd, out.data(), out.size()) != (ssize_t)out.size() ) {
+		Logger::info() << "Could not spill " << count << " events to " << spillPath << ", errno " << errno << endl;
+		Stats::increment( Stats::EventsDropped, count );
+	} else {
+		Stats::increment( Stats::EventsSpilled, count );
+		spillBacklog = true;
+	}
+	if( fd != -1 ) {
+		close( fd );
+	}
+}
+
+void Events::spill( deque<Event>& events ) {
+	if( events.empty() ) {
+		return;
+	}
+
+	string out;
+	for( size_t i = 0; i < events.size(); i++ ) {
+		format( events[i], out );
+	}
+	writeSpill( out, events.size(), spillPath );
+	events.clear();
+}
+
+void Events::loadSpill() {
+	int fd = open( spillPath.c_str(), O_RDWR | O_CLOEXEC );
+	if( fd == -1 ) {
+		return;
+	}
+
+	//Read the next chunk, and split it back into the frames it was written as
+	char buf[65536];
+	ssize_t len = pread( fd, buf, sizeof(buf), replayOffset );
+	size_t used = 0;
+	while( len > 0 && used < (size_t)len ) {
+		size_t frameLength;
+		if( wireFormat == Binary ) {
+			if( len - used < 4 ) {
+				break;
+			}
+			const unsigned char* p = (const unsigned char*)buf + used;
+			frameLength = 4 + ( ( (size_t)p[0] << 24 ) | ( p[1] << 16 ) | ( p[2] << 8 ) | p[3] );
+		} else {
+			const char* newline = (const char*)memchr( buf + used, '\n', len - used );
+			if( newline == NULL ) {
+				break;
+			}
+			frameLength = newline + 1 - ( buf + used );
+		}
+		if( used + frameLength > (size_t)len ) {
+			break;
+		}
+		pending.push_back( string(buf + used, frameLength) );
+		used += frameLength;
+	}
+
+	//A frame bigger than the buffer can only be a corrupt file, start over
+	if( len > 0 && used == 0 && len == (ssize_t)sizeof(buf) ) {
+		Logger::info() << "Spill file " << spillPath << " is corrupt, discarding it" << endl;
+		used = len;
+	}
+	replayOffset += used;
+
+	//Everything has been picked up, start the file afresh
+	if( len < (ssize_t)sizeof(buf) ) {
+		if( len > 0 && used < (size_t)len ) {
+			Logger::info() << "Spill file " << spillPath << " ends in a partial event, discarding it" << endl;
+		}
+		if( ftruncate(fd, 0) == 0 ) {
+			replayOffset = 0;
+			spillBacklog = false;
+		}
+	}
+	close( fd );
+}
+
+void Events::saveBacklog( deque<Event>& batch ) {
+	//Oldest first: the undelivered frames, what's left of the spill file, then the batch
+	string out;
+	for( size_t i = 0; i < pending.size(); i++ ) {
+		out += pending[i];
+	}
+	size_t count = pending.size() + batch.size();
+	pending.clear();
+
+	if( spillBacklog ) {
+		int fd = open( spillPath.c_str(), O_RDONLY | O_CLOEXEC );
+		if( fd != -1 ) {
+			char buf[65536];
+			ssize_t len;
+			off_t offset = replayOffset;
+			while( (len = pread(fd, buf, sizeof(buf), offset)) > 0 ) {
+				out.append( buf, len );
+				offset += len;
+			}
+			close( fd );
+		}
+	}
+	for( size_t i = 0; i < batch.size(); i++ ) {
+		format( batch[i], out );
+	}
+	batch.clear();
+
+	//Replace the spill file in one go, so a crash leaves either the old or the new one
+	string tmpPath = spillPath + ".tmp";
+	int fd = open( tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600 );
+	if( fd == -1 || write(fd, out.data(), out.size()) != (ssize_t)out.size() || rename(tmpPath.c_str(), spillPath.c_str()) == -1 ) {
+		Logger::info() << "Could not save undelivered events to " << spillPath << ", errno " << errno << endl;
+		Stats::increment( Stats::EventsDropped, count );
+	} else {
+		Stats::increment( Stats::EventsSpilled, count );
+	}
+	if( fd != -1 ) {
+		close( fd );
+	}
+	replayOffset = 0;
+}
+
+void* Events::exporter( void* ) {
+	deque<Event> batch;
+	deque<Event> full;
+	string out;
+	while( true ) {
+		//Wait until a batch is full, the batch time is up, or we're stopping
+		pthread_mutex_lock( &queueMutex );
+		bool replaying = collectorFd != -1 && spillBacklog && pending.empty();
+		if( !stopping && !replaying && queue.size() < (size_t)batchCount && overflowed.empty() ) {
+			timespec deadline = deadlineAfter( batchMs );
+			pthread_cond_timedwait( &queueCond, &queueMutex, &deadline );
+		}
+		bool draining = stopping;
+		full.swap( overflowed );
+		pthread_mutex_unlock( &queueMutex );
+
+		//A queue the sessions filled up is older than anything still queued
+		spill( full );
+
+		bool connected = connectCollector();
+
+		//Only take events on when there's somewhere for them to go, otherwise
+		//	they wait in the bounded queue, or get spilled once it fills up
+		pthread_mutex_lock( &queueMutex );
+		if( ( connected && pending.empty() ) || draining
+				|| ( overflow == Spill && ( !connected || queue.size() >= queueLimit / 2 ) ) ) {
+			batch.swap( queue );
+		}
+		pthread_mutex_unlock( &queueMutex );
+
+		//While the spill file has a backlog new events go behind it, so the
+		//	collector still gets everything oldest first
+		if( connected && ( pending.empty() || draining ) && !spillBacklog ) {
+			for( size_t i = 0; i < batch.size(); i++ ) {
+				out.clear();
+				format( batch[i], out );
+				pending.push_back( out );
+			}
+			batch.clear();
+		} else if( overflow == Spill && !draining ) {
+			spill( batch );
+		}
+
+		//Catch up on what was spilled while the collector was away
+		if( connected && pending.empty() && overflow == Spill && !draining ) {
+			loadSpill();
+		}
+
+		if( connected ) {
+			sendPending( draining ? drainTimeoutMs : batchMs );
+		}
+
+		if( draining ) {
+			//Whatever couldn't be delivered in time is spilled or lost
+			if( pendingOffset > 0 ) {
+				pending.pop_front();
+				pendingOffset = 0;
+				Stats::increment( Stats::EventsDropped );
+			}
+			if( overflow == Spill ) {
+				saveBacklog( batch );
+			} else {
+				Stats::increment( Stats::EventsDropped, batch.size() + pending.size() );
+			}
+
+			pthread_mutex_lock( &queueMutex );
+			stopped = true;
+			pthread_cond_broadcast( &queueCond );
+			pthread_mutex_unlock( &queueMutex );
+			return NULL;
+		}
+	}
+}
+
+void* Events::ringExporter( void* ) {
+	deque<Event> batch;
+	string record;
+	while( true ) {
+		//Wait for a batch like the exporter does, unless some events still wait for room
+		pthread_mutex_lock( &queueMutex );
+		if( !stopping && batch.empty() && queue.size() < (size_t)batchCount ) {
+			timespec deadline = deadlineAfter( batchMs );
+			pthread_cond_timedwait( &queueCond, &queueMutex, &deadline );
+		}
+		bool draining = stopping;
+		while( !queue.empty() ) {
+			batch.push_back( queue.front() );
+			queue.pop_front();
+		}
+		pthread_mutex_unlock( &queueMutex );
+
+		//The supervisor empties the ring every few milliseconds, so wait a full one out for a while
+		long long deadline = monotonicMs() + ( draining ? drainTimeoutMs : batchMs );
+		while( !batch.empty() ) {
+			record.clear();
+			encodeRecord( batch.front(), record );
+			if( ring->push(record.data(), record.size()) ) {
+				batch.pop_front();
+			} else if( monotonicMs() < deadline ) {
+				usleep( 1000 );
+			} else {
+				break;
+			}
+		}
+		while( batch.size() > queueLimit ) {
+			batch.pop_front();
+			Stats::increment( Stats::EventsDropped );
+		}
+
+		if( draining ) {
+			Stats::increment( Stats::EventsDropped, batch.size() );
+			pthread_mutex_lock( &queueMutex );
+			stopped = true;
+			pthread_cond_broadcast( &queueCond );
+			pthread_mutex_unlock( &queueMutex );
+			return NULL;
+		}
+	}
+}
@@ -0,0 +1,107 @@
+#ifndef __EVENTS_H
+#define __EVENTS_H
+
+#include <string>
+#include <deque>
+#include <pthread.h>
+#include <time.h>
+using namespace std;
+
+struct Origin;
+class SpscRing;
+
+//Structured session events pushed to a collector listening on a unix socket.
+//	Sessions only ever queue an event, a background thread batches them by
+//	count and time and writes them out. When the collector is gone or slow
+//	the queue is bounded: either the oldest events are dropped, or they are
+//	handed to the background thread to spill to a file, and replayed ahead
+//	of anything newer once the collector is back.
+//
+//	A worker process hands its events to the supervisor through a ring in
+//	shared memory instead, and only the supervisor talks to the collector.
+//
+//	Two wire formats are supported:
+//	  json    one object per line, e.g.
+//	          {"time":"2026-10-18T12:34:56.789Z","mono":1234.567,"type":"login_fail","ip":"10.0.0.1","user":"root","pass":"admin"}
+//	          commands carry "cmd" and, when signatures matched, "tags":["wget",...]
+//	          new download indicators carry "indicator", sent in cmd in binary
+//	          peers found in the IP database carry "asn", "country" and "as_org"
+//	  binary  length-prefixed frames, all integers big endian:
+//	          u32 length of what follows, u8 version (3), u8 type,
+//	          u64 wall-clock ms since the epoch, u64 monotonic ms,
+//	          then ip, user, pass, cmd and the comma separated tags each
+//	          as a u16 length and the bytes, then the u32 asn (0 unknown),
+//	          country and AS name the same way. Version 1 frames end after
+//	          cmd, version 2 after tags.
+class Events {
+    public:
+	enum Type { Connect, LoginSuccess, LoginFail, Command, Disconnect, Indicator, Trace };
+	enum Format { Json, Binary };
+	enum Overflow { DropOldest, Spill };
+
+	//Start exporting to the collector at path. Starts a background thread,
+	//	so call it after forking. Until then emit() does nothing.
+	static void init( string path, Format format, int batchCount, int batchMs,
+		int queueLimit, Overflow overflow, string spillPath );
+
+	//Hand the events to the supervisor through ring rather than to a
+	//	collector, for a worker process. Starts a background thread too.
+	static void initRing( SpscRing* ring, int batchCount, int batchMs, int queueLimit );
+
+	//Queue an event a worker put in its ring, keeping its time stamps
+	static void relay( const char* record, size_t length );
+
+	//Queue an event, never blocks on the collector. origin is where ip is
+	//	announced from, or NULL.
+	static void emit( Type type, const string& ip, const Origin* origin, const char* user="", const char* pass="", const char* cmd="", const char* tags="" );
+
+	//Deliver what's queued, or spill it, giving up after timeoutMs
+	static void shutdown( int timeoutMs );
+
+	static const char* typeName( Type type );
+
+    protected:
+	struct Event {
+		Type type;
+		timespec wall;
+		timespec mono;
+		string ip;
+		const Origin* origin;
+		string user;
+		string pass;
+		string cmd;
+		string tags;
+	};
+
+	static void* exporter( void* );
+	static void* ringExporter( void* );
+	static void enqueue( const Event& event );
+	static void format( const Event& event, string& out );
+	static void encodeRecord( const Event& event, string& out );
+	static bool decodeRecord( const char* record, size_t length, Event& event );
+	static bool connectCollector();
+	static void disconnectCollector();
+	static bool sendPending( int timeoutMs );
+	static void spill( deque<Event>& events );
+	static void loadSpill();
+	static void saveBacklog( deque<Event>& batch );
+
+	static bool enabled;
+	static string collectorPath;
+	static Format wireFormat;
+	static int batchCount;
+	static int batchMs;
+	static size_t queueLimit;
+	static Overflow overflow;
+	static string spillPath;
+	static SpscRing* ring;
+
+	static deque<Event> queue;
+	static deque<Event> overflowed; //A full queue waiting for the exporter to spill it
+	static pthread_mutex_t queueMutex;
+	static pthread_cond_t queueCond;
+	static bool stopping;
+	static bool stopped;
+};
+
+#endif
@@ -0,0 +1,340 @@
+#include "geoip.h"
+
+#include <fstream>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+
+#include "logger.h"
+
+typedef unsigned __int128 Key6;
+
+enum Family { V4, V6, NumFamilies };
+
+//Top bits of an address indexed per family
+static const int INDEX_BITS = 16;
+static const size_t INDEX_ENTRIES = ( 1 << INDEX_BITS ) + 1;
+
+//The image is laid out as a Header, the origins, the AS name pool, then per
+//	family the index, the origin of each range, and the range starts and ends
+struct Header {
+	unsigned long long numOrigins;
+	unsigned long long count[NumFamilies];
+	unsigned long long offsets[NumFamilies][4];
+};
+
+const char* GeoIp::image = NULL;
+size_t GeoIp::imageLength = 0;
+
+template<typename K>
+struct Range {
+	K start;
+	K end;
+	unsigned int origin;
+
+	bool operator<( const Range& other ) const {
+		return start < other.start;
+	}
+};
+
+static size_t alignUp( size_t n ) {
+	return ( n + 15 ) & ~(size_t)15;
+}
+
+//Parse an IPv4 or IPv6 address into its family and value
+static bool parseAddress( const string& text, int& family, Key6& value ) {
+	unsigned char bytes[16];
+	int length;
+	if( inet_pton(AF_INET, text.c_str(), bytes) == 1 ) {
+		family = V4;
+		length = 4;
+	} else if( inet_pton(AF_INET6, text.c_str(), bytes) == 1 ) {
+		family = V6;
+		length = 16;
+	} else {
+		return false;
+	}
+	value = 0;
+	for( int i = 0; i < length; i++ ) {
+		value = ( value << 8 ) | bytes[i];
+	}
+	return true;
+}
+
+//Split line at delimiter into at most max fields, the last one taking the rest
+static void split( const string& line, char delimiter, size_t max, vector<string>& fields ) {
+	fields.clear();
+	size_t start = 0;
+	while( fields.size() + 1 < max ) {
+		size_t end = line.find( delimiter, start );
+		if( end == string::npos ) {
+			break;
+		}
+		fields.push_back( line.substr(start, end - start) );
+		start = end + 1;
+	}
+	fields.push_back( line.substr(start) );
+}
+
+static string trim( const string& s ) {
+	size_t start = s.find_first_not_of( " \t\"" );
+	if( start == string::npos ) {
+		return "";
+	}
+	return s.substr( start, s.find_last_not_of(" \t\"") - start + 1 );
+}
+
+//Where the first range that could hold an address in each block starts, and
+//	one past the last range, so a lookup only searches between two entries
+template<typename K>
+static void buildIndex( const vector< Range<K> >& ranges, int shift, unsigned int* index ) {
+	size_t i = 0;
+	for( size_t block = 0; block + 1 < INDEX_ENTRIES; block++ ) {
+		K boundary = (K)block << shift;
+		while( i < ranges.size() && ranges[i].end < boundary ) {
+			i++;
+		}
+		index[block] = i;
+	}
+	index[INDEX_ENTRIES - 1] = ranges.size();
+}
+
+//Sort the ranges and drop the ones that overlap an earlier one, returns how many went
+template<typename K>
+static size_t sortRanges( vector< Range<K> >& ranges ) {
+	stable_sort( ranges.begin(), ranges.end() );
+	size_t kept = 0;
+	for( size_t i = 0; i < ranges.size(); i++ ) {
+		if( kept > 0 && ranges[i].start <= ranges[kept - 1].end ) {
+			continue;
+		}
+		ranges[kept++] = ranges[i];
+	}
+	size_t dropped = ranges.size() - kept;
+	ranges.resize( kept );
+	return dropped;
+}
+
+template<typename K>
+static void placeRanges( const vector< Range<K> >& ranges, char* mem, const unsigned long long* offsets, int shift ) {
+	buildIndex( ranges, shift, (unsigned int*)( mem + offsets[0] ) );
+	unsigned int* origins = (unsigned int*)( mem + offsets[1] );
+	K* starts = (K*)( mem + offsets[2] );
+	K* ends = (K*)( mem + offsets[3] );
+	for( size_t i = 0; i < ranges.size(); i++ ) {
+		origins[i] = ranges[i].origin;
+		starts[i] = ranges[i].start;
+		ends[i] = ranges[i].end;
+	}
+}
+
+template<typename K>
+static const Origin* findRange( const char* image, const unsigned long long* offsets, size_t count, K key, int shift ) {
+	const unsigned int* index = (const unsigned int*)( image + offsets[0] );
+	const K* starts = (const K*)( image + offsets[2] );
+	unsigned int block = key >> shift;
+	size_t low = index[block];
+	size_t high = index[block + 1];
+	if( low >= count || starts[low] > key ) {
+		return NULL;
+	}
+	if( high >= count ) {
+		high = count - 1;
+	}
+
+	//The last range starting at or before key
+	while( low < high ) {
+		size_t middle = ( low + high + 1 ) / 2;
+		if( starts[middle] <= key ) {
+			low = middle;
+		} else {
+			high = middle - 1;
+		}
+	}
+
+	const K* ends = (const K*)( image + offsets[3] );
+	if( ends[low] < key ) {
+		return NULL;
+	}
+	const unsigned int* origins = (const unsigned int*)( image + offsets[1] );
+	return (const Origin*)( image + sizeof(Header) ) + origins[low];
+}
+
+void GeoIp::load( const string& path ) {
+	ifstream in( path.c_str() );
+	if( !in ) {
+		throw string("Could not read the IP database from ") + path;
+	}
+
+	vector< Range<unsigned int> > ranges4;
+	vector< Range<Key6> > ranges6;
+	vector<Origin> origins;
+	vector<string> orgs;
+	map<string, unsigned int> originIds;
+	size_t skipped = 0;
+	string line;
+	vector<string> fields;
+	while( getline(in, line) ) {
+		if( !line.empty() && line[line.size() - 1] == '\r' ) {
+			line.erase( line.size() - 1 );
+		}
+		if( line.empty() || line[0] == '#' ) {
+			continue;
+		}
+
+		//A network takes one field where a range takes two
+		char delimiter = line.find( '\t' ) != string::npos ? '\t' : ',';
+		size_t slash = line.find( '/' );
+		bool network = slash != string::npos && slash < line.find( delimiter );
+		split( line, delimiter, network ? 4 : 5, fields );
+		if( fields.size() < ( network ? 3 : 4 ) ) {
+			skipped++;
+			continue;
+		}
+
+		int family, endFamily = -1;
+		Key6 start, end;
+		if( network ) {
+			char* rest;
+			string& text = fields[0];
+			slash = text.find( '/' );
+			long length = strtol( text.c_str() + slash + 1, &rest, 10 );
+			if( !parseAddress(text.substr(0, slash), family, start) || *rest != '\0' || length < 0 || length > ( family == V4 ? 32 : 128 ) ) {
+				skipped++;
+				continue;
+			}
+			int hostBits = ( family == V4 ? 32 : 128 ) - length;
+			Key6 hostMask = hostBits == 128 ? ~(Key6)0 : ( (Key6)1 << hostBits ) - 1;
+			start &= ~hostMask;
+			end = start | hostMask;
+			endFamily = family;
+			fields.insert( fields.begin() + 1, "" );
+		} else if( !parseAddress(trim(fields[0]), family, start) || !parseAddress(trim(fields[1]), endFamily, end) ) {
+			skipped++;
+			continue;
+		}
+
+		string asnText = trim( fields[2] );
+		if( asnText.compare(0, 2, "AS") == 0 ) {
+			asnText.erase( 0, 2 );
+		}
+		unsigned long asn = strtoul( asnText.c_str(), NULL, 10 );
+		if( asn == 0 ) {
+			continue;
+		}
+		if( family != endFamily || end < start ) {
+			skipped++;
+			continue;
+		}
+
+		//Share one origin between all the ranges of an AS in a country
+		string country = trim( fields[3] );
+		if( country.size() != 2 ) {
+			country.clear();
+		}
+		string org = fields.size() > 4 ? trim( fields[4] ) : "";
+		string originKey = asnText + "\t" + country + "\t" + org;
+		map<string, unsigned int>::iterator found = originIds.find( originKey );
+		unsigned int originId;
+		if( found != originIds.end() ) {
+			originId = found->second;
+		} else {
+			Origin origin;
+			memset( &origin, 0, sizeof(origin) );
+			origin.asn = asn;
+			memcpy( origin.country, country.data(), country.size() );
+			originId = origins.size();
+			originIds[originKey] = originId;
+			origins.push_back( origin );
+			orgs.push_back( org );
+		}
+
+		if( family == V4 ) {
+			Range<unsigned int> range = { (unsigned int)start, (unsigned int)end, originId };
+			ranges4.push_back( range );
+		} else {
+			Range<Key6> range = { start, end, originId };
+			ranges6.push_back( range );
+		}
+	}
+	size_t overlapping = sortRanges( ranges4 ) + sortRanges( ranges6 );
+
+	//Lay the image out
+	size_t poolLength = 0;
+	for( size_t i = 0; i < orgs.size(); i++ ) {
+		poolLength += orgs[i].size() + 1;
+	}
+	size_t counts[NumFamilies] = { ranges4.size(), ranges6.size() };
+	size_t keySizes[NumFamilies] = { sizeof(unsigned int), sizeof(Key6) };
+	size_t poolOffset = sizeof(Header) + origins.size() * sizeof(Origin);
+	size_t length = alignUp( poolOffset + poolLength );
+	unsigned long long offsets[NumFamilies][4];
+	for( int f = 0; f < NumFamilies; f++ ) {
+		offsets[f][0] = length;
+		offsets[f][1] = offsets[f][0] + INDEX_ENTRIES * sizeof(unsigned int);
+		offsets[f][2] = alignUp( offsets[f][1] + counts[f] * sizeof(unsigned int) );
+		offsets[f][3] = offsets[f][2] + counts[f] * keySizes[f];
+		length = alignUp( offsets[f][3] + counts[f] * keySizes[f] );
+	}
+
+	char* mem = (char*) mmap( NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+	if( mem == MAP_FAILED ) {
+		throw string("Could not map the IP database");
+	}
+
+	Header* header = (Header*) mem;
+	header->numOrigins = origins.size();
+	memcpy( header->count, counts, sizeof(header->count) );
+	memcpy( header->offsets, offsets, sizeof(header->offsets) );
+
+	Origin* placed = (Origin*)( mem + sizeof(Header) );
+	char* pool = mem + poolOffset;
+	for( size_t i = 0; i < origins.size(); i++ ) {
+		placed[i] = origins[i];
+		placed[i].org = pool;
+		memcpy( pool, orgs[i].c_str(), orgs[i].size() + 1 );
+		pool += orgs[i].size() + 1;
+	}
+	placeRanges( ranges4, mem, offsets[V4], 32 - INDEX_BITS );
+	placeRanges( ranges6, mem, offsets[V6], 128 - INDEX_BITS );
+
+	//Sessions only ever read it, and may hold on to its origins, so an earlier image stays mapped
+	mprotect( mem, length, PROT_READ );
+	image = mem;
+	imageLength = length;
+
+	Logger::info() << "Loaded " << counts[V4] << " IPv4 and " << counts[V6] << " IPv6 ranges of " << origins.size()
+		<< " origins from " << path << " into a " << length << " byte table, skipped " << skipped
+		<< " bad lines and " << overlapping << " overlapping ranges" << endl;
+}
+
+const Origin* GeoIp::lookup( const sockaddr* address ) {
+	if( image == NULL ) {
+		return NULL;
+	}
+
+	const Header* header = (const Header*) image;
+	if( address->sa_family == AF_INET ) {
+		unsigned int key = ntohl( ((const sockaddr_in*) address)->sin_addr.s_addr );
+		return findRange( image, header->offsets[V4], header->count[V4], key, 32 - INDEX_BITS );
+	}
+	if( address->sa_family == AF_INET6 ) {
+		const in6_addr* address6 = &((const sockaddr_in6*) address)->sin6_addr;
+		if( IN6_IS_ADDR_V4MAPPED(address6) ) {
+			unsigned int key;
+			memcpy( &key, address6->s6_addr + 12, sizeof(key) );
+			return findRange( image, header->offsets[V4], header->count[V4], ntohl(key), 32 - INDEX_BITS );
+		}
+		Key6 key = 0;
+		for( int i = 0; i < 16; i++ ) {
+			key = ( key << 8 ) | address6->s6_addr[i];
+		}
+		return findRange( image, header->offsets[V6], header->count[V6], key, 128 - INDEX_BITS );
+	}
+	return NULL;
+}
@@ -0,0 +1,46 @@
+#ifndef __GEOIP_H
+#define __GEOIP_H
+
+#include <string>
+#include <sys/socket.h>
+using namespace std;
+
+//Where an address is announced from, as far as the database knows
+struct Origin {
+	unsigned int asn;
+	char country[4];
+	const char* org;
+};
+
+//Offline ASN and country lookups from a local IP range database, so every
+//	event can say where its session came from without anything downstream
+//	or on the network. Each session looks its peer up once at connect time.
+//
+//	The file is compiled at startup into one read-only memory mapping: per
+//	address family the non-overlapping ranges sorted by start, with a table
+//	on the top 16 bits of the address that narrows each lookup down to a
+//	handful of ranges for the binary search. The origins are deduplicated
+//	and their AS names pooled behind them.
+//
+//	Two line shapes are read, tab or comma separated:
+//	  start, end, asn, country, AS name   e.g. ip2asn-combined.tsv
+//	  network/length, asn, country, AS name   e.g. a converted GeoLite2 CSV
+//	IPv4 and IPv6 can be mixed. "AS" in front of the number, quotes around
+//	the name and a missing name are fine. Lines with ASN 0 (not routed)
+//	and lines starting with # are skipped, and so are ranges overlapping
+//	one that starts earlier.
+class GeoIp {
+    public:
+	//Compile the database in path, throws a string if it can't be read
+	static void load( const string& path );
+
+	//The origin of an address, or NULL if it isn't in the database. The
+	//	Origin stays valid for the life of the process.
+	static const Origin* lookup( const sockaddr* address );
+
+    protected:
+	static const char* image;
+	static size_t imageLength;
+};
+
+#endif
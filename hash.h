@@ -0,0 +1,22 @@
+#ifndef __HASH_H
+#define __HASH_H
+
+#include <cstddef>
+
+//FNV-1a, with the murmur3 finalizer so every bit of the result is mixed.
+//	Used to spread keys over the sketches and tables.
+inline unsigned long long hashBytes( const char* data, size_t length ) {
+	unsigned long long h = 14695981039346656037ULL;
+	for( size_t i = 0; i < length; i++ ) {
+		h ^= (unsigned char)data[i];
+		h *= 1099511628211ULL;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+#endif
@@ -0,0 +1,285 @@
+#include "indicators.h"
+
+#include <cstring>
+#include <strings.h>
+#include <cstdio>
+#include <cerrno>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "stats.h"
+#include "events.h"
+#include "hash.h"
+
+//Slots an indicator may land in, past its home slot
+static const size_t PROBE = 16;
+
+bool Indicators::enabled = false;
+Indicators::Slot* Indicators::slots = NULL;
+size_t Indicators::mask = 0;
+int Indicators::fd = -1;
+string Indicators::path;
+
+static const char* schemes[] = { "http://", "https://", "ftp://", "tftp://" };
+static const int defaultPorts[] = { 80, 443, 21, 69 };
+
+void Indicators::init( const string& path, int capacity ) {
+	Indicators::path = path;
+	if( !path.empty() ) {
+		fd = open( path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644 );
+		if( fd == -1 ) {
+			throw string("Could not open indicator file ") + path;
+		}
+	}
+
+	size_t size = PROBE;
+	while( size < (size_t)( capacity > 0 ? capacity : 0 ) ) {
+		size *= 2;
+	}
+	slots = new Slot[size];
+	memset( (void*)slots, 0, sizeof(Slot) * size );
+	mask = size - 1;
+	enabled = true;
+}
+
+//Where a URL ends in a shell command line
+static bool endsUrl( unsigned char c ) {
+	return c <= ' ' || c == '\'' || c == '"' || c == '`' || c == ';' || c == '|' || c == '&'
+		|| c == '<' || c == '>' || c == '(' || c == ')' || c == 0x7f;
+}
+
+static bool isDigit( char c ) {
+	return c >= '0' && c <= '9';
+}
+
+static bool isWordChar( char c ) {
+	return isDigit(c) || ( c >= 'a' && c <= 'z' ) || ( c >= 'A' && c <= 'Z' ) || c == '.' || c == '_' || c == '-';
+}
+
+//Parses a dotted quad with an optional :port at data, normalized into out.
+//	Returns how many bytes it spans, 0 if there's none.
+static size_t parseAddress( const char* data, size_t length, string& out ) {
+	char normal[32];
+	int used = 0;
+	size_t i = 0;
+	for( int octet = 0; octet < 4; octet++ ) {
+		if( octet > 0 ) {
+			if( i >= length || data[i] != '.' ) {
+				return 0;
+			}
+			i++;
+		}
+		int value = 0, digits = 0;
+		while( i < length && isDigit(data[i]) && digits < 3 ) {
+			value = value * 10 + ( data[i++] - '0' );
+			digits++;
+		}
+		if( digits == 0 || value > 255 ) {
+			return 0;
+		}
+		used += snprintf( normal + used, sizeof(normal) - used, octet > 0 ? ".%d" : "%d", value );
+	}
+
+	size_t end = i;
+	if( i + 1 < length && data[i] == ':' && isDigit(data[i + 1]) ) {
+		int port = 0;
+		for( i++; i < length && isDigit(data[i]) && port <= 65535; i++ ) {
+			port = port * 10 + ( data[i] - '0' );
+		}
+		if( port > 0 && port <= 65535 ) {
+			used += snprintf( normal + used, sizeof(normal) - used, ":%d", port );
+			end = i;
+		}
+	}
+	if( end < length && isWordChar(data[end]) ) {
+		return 0;
+	}
+	out.assign( normal, used );
+	return end;
+}
+
+//Lowercases the scheme and host, drops the fragment, a trailing dot on the
+//	host and the scheme's default port. Returns false if there's no host.
+static bool normalizeUrl( string& url, int scheme ) {
+	size_t hash = url.find( '#' );
+	if( hash != string::npos ) {
+		url.erase( hash );
+	}
+
+	size_t hostStart = strlen( schemes[scheme] );
+	size_t hostEnd = url.find_first_of( "/?", hostStart );
+	if( hostEnd == string::npos ) {
+		hostEnd = url.size();
+	}
+	for( size_t i = 0; i < hostEnd; i++ ) {
+		if( url[i] >= 'A' && url[i] <= 'Z' ) {
+			url[i] += 'a' - 'A';
+		}
+	}
+
+	//The port is after the last colon, unless that's inside an [IPv6] literal
+	size_t colon = url.rfind( ':', hostEnd - 1 );
+	if( colon != string::npos && colon >= hostStart && url.find( ']', colon ) == string::npos ) {
+		string port = url.substr( colon + 1, hostEnd - colon - 1 );
+		char portText[8];
+		snprintf( portText, sizeof(portText), "%d", defaultPorts[scheme] );
+		if( port.empty() || port == portText ) {
+			url.erase( colon, hostEnd - colon );
+			hostEnd = colon;
+		}
+	}
+	if( hostEnd > hostStart && url[hostEnd - 1] == '.' ) {
+		url.erase( hostEnd - 1, 1 );
+		hostEnd--;
+	}
+	return hostEnd > hostStart;
+}
+
+void Indicators::scan( const char* line, size_t length, const string& ip, const Origin* origin, const char* user ) {
+	if( !enabled ) {
+		return;
+	}
+
+	long now = time( NULL );
+	string indicator;
+	size_t i = 0;
+	while( i < length ) {
+		//URLs, starting with a scheme we know
+		int scheme = -1;
+		for( int s = 0; s < 4 && scheme == -1; s++ ) {
+			size_t schemeLength = strlen( schemes[s] );
+			if( length - i >= schemeLength && strncasecmp(line + i, schemes[s], schemeLength) == 0 ) {
+				scheme = s;
+			}
+		}
+		if( scheme != -1 ) {
+			size_t end = i;
+			while( end < length && !endsUrl(line[end]) ) {
+				end++;
+			}
+			indicator.assign( line + i, end - i );
+			if( normalizeUrl(indicator, scheme) ) {
+				unsigned long long h = hashBytes( indicator.data(), indicator.size() );
+				if( record(h, now) ) {
+					report( indicator, h, now, ip, origin, user );
+				}
+			}
+			i = end;
+			continue;
+		}
+
+		//Bare addresses, as tftp and ftpget take them
+		if( isDigit(line[i]) && ( i == 0 || !isWordChar(line[i - 1]) ) ) {
+			size_t span = parseAddress( line + i, length - i, indicator );
+			if( span > 0 ) {
+				unsigned long long h = hashBytes( indicator.data(), indicator.size() );
+				if( record(h, now) ) {
+					report( indicator, h, now, ip, origin, user );
+				}
+				i += span;
+				continue;
+			}
+		}
+		i++;
+	}
+}
+
+bool Indicators::record( unsigned long long hash, long now ) {
+	Stats::increment( Stats::IndicatorsSeen );
+	if( hash == 0 ) {
+		hash = 1;
+	}
+
+	//Count it in its slot, or claim an empty one. Another session taking
+	//	the slot we were after may have been recording this same indicator,
+	//	so the probe starts over then.
+	for( int attempt = 0; attempt < 4; attempt++ ) {
+		Slot* oldest = NULL;
+		for( size_t i = 0; i < PROBE; i++ ) {
+			Slot* slot = &slots[( hash + i ) & mask];
+			unsigned long long cur = slot->hash;
+			if( cur == 0 && __sync_bool_compare_and_swap(&slot->hash, 0ULL, hash) ) {
+				slot->firstSeen = now;
+				slot->lastSeen = now;
+				slot->count = 1;
+				Stats::increment( Stats::IndicatorsNew );
+				return true;
+			}
+			cur = slot->hash;
+			if( cur == hash ) {
+				__sync_fetch_and_add( &slot->count, 1 );
+				slot->lastSeen = now;
+				return false;
+			}
+			if( oldest == NULL || slot->lastSeen < oldest->lastSeen ) {
+				oldest = slot;
+			}
+		}
+
+		//Full, make room by forgetting the indicator seen longest ago
+		unsigned long long evicted = oldest->hash;
+		if( __sync_bool_compare_and_swap(&oldest->hash, evicted, hash) ) {
+			oldest->firstSeen = now;
+			oldest->lastSeen = now;
+			oldest->count = 1;
+			Stats::increment( Stats::IndicatorsNew );
+			return true;
+		}
+	}
+
+	//Lost every race, it'll be back
+	return false;
+}
+
+static void formatTime( long t, char* buf, size_t size ) {
+	time_t seconds = t;
+	struct tm tm;
+	strftime( buf, size, "%Y-%m-%dT%H:%M:%SZ", gmtime_r(&seconds, &tm) );
+}
+
+void Indicators::report( const string& indicator, unsigned long long hash, long now, const string& ip, const Origin* origin, const char* user ) {
+	LOG_INFO( "New indicator {} from {}", indicator, ip );
+	Events::emit( Events::Indicator, ip, origin, user, "", indicator.c_str() );
+
+	if( fd == -1 ) {
+		return;
+	}
+	char seen[32];
+	formatTime( now, seen, sizeof(seen) );
+	char prefix[96];
+	snprintf( prefix, sizeof(prefix), "%s\t%016llx\t", seen, hash );
+	string out = prefix + ip + "\t" + indicator + "\n";
+
+	//One write per line, so lines from concurrent sessions don't interleave
+	if( write(fd, out.data(), out.size()) != (ssize_t)out.size() ) {
+		LOG_INFO( "Could not append to {}, errno {}", path, errno );
+	}
+}
+
+void Indicators::shutdown() {
+	if( !enabled || path.empty() ) {
+		return;
+	}
+
+	string countsPath = path + ".counts";
+	string tmpPath = countsPath + ".tmp";
+	FILE* out = fopen( tmpPath.c_str(), "w" );
+	if( out == NULL ) {
+		Logger::info() << "Could not write " << tmpPath << ", errno " << errno << endl;
+		return;
+	}
+	for( size_t i = 0; i <= mask; i++ ) {
+		const Slot& slot = slots[i];
+		if( slot.hash == 0 ) {
+			continue;
+		}
+		char first[32], last[32];
+		formatTime( slot.firstSeen, first, sizeof(first) );
+		formatTime( slot.lastSeen, last, sizeof(last) );
+		fprintf( out, "%016llx\t%s\t%s\t%ld\n", (unsigned long long)slot.hash, first, last, (long)slot.count );
+	}
+	fclose( out );
+	rename( tmpPath.c_str(), countsPath.c_str() );
+}
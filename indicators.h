@@ -0,0 +1,55 @@
+#ifndef __INDICATORS_H
+#define __INDICATORS_H
+
+#include <string>
+using namespace std;
+
+struct Origin;
+
+//Payload references found in shell commands: URLs (http, https, ftp,
+//	tftp) and bare IPv4 hosts, as bots type them in wget, tftp or ftpget
+//	lines. Nothing is ever fetched.
+//
+//	Each indicator is normalized (lowercase scheme and host, default port
+//	and fragment dropped, leading zeros taken out of addresses) and hashed
+//	into a fixed size table holding its first-seen and last-seen time and
+//	count. Only indicators the table hasn't seen go on: to the event stream
+//	and to an append-only file, one line each:
+//	  <first seen>	<hash>	<ip>	<indicator>
+//	When the table is full the entry seen longest ago makes room, so an
+//	indicator that comes back much later is reported again.
+class Indicators {
+    public:
+	//Keep up to capacity indicators (rounded up to a power of two, at least
+	//	16), append new ones to path unless it's empty. Throws a string if
+	//	path can't be opened.
+	static void init( const string& path, int capacity );
+
+	//Extract the indicators in a command typed by ip, announced from origin
+	static void scan( const char* line, size_t length, const string& ip, const Origin* origin, const char* user );
+
+	//Write first-seen, last-seen and count of every indicator in the table
+	//	to path.counts, keyed by hash
+	static void shutdown();
+
+    protected:
+	struct Slot {
+		volatile unsigned long long hash;
+		volatile long count;
+		volatile long firstSeen;
+		volatile long lastSeen;
+	};
+
+	//Whether the indicator is new to the table, counts it unless it lost
+	//	every race for a slot
+	static bool record( unsigned long long hash, long now );
+	static void report( const string& indicator, unsigned long long hash, long now, const string& ip, const Origin* origin, const char* user );
+
+	static bool enabled;
+	static Slot* slots;
+	static size_t mask;
+	static int fd;
+	static string path;
+};
+
+#endif
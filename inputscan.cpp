@@ -0,0 +1,93 @@
+#include "inputscan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define INPUTSCAN_X86
+#endif
+
+InputScan::FindFunction InputScan::find = InputScan::choose();
+
+static inline bool isSpecial( unsigned char c ) {
+	return c < 0x20 || c == 0x7f || c == 0xff;
+}
+
+size_t InputScan::findSpecialScalar( const char* data, size_t length ) {
+	for( size_t i = 0; i < length; i++ ) {
+		if( isSpecial(data[i]) ) {
+			return i;
+		}
+	}
+	return length;
+}
+
+#ifdef INPUTSCAN_X86
+
+//The lanes holding a special byte: below 0x20 (min(c, 0x1f) == c), DEL or IAC
+static inline __m128i specialLanes( __m128i v ) {
+	__m128i control = _mm_cmpeq_epi8( _mm_min_epu8(v, _mm_set1_epi8(0x1f)), v );
+	__m128i del = _mm_cmpeq_epi8( v, _mm_set1_epi8(0x7f) );
+	__m128i iac = _mm_cmpeq_epi8( v, _mm_set1_epi8((char)0xff) );
+	return _mm_or_si128( control, _mm_or_si128(del, iac) );
+}
+
+size_t InputScan::findSpecialSse2( const char* data, size_t length ) {
+	size_t i = 0;
+	for( ; i + 16 <= length; i += 16 ) {
+		__m128i v = _mm_loadu_si128( (const __m128i*)(data + i) );
+		int mask = _mm_movemask_epi8( specialLanes(v) );
+		if( mask != 0 ) {
+			return i + __builtin_ctz( mask );
+		}
+	}
+	return i + findSpecialScalar( data + i, length - i );
+}
+
+__attribute__((target("avx2")))
+size_t InputScan::findSpecialAvx2( const char* data, size_t length ) {
+	const __m256i low = _mm256_set1_epi8( 0x1f );
+	const __m256i del = _mm256_set1_epi8( 0x7f );
+	const __m256i iac = _mm256_set1_epi8( (char)0xff );
+
+	size_t i = 0;
+	for( ; i + 32 <= length; i += 32 ) {
+		__m256i v = _mm256_loadu_si256( (const __m256i*)(data + i) );
+		__m256i special = _mm256_or_si256( _mm256_cmpeq_epi8(_mm256_min_epu8(v, low), v),
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, del), _mm256_cmpeq_epi8(v, iac)) );
+		unsigned int mask = _mm256_movemask_epi8( special );
+		if( mask != 0 ) {
+			return i + __builtin_ctz( mask );
+		}
+	}
+	return i + findSpecialSse2( data + i, length - i );
+}
+
+InputScan::FindFunction InputScan::choose() {
+	__builtin_cpu_init();
+	if( __builtin_cpu_supports("avx2") ) {
+		return findSpecialAvx2;
+	}
+	return findSpecialSse2;
+}
+
+#else
+
+size_t InputScan::findSpecialSse2( const char* data, size_t length ) {
+	return findSpecialScalar( data, length );
+}
+
+size_t InputScan::findSpecialAvx2( const char* data, size_t length ) {
+	return findSpecialScalar( data, length );
+}
+
+InputScan::FindFunction InputScan::choose() {
+	return findSpecialScalar;
+}
+
+#endif
+
+const char* InputScan::implementation() {
+	if( find == findSpecialScalar ) {
+		return "scalar";
+	}
+	return find == findSpecialAvx2 ? "avx2" : "sse2";
+}
@@ -0,0 +1,35 @@
+#ifndef __INPUTSCAN_H
+#define __INPUTSCAN_H
+
+#include <cstddef>
+using namespace std;
+
+//Finds the bytes of client input that need more than being appended to the
+//	line: control characters (CR, LF, ESC, BS, ...), DEL and IAC. Bots paste
+//	kilobytes of plain text, which getLine() can then copy in one go instead
+//	of a byte at a time. Uses AVX2 when the CPU has it, SSE2 otherwise, and
+//	plain C++ on other architectures.
+class InputScan {
+    public:
+	//Offset of the first special byte in data, or length if there is none
+	static size_t findSpecial( const char* data, size_t length );
+
+	//The implementations, for the benchmark
+	static size_t findSpecialScalar( const char* data, size_t length );
+	static size_t findSpecialSse2( const char* data, size_t length );
+	static size_t findSpecialAvx2( const char* data, size_t length );
+
+	//Name of the implementation findSpecial() uses
+	static const char* implementation();
+
+    protected:
+	typedef size_t (*FindFunction)( const char*, size_t );
+	static FindFunction find;
+	static FindFunction choose();
+};
+
+inline size_t InputScan::findSpecial( const char* data, size_t length ) {
+	return find( data, length );
+}
+
+#endif
@@ -0,0 +1,113 @@
+// Implementation of the IOBackend and BlockingBackend classes
+
+#include "IOBackend.h"
+#include "UringBackend.h"
+#include <errno.h>
+#include <string.h>
+#include <poll.h>
+
+
+IOBackend* IOBackend::create ( const std::string& name ) {
+	if( name == "uring" ) {
+		UringBackend* uring = UringBackend::create();
+		if( uring != NULL ) {
+			return uring;
+		}
+	}
+
+	return new BlockingBackend();
+}
+
+int BlockingBackend::accept ( int listenFd, sockaddr* addr, socklen_t* addrLen, int wakeFd ) {
+	while( true ) {
+		//Wait for either a connection or the wake fd, the listening socket may
+		//	be shared with another process so accept() itself mustn't block
+		if( wakeFd != -1 ) {
+			pollfd pfd[2];
+			pfd[0].fd = listenFd;
+			pfd[0].events = POLLIN;
+			pfd[0].revents = 0;
+			pfd[1].fd = wakeFd;
+			pfd[1].events = POLLIN;
+			pfd[1].revents = 0;
+
+			if( ::poll( pfd, 2, -1 ) == -1 ) {
+				if( errno == EINTR ) {
+					continue;
+				}
+				return -1;
+			}
+			if( pfd[1].revents & POLLIN ) {
+				errno = EINTR;
+				return -1;
+			}
+		}
+
+		int fd = ::accept( listenFd, addr, addrLen );
+		if( fd == -1 && ( errno == EINTR || ( wakeFd != -1 && ( errno == EAGAIN || errno == EWOULDBLOCK ) ) ) ) {
+			continue;
+		}
+		return fd;
+	}
+}
+
+int BlockingBackend::recv ( int fd, char* buf, int max, int timeoutMs ) {
+	if( timeoutMs >= 0 ) {
+		pollfd pfd;
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+
+		int ready;
+		do {
+			ready = ::poll( &pfd, 1, timeoutMs );
+		} while( ready == -1 && errno == EINTR );
+
+		if( ready == 0 ) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+	}
+
+	int status;
+	do {
+		status = ::recv( fd, buf, max, 0 );
+	} while( status == -1 && errno == EINTR );
+
+	return status;
+}
+
+bool BlockingBackend::sendv ( int fd, const struct iovec* iov, int iovCount ) {
+	//Copy the vector so we can advance it past partial writes
+	struct iovec vec[iovCount];
+	memcpy( vec, iov, sizeof(struct iovec) * iovCount );
+
+	struct iovec* cur = vec;
+	while( iovCount > 0 ) {
+		msghdr msg;
+		memset( &msg, 0, sizeof(msg) );
+		msg.msg_iov = cur;
+		msg.msg_iovlen = iovCount;
+
+		ssize_t sent = ::sendmsg( fd, &msg, MSG_NOSIGNAL );
+		if( sent == -1 ) {
+			if( errno == EINTR ) {
+				continue;
+			}
+			return false;
+		}
+
+		//Skip over everything that was fully written
+		while( iovCount > 0 && (size_t)sent >= cur->iov_len ) {
+			sent -= cur->iov_len;
+			cur++;
+			iovCount--;
+		}
+		if( iovCount > 0 ) {
+			cur->iov_base = (char*)cur->iov_base + sent;
+			cur->iov_len -= sent;
+		}
+	}
+
+	return true;
+}
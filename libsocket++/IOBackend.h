@@ -0,0 +1,59 @@
+// Definition of the IOBackend class
+//
+// An IOBackend performs the accept/recv/send syscalls on behalf of a Socket.
+// The default backend just calls the blocking syscalls directly, other
+// backends (see UringBackend.h) can batch or avoid syscalls entirely while
+// keeping the same blocking semantics for the caller.
+
+#ifndef IOBackend_class
+#define IOBackend_class
+
+#include <string>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+
+class IOBackend
+{
+ public:
+  virtual ~IOBackend() {};
+
+  // Blocking accept on a listening socket, returns the new fd or -1. When
+  //  wakeFd is given and becomes readable first, returns -1 with errno
+  //  EINTR and leaves wakeFd for the caller to drain.
+  virtual int accept ( int listenFd, sockaddr* addr, socklen_t* addrLen, int wakeFd=-1 ) = 0;
+
+  // Blocking recv of up to max bytes, returns the count, 0 on EOF or -1.
+  //  Gives up with errno ETIMEDOUT after timeoutMs, unless it is negative.
+  virtual int recv ( int fd, char* buf, int max, int timeoutMs=-1 ) = 0;
+
+  // Send all of the buffers in order, returns false if any of them failed
+  virtual bool sendv ( int fd, const struct iovec* iov, int iovCount ) = 0;
+
+  // Called before the socket is closed so per-fd state can be dropped
+  virtual void release ( int fd ) {};
+
+  // Create a backend of the same kind for a newly accepted connection
+  virtual IOBackend* spawn() const = 0;
+
+  virtual const char* name() const = 0;
+
+  // Create a backend by name ("blocking" or "uring"). Falls back to the
+  //  blocking backend when the requested one isn't available.
+  static IOBackend* create ( const std::string& name );
+};
+
+
+class BlockingBackend : public IOBackend
+{
+ public:
+  int accept ( int listenFd, sockaddr* addr, socklen_t* addrLen, int wakeFd=-1 );
+  int recv ( int fd, char* buf, int max, int timeoutMs=-1 );
+  bool sendv ( int fd, const struct iovec* iov, int iovCount );
+  IOBackend* spawn() const { return new BlockingBackend(); }
+  const char* name() const { return "blocking"; }
+};
+
+
+#endif
@@ -9,20 +9,84 @@
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <time.h>
 
 
 
 Socket::Socket() {
 	m_sock = -1;
 	memset ( &m_addr, 0, sizeof(m_addr) );
+	m_backend = new BlockingBackend();
+	m_rpos = 0;
+	m_rlen = 0;
+	m_shared = NULL;
+	m_readTimeout = -1;
+	m_deadline = -1;
+	m_rateBytes = 0;
+	m_rateInterval = 0;
+	m_intervalEnd = -1;
+	m_intervalBytes = 0;
+	m_bytesIn = 0;
+	m_bytesOut = 0;
+	m_recordFd = -1;
+	m_recordStart = 0;
+}
 
+static long long monotonic_ms() {
+	timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
 }
 
 Socket::~Socket() {
 	if ( is_valid() ) {
-		Logger::debug() << "Closing socket " << (int)m_sock << endl;
+		//Push out anything still queued, the peer may be waiting for it
+		flush();
+		
+		//Drop the backend first so it lets go of the fd before we close it
+		m_backend->release( m_sock );
+		delete m_backend;
+		m_backend = NULL;
+		
+		LOG_DEBUG( "Closing socket {}", (int)m_sock );
 		::close ( m_sock );
 	}
+	
+	delete m_backend;
+	
+	if ( m_recordFd != -1 ) {
+		::close ( m_recordFd );
+	}
+}
+
+void Socket::set_backend ( IOBackend* backend ) {
+	delete m_backend;
+	m_backend = backend;
+}
+
+IOBackend* Socket::backend() const {
+	return m_backend;
+}
+
+void Socket::set_read_timeout ( int ms ) {
+	m_readTimeout = ms > 0 ? ms : -1;
+}
+
+void Socket::set_lifetime ( int ms ) {
+	m_deadline = ms > 0 ? monotonic_ms() + ms : -1;
+}
+
+void Socket::set_min_rate ( int bytes, int intervalMs ) {
+	if ( bytes <= 0 || intervalMs <= 0 ) {
+		m_rateBytes = 0;
+		m_intervalEnd = -1;
+		return;
+	}
+	
+	m_rateBytes = bytes;
+	m_rateInterval = intervalMs;
+	m_intervalEnd = monotonic_ms() + intervalMs;
+	m_intervalBytes = 0;
 }
 
 bool Socket::create()
@@ -47,6 +111,27 @@ bool Socket::is_valid() const {
 	return static_cast<bool>( m_sock != -1 );
 }
 
+int Socket::get_fd() const {
+	return m_sock;
+}
+
+int Socket::detach() {
+	m_backend->release( m_sock );
+	int fd = m_sock;
+	m_sock = -1;
+	return fd;
+}
+
+bool Socket::adopt ( int fd ) {
+	socklen_t addr_length = sizeof( m_addr );
+	if ( getsockname( fd, (sockaddr*) &m_addr, &addr_length ) == -1 ) {
+		return false;
+	}
+	
+	m_sock = fd;
+	return true;
+}
+
 bool Socket::bind ( const int port )
 {
 
@@ -98,7 +183,19 @@ std::string Socket::addressAsString() {
 	return std::string(tmp);
 }
 
-Socket* Socket::accept ( Socket* alreadyCreated ) const {
+const sockaddr_in& Socket::get_address() const {
+	return m_addr;
+}
+
+unsigned long long Socket::bytes_received() const {
+	return m_bytesIn;
+}
+
+unsigned long long Socket::bytes_sent() const {
+	return m_bytesOut;
+}
+
+Socket* Socket::accept ( Socket* alreadyCreated, int wakeFd ) const {
 	Socket* retVal = NULL;
 	if( alreadyCreated == NULL ) {
 		retVal = new Socket();
@@ -106,42 +203,98 @@ Socket* Socket::accept ( Socket* alreadyCreated ) const {
 		retVal = dynamic_cast<Socket*>( alreadyCreated );
 	}
 	
-	int addr_length = sizeof( m_addr );
-	retVal->m_sock = ::accept ( m_sock, (sockaddr*) &(retVal->m_addr), (socklen_t*) &addr_length );
+	socklen_t addr_length = sizeof( m_addr );
+	retVal->m_sock = m_backend->accept( m_sock, (sockaddr*) &(retVal->m_addr), &addr_length, wakeFd );
+	
+	if ( retVal->m_sock == -1 && errno == EINTR && wakeFd != -1 ) {
+		if ( alreadyCreated == NULL ) {
+			delete retVal;
+		}
+		return NULL;
+	}
 	
 	if ( retVal->m_sock <= 0 ) {
 		throw std::string("Failed to accept() socket because: m_sock <= 0");
 	}
 	
+	//The connection gets its own backend of the same kind as ours
+	retVal->set_backend( m_backend->spawn() );
+	
 	return retVal;
 }
 
 
 bool Socket::send ( const std::string& s ) const {
-	int status = ::send( m_sock, s.c_str(), s.size(), MSG_NOSIGNAL );
-	if ( status == -1 ) {
-		return false;
-	} else {
-		return true;
+	//Anything buffered goes out first, in the same call
+	struct iovec iov[3];
+	int count = 0;
+	if( m_shared != NULL ) {
+		iov[count].iov_base = (void*) m_shared->data();
+		iov[count++].iov_len = m_shared->size();
+	}
+	if( !m_wbuf.empty() ) {
+		iov[count].iov_base = (void*) m_wbuf.data();
+		iov[count++].iov_len = m_wbuf.size();
 	}
+	if( !s.empty() ) {
+		iov[count].iov_base = (void*) s.data();
+		iov[count++].iov_len = s.size();
+	}
+	
+	bool status = m_backend->sendv( m_sock, iov, count );
+	if ( status ) {
+		for ( int i = 0; i < count; i++ ) {
+			m_bytesOut += iov[i].iov_len;
+		}
+	}
+	if ( m_recordFd != -1 ) {
+		record ( '>', iov, count );
+	}
+	m_shared = NULL;
+	m_wbuf.clear();
+	return status;
 }
 
 bool Socket::send ( const unsigned char& c ) const
 {
 	std::string s;
 	s += c;
-	send( s );
+	return send( s );
+}
+
+void Socket::defer ( const std::string& s ) const {
+	m_wbuf += s;
+}
+
+void Socket::defer ( const char* data, size_t length ) const {
+	m_wbuf.append( data, length );
+}
+
+void Socket::defer_shared ( const std::string& s ) const {
+	//Only one shared buffer can be queued ahead of the rest, copy any more
+	if( m_shared != NULL || !m_wbuf.empty() ) {
+		m_wbuf += s;
+		return;
+	}
+	m_shared = &s;
+}
+
+bool Socket::flush() const {
+	if( m_shared == NULL && m_wbuf.empty() ) {
+		return true;
+	}
+	return send( std::string() );
 }
 
 const Socket& Socket::operator << ( const std::string& s ) const {
-	send( s );
+	defer( s );
 	
 	return *this;
 }
 
 const Socket& Socket::operator << ( const unsigned char& c ) const {
-	send( c );
-	Logger::debug() << "Sent character " << c << " (" << (int)c << ")" << endl;
+	m_wbuf += c;
+	LOG_DEBUG( "Sent character {} ({})", c, (int)c );
 	
 	return *this;
 }
@@ -155,32 +308,142 @@ const Socket& Socket::operator >> ( std::string& s ) const {
 }
 
 const Socket& Socket::operator >> ( unsigned char& c ) const {
-	std::string s;
-	if ( !recv(s,1) ) {
+	if ( m_rpos == m_rlen && !fill() ) {
 		throw SocketException ( "Could not read from socket." );
 	}
 
-
-	c = s[0];
-	Logger::debug() << "Read character (" << (int)c << ")" << endl;
+	c = m_rbuf[m_rpos++];
+	LOG_DEBUG( "Read character ({})", (int)c );
 	return *this;
 }
 
+size_t Socket::buffered ( const char*& data ) const {
+	data = m_rbuf + m_rpos;
+	return m_rlen - m_rpos;
+}
+
+void Socket::consume ( size_t count ) const {
+	m_rpos += count;
+}
+
 int Socket::recv( std::string& s, const int& max ) const {
-	char buf[max+1];
-	memset( buf, 0, max+1 );
 	s = "";
+	if ( m_rpos == m_rlen && !fill() ) {
+		return 0;
+	}
+	
+	//Hand out what we already have buffered
+	int count = m_rlen - m_rpos;
+	if ( count > max ) {
+		count = max;
+	}
+	s.assign( m_rbuf + m_rpos, count );
+	m_rpos += count;
+	return count;
+}
 
+bool Socket::fill() const {
+	//We're about to block, so whatever was deferred has to go out now
+	flush();
+	
+	long long start = monotonic_ms();
+	int status;
+	while ( true ) {
+		long long now = monotonic_ms();
+		if ( m_deadline != -1 && now >= m_deadline ) {
+			throw SocketTimeout ( SocketTimeout::Lifetime, "Session lifetime exceeded." );
+		}
+		
+		//Check the rate at the end of every interval, even if nothing came in
+		if ( m_intervalEnd != -1 && now >= m_intervalEnd ) {
+			if ( m_intervalBytes < m_rateBytes ) {
+				throw SocketTimeout ( SocketTimeout::MinRate, "Peer sent too little data." );
+			}
+			m_intervalEnd = now + m_rateInterval;
+			m_intervalBytes = 0;
+		}
+		
+		//Wait no longer than the nearest of the limits
+		long long wait = -1;
+		if ( m_readTimeout != -1 ) {
+			wait = start + m_readTimeout - now;
+			if ( wait <= 0 ) {
+				throw SocketTimeout ( SocketTimeout::Idle, "Timed out waiting for data." );
+			}
+		}
+		if ( m_deadline != -1 && ( wait == -1 || m_deadline - now < wait ) ) {
+			wait = m_deadline - now;
+		}
+		if ( m_intervalEnd != -1 && ( wait == -1 || m_intervalEnd - now < wait ) ) {
+			wait = m_intervalEnd - now;
+		}
+		
+		status = m_backend->recv( m_sock, m_rbuf, MAXRECV, (int) wait );
+		if ( status == -1 && errno == ETIMEDOUT ) {
+			continue;
+		}
+		break;
+	}
 	
-	int status = ::recv( m_sock, buf, max, 0 );
 	if ( status == -1 ) {
-		Logger::info() << "status == -1   errno == " << errno << "  in Socket::recv\n";
-		return 0;
+		LOG_INFO( "recv failed, errno {}", errno );
+		return false;
 	} else if( status == 0 ) {
-		return 0;
-	} else {
-		s = buf;
-		return status;
+		return false;
+	}
+	
+	m_rpos = 0;
+	m_rlen = status;
+	m_intervalBytes += status;
+	m_bytesIn += status;
+	
+	if ( m_recordFd != -1 ) {
+		struct iovec iov;
+		iov.iov_base = m_rbuf;
+		iov.iov_len = status;
+		record ( '<', &iov, 1 );
+	}
+	return true;
+}
+
+void Socket::set_recording ( int fd ) {
+	if ( m_recordFd != -1 ) {
+		::close ( m_recordFd );
+	}
+	m_recordFd = fd;
+	m_recordStart = monotonic_ms();
+	if ( ::write ( m_recordFd, "FTREC1\n", 7 ) != 7 ) {
+		::close ( m_recordFd );
+		m_recordFd = -1;
+	}
+}
+
+void Socket::record ( char direction, const struct iovec* iov, int count ) const {
+	size_t length = 0;
+	for ( int i = 0; i < count; i++ ) {
+		length += iov[i].iov_len;
+	}
+	if ( length == 0 ) {
+		return;
+	}
+	
+	unsigned int ms = monotonic_ms() - m_recordStart;
+	unsigned char header[9];
+	header[0] = direction;
+	for ( int i = 0; i < 4; i++ ) {
+		header[1 + i] = ( ms >> ( 24 - i * 8 ) ) & 0xff;
+		header[5 + i] = ( length >> ( 24 - i * 8 ) ) & 0xff;
+	}
+	
+	//One write per chunk keeps the file consistent if the daemon dies
+	struct iovec vec[4];
+	vec[0].iov_base = header;
+	vec[0].iov_len = sizeof(header);
+	for ( int i = 0; i < count && i < 3; i++ ) {
+		vec[1 + i] = iov[i];
+	}
+	if ( ::writev ( m_recordFd, vec, 1 + ( count < 3 ? count : 3 ) ) == -1 ) {
+		LOG_DEBUG( "Could not record to fd {}, errno {}", m_recordFd, errno );
 	}
 }
 
@@ -12,10 +12,14 @@
 #include <string>
 #include <arpa/inet.h>
 
+#include "IOBackend.h"
+
 
 const int MAXHOSTNAME = 200;
-const int MAXCONNECTIONS = 5;
-const int MAXRECV = 500;
+// Listen backlog, bursts of connects beyond it get reset
+const int MAXCONNECTIONS = SOMAXCONN;
+// Receive buffer size, big enough that a pasted script is scanned in a few chunks
+const int MAXRECV = 2048;
 
 class Socket
 {
@@ -27,7 +31,12 @@ class Socket
   bool create();
   bool bind ( const int port );
   bool listen() const;
-  virtual Socket* accept( Socket* alreadyCreated=NULL ) const;
+  // Returns NULL when woken through wakeFd instead, see IOBackend::accept()
+  virtual Socket* accept( Socket* alreadyCreated=NULL, int wakeFd=-1 ) const;
+
+  // Take over an already bound and listening socket, e.g. one passed in
+  //  from another process
+  bool adopt ( int fd );
 
   // Client initialization
   bool connect ( const std::string host, const int port );
@@ -37,20 +46,94 @@ class Socket
   bool send ( const unsigned char& c ) const;
   int recv ( std::string&, const int& max=MAXRECV ) const;
 
+  // Queue data in the output buffer, it goes out together with the next
+  //  send(), flush() or right before the next blocking read. operator<<
+  //  queues the same way.
+  void defer ( const std::string& s ) const;
+  void defer ( const char* data, size_t length ) const;
+
+  // Queue an immutable buffer that outlives the socket without copying it,
+  //  it is sent ahead of anything else in the output buffer
+  void defer_shared ( const std::string& s ) const;
+
+  bool flush() const;
+
   const Socket& operator << ( const std::string& ) const;
   const Socket& operator << ( const unsigned char& c ) const;
   const Socket& operator >> ( std::string& ) const;
   const Socket& operator >> ( unsigned char& ) const;
+
+  // The bytes received but not read yet, without blocking. consume() marks
+  //  the first count of them as read.
+  size_t buffered ( const char*& data ) const;
+  void consume ( size_t count ) const;
   
+  // Bytes received from and sent to the peer so far
+  unsigned long long bytes_received() const;
+  unsigned long long bytes_sent() const;
+
   std::string addressAsString();
+  const sockaddr_in& get_address() const;
   
   void set_non_blocking ( const bool );
 
   bool is_valid() const;
+  int get_fd() const;
+
+  // Hand the fd over to the caller, who closes it. The socket is invalid
+  //  afterwards.
+  int detach();
+
+  // Read limits in milliseconds, a blocking read that runs into one of them
+  //  throws a SocketTimeout naming the rule. Negative or zero disables them.
+  //   - read timeout: longest a single read may wait for data
+  //   - lifetime: from now until reads stop being served
+  //   - min rate: fewer than bytes received per interval gives up
+  void set_read_timeout ( int ms );
+  void set_lifetime ( int ms );
+  void set_min_rate ( int bytes, int intervalMs );
+
+  // The socket takes ownership of the backend
+  void set_backend ( IOBackend* backend );
+  IOBackend* backend() const;
+
+  // Append every byte received and sent to fd, which the socket closes.
+  //  The file starts with "FTREC1\n", then each chunk is a direction byte
+  //  ('<' received, '>' sent), the u32 milliseconds since recording
+  //  started, the u32 length, both big endian, and the bytes.
+  void set_recording ( int fd );
 
  private:
+  bool fill() const;
+  void record ( char direction, const struct iovec* iov, int count ) const;
+
   int m_sock;
   sockaddr_in m_addr;
+  IOBackend* m_backend;
+
+  // Bytes received but not handed out yet
+  mutable char m_rbuf[MAXRECV];
+  mutable int m_rpos;
+  mutable int m_rlen;
+
+  // Read limits, deadlines are CLOCK_MONOTONIC milliseconds or -1
+  int m_readTimeout;
+  long long m_deadline;
+  int m_rateBytes;
+  int m_rateInterval;
+  mutable long long m_intervalEnd;
+  mutable int m_intervalBytes;
+
+  mutable unsigned long long m_bytesIn;
+  mutable unsigned long long m_bytesOut;
+
+  // Output buffer, see defer()
+  mutable const std::string* m_shared;
+  mutable std::string m_wbuf;
+
+  // Session recording, see set_recording()
+  int m_recordFd;
+  long long m_recordStart;
 
 
 };
@@ -20,4 +20,21 @@ class SocketException
 
 };
 
+
+// Thrown when a read runs into one of the limits set on the socket
+class SocketTimeout : public SocketException
+{
+ public:
+  enum Rule { Idle, Lifetime, MinRate };
+
+  SocketTimeout ( Rule rule, std::string s ) : SocketException ( s ), m_rule ( rule ) {};
+
+  Rule rule() { return m_rule; }
+
+ private:
+
+  Rule m_rule;
+
+};
+
 #endif
@@ -0,0 +1,422 @@
+// Implementation of the UringBackend class
+
+#include "UringBackend.h"
+
+#ifndef SOCKET_HAVE_IO_URING
+
+struct UringBackend::Ring {};
+
+UringBackend::UringBackend() : m_ring( NULL ) {}
+UringBackend::~UringBackend() {}
+UringBackend* UringBackend::create() { return NULL; }
+int UringBackend::accept ( int listenFd, sockaddr* addr, socklen_t* addrLen, int wakeFd ) { return -1; }
+int UringBackend::recv ( int fd, char* buf, int max, int timeoutMs ) { return -1; }
+bool UringBackend::sendv ( int fd, const struct iovec* iov, int iovCount ) { return false; }
+IOBackend* UringBackend::spawn() const { return new BlockingBackend(); }
+
+#else
+
+#include <deque>
+#include <errno.h>
+#include <string.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+
+// Ring sizes: the accepts kept in flight, their cancels and the wake poll
+const unsigned URING_ENTRIES = 32;
+const unsigned URING_ACCEPTS = 8;
+
+// user_data tags so completions can be told apart, accepts carry their slot above the tag
+enum { URING_TAG_ACCEPT = 1, URING_TAG_WAKE = 4, URING_TAG_CANCEL = 5 };
+const unsigned URING_SLOT_SHIFT = 8;
+
+
+struct UringBackend::Ring
+{
+  int fd;
+
+  // Submission queue
+  unsigned* sqHead;
+  unsigned* sqTail;
+  unsigned* sqArray;
+  unsigned sqMask;
+  unsigned sqEntries;
+  io_uring_sqe* sqes;
+  unsigned toSubmit;
+
+  // Completion queue
+  unsigned* cqHead;
+  unsigned* cqTail;
+  unsigned cqMask;
+  io_uring_cqe* cqes;
+
+  // Mappings so they can be torn down again
+  void* sqMap;
+  size_t sqMapLen;
+  void* cqMap;
+  size_t cqMapLen;
+  void* sqeMap;
+  size_t sqeMapLen;
+
+  // The accepts in flight, each with room for the peer's address
+  struct Slot { bool armed; socklen_t addrLen; sockaddr_storage addr; };
+  Slot slots[URING_ACCEPTS];
+
+  // Connections accepted but not handed out yet
+  struct Accepted { int fd; socklen_t addrLen; sockaddr_storage addr; };
+  std::deque<Accepted> accepted;
+
+  // Poll on the accept wake fd
+  bool wakeArmed;
+  bool woken;
+};
+
+
+static int uringSetup ( unsigned entries, io_uring_params* p ) {
+	return (int) syscall( __NR_io_uring_setup, entries, p );
+}
+
+static int uringEnter ( int fd, unsigned toSubmit, unsigned minComplete, unsigned flags ) {
+	return (int) syscall( __NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0 );
+}
+
+static int uringRegister ( int fd, unsigned opcode, void* arg, unsigned nrArgs ) {
+	return (int) syscall( __NR_io_uring_register, fd, opcode, arg, nrArgs );
+}
+
+static bool supported ( int fd );
+static io_uring_sqe* getSqe ( UringBackend::Ring* r );
+static bool flush ( UringBackend::Ring* r, unsigned waitFor );
+static bool reapOne ( UringBackend::Ring* r, bool wait );
+static bool anyArmed ( UringBackend::Ring* r );
+
+
+UringBackend::UringBackend() : m_ring( NULL ) {}
+
+UringBackend::~UringBackend() {
+	if( m_ring == NULL ) {
+		return;
+	}
+
+	//Closing the ring cancels the accepts still in flight
+	if( m_ring->fd != -1 ) {
+		::close( m_ring->fd );
+	}
+	if( m_ring->sqeMap != NULL ) munmap( m_ring->sqeMap, m_ring->sqeMapLen );
+	if( m_ring->cqMap != NULL && m_ring->cqMap != m_ring->sqMap ) munmap( m_ring->cqMap, m_ring->cqMapLen );
+	if( m_ring->sqMap != NULL ) munmap( m_ring->sqMap, m_ring->sqMapLen );
+
+	//Connections accepted but never handed out
+	for( size_t i = 0; i < m_ring->accepted.size(); i++ ) {
+		if( m_ring->accepted[i].fd >= 0 ) {
+			::close( m_ring->accepted[i].fd );
+		}
+	}
+
+	delete m_ring;
+}
+
+UringBackend* UringBackend::create() {
+	UringBackend* backend = new UringBackend();
+	Ring* r = new Ring();
+	backend->m_ring = r;
+
+	r->fd = -1;
+	r->sqMap = r->cqMap = r->sqeMap = NULL;
+	r->toSubmit = 0;
+	r->wakeArmed = false;
+	r->woken = false;
+	for( unsigned i = 0; i < URING_ACCEPTS; i++ ) {
+		r->slots[i].armed = false;
+	}
+
+	io_uring_params p;
+	memset( &p, 0, sizeof(p) );
+	r->fd = uringSetup( URING_ENTRIES, &p );
+	if( r->fd < 0 ) {
+		r->fd = -1;
+		delete backend;
+		return NULL;
+	}
+
+	//An older kernel sets up a ring fine but fails the requests we make
+	//	later, so the caller has to fall back to blocking I/O now
+	if( !supported( r->fd ) ) {
+		delete backend;
+		return NULL;
+	}
+
+	//Map the submission and completion rings, modern kernels share one mapping
+	r->sqMapLen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cqMapLen = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+	if( p.features & IORING_FEAT_SINGLE_MMAP ) {
+		if( r->cqMapLen > r->sqMapLen ) {
+			r->sqMapLen = r->cqMapLen;
+		}
+		r->cqMapLen = r->sqMapLen;
+	}
+
+	r->sqMap = mmap( NULL, r->sqMapLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING );
+	if( r->sqMap == MAP_FAILED ) {
+		r->sqMap = NULL;
+		delete backend;
+		return NULL;
+	}
+
+	if( p.features & IORING_FEAT_SINGLE_MMAP ) {
+		r->cqMap = r->sqMap;
+	} else {
+		r->cqMap = mmap( NULL, r->cqMapLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING );
+		if( r->cqMap == MAP_FAILED ) {
+			r->cqMap = NULL;
+			delete backend;
+			return NULL;
+		}
+	}
+
+	r->sqeMapLen = p.sq_entries * sizeof(io_uring_sqe);
+	r->sqeMap = mmap( NULL, r->sqeMapLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES );
+	if( r->sqeMap == MAP_FAILED ) {
+		r->sqeMap = NULL;
+		delete backend;
+		return NULL;
+	}
+
+	char* sq = (char*) r->sqMap;
+	r->sqHead = (unsigned*)( sq + p.sq_off.head );
+	r->sqTail = (unsigned*)( sq + p.sq_off.tail );
+	r->sqArray = (unsigned*)( sq + p.sq_off.array );
+	r->sqMask = *(unsigned*)( sq + p.sq_off.ring_mask );
+	r->sqEntries = p.sq_entries;
+	r->sqes = (io_uring_sqe*) r->sqeMap;
+
+	char* cq = (char*) r->cqMap;
+	r->cqHead = (unsigned*)( cq + p.cq_off.head );
+	r->cqTail = (unsigned*)( cq + p.cq_off.tail );
+	r->cqMask = *(unsigned*)( cq + p.cq_off.ring_mask );
+	r->cqes = (io_uring_cqe*)( cq + p.cq_off.cqes );
+
+	return backend;
+}
+
+static bool supported ( int fd ) {
+	//Every opcode we submit has to be there, the probe itself needs 5.6+
+	const unsigned maxOps = 256;
+	char mem[sizeof(io_uring_probe) + maxOps * sizeof(io_uring_probe_op)];
+	memset( mem, 0, sizeof(mem) );
+	io_uring_probe* probe = (io_uring_probe*) mem;
+	if( uringRegister( fd, IORING_REGISTER_PROBE, probe, maxOps ) != 0 ) {
+		return false;
+	}
+	static const unsigned char needed[] = { IORING_OP_ACCEPT, IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL };
+	for( size_t i = 0; i < sizeof(needed); i++ ) {
+		if( needed[i] > probe->last_op || !( probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED ) ) {
+			return false;
+		}
+	}
+	return true;
+}
+
+IOBackend* UringBackend::spawn() const {
+	//A ring per session would cost a ring fd and its mappings each while
+	//	still entering the kernel once per recv and send, so sessions do
+	//	their I/O with the plain syscalls
+	return new BlockingBackend();
+}
+
+
+static io_uring_sqe* getSqe ( UringBackend::Ring* r ) {
+	unsigned head = __atomic_load_n( r->sqHead, __ATOMIC_ACQUIRE );
+	unsigned tail = *r->sqTail + r->toSubmit;
+	if( tail - head >= r->sqEntries ) {
+		return NULL;
+	}
+
+	unsigned idx = tail & r->sqMask;
+	io_uring_sqe* sqe = &r->sqes[idx];
+	memset( sqe, 0, sizeof(*sqe) );
+	r->sqArray[idx] = idx;
+	r->toSubmit++;
+	return sqe;
+}
+
+// Publishes the queued sqes and optionally waits for completions in one syscall
+static bool flush ( UringBackend::Ring* r, unsigned waitFor ) {
+	unsigned toSubmit = r->toSubmit;
+	if( toSubmit > 0 ) {
+		__atomic_store_n( r->sqTail, *r->sqTail + toSubmit, __ATOMIC_RELEASE );
+		r->toSubmit = 0;
+	}
+
+	if( toSubmit == 0 && waitFor == 0 ) {
+		return true;
+	}
+
+	while( true ) {
+		int ret = uringEnter( r->fd, toSubmit, waitFor, waitFor > 0 ? IORING_ENTER_GETEVENTS : 0 );
+		if( ret >= 0 ) {
+			return true;
+		}
+		if( errno == EINTR ) {
+			//The sqes were consumed already if the kernel got that far
+			toSubmit = 0;
+			continue;
+		}
+		if( errno == EAGAIN || errno == EBUSY ) {
+			continue;
+		}
+		return false;
+	}
+}
+
+// Pops one completion and files it with whoever is waiting for it
+static bool reapOne ( UringBackend::Ring* r, bool wait ) {
+	while( true ) {
+		unsigned head = *r->cqHead;
+		unsigned tail = __atomic_load_n( r->cqTail, __ATOMIC_ACQUIRE );
+		if( head != tail ) {
+			io_uring_cqe* cqe = &r->cqes[head & r->cqMask];
+			int res = cqe->res;
+			unsigned long long tag = cqe->user_data;
+			__atomic_store_n( r->cqHead, head + 1, __ATOMIC_RELEASE );
+
+			if( ( tag & ( ( 1 << URING_SLOT_SHIFT ) - 1 ) ) == URING_TAG_ACCEPT ) {
+				UringBackend::Ring::Slot& slot = r->slots[tag >> URING_SLOT_SHIFT];
+				slot.armed = false;
+
+				//A shared listener may have been emptied by another process,
+				//	and a peer may leave before we get to it, both just rearm
+				if( res != -ECANCELED && res != -EAGAIN && res != -ECONNABORTED ) {
+					UringBackend::Ring::Accepted a;
+					a.fd = res;
+					a.addrLen = slot.addrLen;
+					memcpy( &a.addr, &slot.addr, slot.addrLen < sizeof(a.addr) ? slot.addrLen : sizeof(a.addr) );
+					r->accepted.push_back( a );
+				}
+			} else if( tag == URING_TAG_WAKE ) {
+				r->wakeArmed = false;
+				r->woken = true;
+			}
+			return true;
+		}
+
+		if( !wait ) {
+			return false;
+		}
+		if( !flush( r, 1 ) ) {
+			return false;
+		}
+	}
+}
+
+static bool anyArmed ( UringBackend::Ring* r ) {
+	for( unsigned i = 0; i < URING_ACCEPTS; i++ ) {
+		if( r->slots[i].armed ) {
+			return true;
+		}
+	}
+	return false;
+}
+
+
+int UringBackend::accept ( int listenFd, sockaddr* addr, socklen_t* addrLen, int wakeFd ) {
+	Ring* r = m_ring;
+	while( r->accepted.empty() ) {
+		if( r->woken ) {
+			//Cancel the accepts in flight so nothing piles up in our ring while
+			//	the caller isn't accepting. Connections they already took are
+			//	handed out before the wakeup is reported.
+			if( anyArmed( r ) ) {
+				for( unsigned i = 0; i < URING_ACCEPTS; i++ ) {
+					if( !r->slots[i].armed ) {
+						continue;
+					}
+					io_uring_sqe* sqe = getSqe( r );
+					if( sqe == NULL ) {
+						flush( r, 0 );
+						sqe = getSqe( r );
+					}
+					sqe->opcode = IORING_OP_ASYNC_CANCEL;
+					sqe->addr = URING_TAG_ACCEPT | ( i << URING_SLOT_SHIFT );
+					sqe->user_data = URING_TAG_CANCEL;
+				}
+				while( anyArmed( r ) ) {
+					if( !reapOne( r, true ) ) {
+						return -1;
+					}
+				}
+				continue;
+			}
+
+			r->woken = false;
+			errno = EINTR;
+			return -1;
+		}
+
+		if( wakeFd != -1 && !r->wakeArmed ) {
+			io_uring_sqe* sqe = getSqe( r );
+			if( sqe == NULL ) {
+				flush( r, 0 );
+				continue;
+			}
+			sqe->opcode = IORING_OP_POLL_ADD;
+			sqe->fd = wakeFd;
+			sqe->poll32_events = POLLIN;
+			sqe->user_data = URING_TAG_WAKE;
+			r->wakeArmed = true;
+		}
+
+		//Keep several accepts in flight, so under load one wait reaps a batch
+		//	of connections and their addresses, and rearms them in the same call
+		for( unsigned i = 0; i < URING_ACCEPTS; i++ ) {
+			Ring::Slot& slot = r->slots[i];
+			if( slot.armed ) {
+				continue;
+			}
+			io_uring_sqe* sqe = getSqe( r );
+			if( sqe == NULL ) {
+				break;
+			}
+			slot.addrLen = sizeof(slot.addr);
+			sqe->opcode = IORING_OP_ACCEPT;
+			sqe->fd = listenFd;
+			sqe->addr = (unsigned long) &slot.addr;
+			sqe->addr2 = (unsigned long) &slot.addrLen;
+			sqe->user_data = URING_TAG_ACCEPT | ( i << URING_SLOT_SHIFT );
+			slot.armed = true;
+		}
+
+		if( !reapOne( r, true ) ) {
+			return -1;
+		}
+	}
+
+	Ring::Accepted a = r->accepted.front();
+	r->accepted.pop_front();
+	if( a.fd < 0 ) {
+		errno = -a.fd;
+		return -1;
+	}
+
+	if( addr != NULL ) {
+		socklen_t length = a.addrLen < *addrLen ? a.addrLen : *addrLen;
+		memcpy( addr, &a.addr, length );
+		*addrLen = a.addrLen;
+	}
+	return a.fd;
+}
+
+int UringBackend::recv ( int fd, char* buf, int max, int timeoutMs ) {
+	BlockingBackend blocking;
+	return blocking.recv( fd, buf, max, timeoutMs );
+}
+
+bool UringBackend::sendv ( int fd, const struct iovec* iov, int iovCount ) {
+	BlockingBackend blocking;
+	return blocking.sendv( fd, iov, iovCount );
+}
+
+#endif
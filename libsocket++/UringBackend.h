@@ -0,0 +1,54 @@
+// Definition of the UringBackend class
+//
+// An io_uring based IOBackend for accept loops. Each listening socket owns a
+// small ring that keeps several accepts in flight, each with room for the
+// peer's address, so under load a single io_uring_enter() reaps a batch of
+// connections and rearms the accepts for them. Connections get the blocking
+// backend: with a thread per session, a ring of their own would cost a ring
+// fd and its mappings each and still enter the kernel once per recv or send.
+//
+// The ring is driven through the raw syscalls, so nothing beyond the kernel
+// headers is needed to build it. When the headers are too old, or the running
+// kernel refuses io_uring_setup(), create() returns NULL and the caller falls
+// back to the blocking backend.
+
+#ifndef UringBackend_class
+#define UringBackend_class
+
+#include "IOBackend.h"
+
+#if defined(__linux__) && defined(__has_include)
+# if __has_include(<linux/io_uring.h>)
+#  include <linux/io_uring.h>
+#  if defined(IO_URING_OP_SUPPORTED)
+#   define SOCKET_HAVE_IO_URING 1
+#  endif
+# endif
+#endif
+
+
+class UringBackend : public IOBackend
+{
+ public:
+  virtual ~UringBackend();
+
+  // Returns NULL when io_uring can't be used on this build or kernel
+  static UringBackend* create();
+
+  int accept ( int listenFd, sockaddr* addr, socklen_t* addrLen, int wakeFd=-1 );
+  int recv ( int fd, char* buf, int max, int timeoutMs=-1 );
+  bool sendv ( int fd, const struct iovec* iov, int iovCount );
+  IOBackend* spawn() const;
+  const char* name() const { return "uring"; }
+
+  // Ring state, only defined in UringBackend.cpp
+  struct Ring;
+
+ private:
+  UringBackend();
+
+  Ring* m_ring;
+};
+
+
+#endif
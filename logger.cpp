@@ -2,13 +2,134 @@
 
 #include <fstream>
 #include <string>
+#include <cstring>
+#include <ctime>
+#include <cerrno>
+#include <vector>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 using namespace std;
 
 bool Logger::hasInited = false;
-ofstream Logger::logFile;
+ostream Logger::logFile( NULL );
 Logger::LogLevel Logger::logLevel;
 ofstream Logger::blackhole;
 
+string Logger::logPath;
+int Logger::logFd = -1;
+__gnu_cxx::stdio_filebuf<char>* Logger::logBuf = NULL;
+
+size_t Logger::rotateBytes = 0;
+int Logger::rotateInterval = 0;
+int Logger::keepSegments = 0;
+bool Logger::compressSegments = false;
+volatile sig_atomic_t Logger::reopenRequested = 0;
+
+//The formatted date and time of the last second seen by this thread, so
+//	gmtime_r() and the formatting only happen once a second
+static __thread time_t cachedSecond = -1;
+static __thread char cachedDate[24];
+__thread bool Logger::quietThread = false;
+__thread char Logger::lineBuf[Logger::LineLength];
+
+//Writes value as exactly width digits, zero padded
+static inline char* putDigits( char* p, unsigned long long value, int width ) {
+	for( int i = width - 1; i >= 0; i-- ) {
+		p[i] = '0' + value % 10;
+		value /= 10;
+	}
+	return p + width;
+}
+
+size_t Logger::timestamp( char* buf ) {
+	//The coarse clocks are read without a syscall and are good to a tick, plenty for logs
+	timespec wall, mono;
+	clock_gettime( CLOCK_REALTIME_COARSE, &wall );
+	clock_gettime( CLOCK_MONOTONIC_COARSE, &mono );
+	
+	if( wall.tv_sec != cachedSecond ) {
+		tm parts;
+		gmtime_r( &wall.tv_sec, &parts );
+		strftime( cachedDate, sizeof(cachedDate), "%Y-%m-%dT%H:%M:%S", &parts );
+		cachedSecond = wall.tv_sec;
+	}
+	
+	char* p = buf;
+	size_t dateLength = strlen( cachedDate );
+	memcpy( p, cachedDate, dateLength );
+	p += dateLength;
+	*p++ = '.';
+	p = putDigits( p, wall.tv_nsec / 1000000, 3 );
+	memcpy( p, "Z mono=", 7 );
+	p += 7;
+	
+	//Seconds without leading zeros
+	char digits[20];
+	int n = 0;
+	unsigned long long sec = mono.tv_sec;
+	do {
+		digits[n++] = '0' + sec % 10;
+		sec /= 10;
+	} while( sec > 0 );
+	while( n > 0 ) {
+		*p++ = digits[--n];
+	}
+	*p++ = '.';
+	p = putDigits( p, mono.tv_nsec / 1000000, 3 );
+	
+	return p - buf;
+}
+
+void Logger::writePrefix( const char* level, size_t levelLength ) {
+	char buf[TimestampLength + 16];
+	size_t length = timestamp( buf );
+	buf[length++] = ' ';
+	memcpy( buf + length, level, levelLength );
+	length += levelLength;
+	logFile.write( buf, length );
+}
+
+const char* Logger::formatLiteral( LogLine& line, const char* format ) {
+	const char* start = format;
+	while( *format != '\0' ) {
+		if( format[0] == '{' && format[1] == '}' ) {
+			break;
+		}
+		
+		//Keep one of a doubled brace
+		if( ( format[0] == '{' && format[1] == '{' ) || ( format[0] == '}' && format[1] == '}' ) ) {
+			line.append( start, format + 1 - start );
+			format += 2;
+			start = format;
+			continue;
+		}
+		format++;
+	}
+	line.append( start, format - start );
+	return format;
+}
+
+void Logger::writeLine( const char* data, size_t length ) {
+	//One write() to the O_APPEND file or the pipe keeps the line whole
+	//	among the lines of other threads and workers
+	while( length > 0 ) {
+		ssize_t written = ::write( logFd, data, length );
+		if( written <= 0 ) {
+			if( written == -1 && errno == EINTR ) {
+				continue;
+			}
+			return;
+		}
+		data += written;
+		length -= written;
+	}
+}
+
 void Logger::init( string filename, LogLevel setLevel ) {
 	if( hasInited ) {
 		return ;
@@ -17,19 +138,174 @@ void Logger::init( string filename, LogLevel setLevel ) {
 	//Set the log level
 	logLevel = setLevel;
 	
-	//
-	logFile.open( filename.c_str(), ofstream::app | ofstream::out );
-	if( !logFile.is_open() || !logFile.good() ) {
+	//Open the file ourselves so the fd can be swapped when rotating
+	logFd = open( filename.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644 );
+	if( logFd == -1 ) {
 		throw string("Could not open logfile ") + filename;
 	}
+	logPath = filename;
+	logBuf = new __gnu_cxx::stdio_filebuf<char>( logFd, ios::out | ios::app );
+	logFile.rdbuf( logBuf );
 	
 	hasInited = true;
 }
 
 void Logger::shutdown() {
 	if( hasInited ) {
-		logFile.close();
+		logFile.flush();
+		logBuf->close();
+	}
+}
+
+void Logger::setRotation( size_t maxBytes, int intervalSecs, int keep, bool compress ) {
+	rotateBytes = maxBytes;
+	rotateInterval = intervalSecs;
+	keepSegments = keep;
+	compressSegments = compress;
+	
+	//The thread also handles reopens, so it always runs
+	pthread_t thread;
+	if( pthread_create(&thread, NULL, &Logger::rotator, NULL) != 0 ) {
+		throw string("Could not start the log rotation thread");
+	}
+	pthread_detach( thread );
+}
+
+void Logger::reopenLater() {
+	reopenRequested = 1;
+}
+
+void* Logger::rotator( void* ) {
+	time_t opened = time( NULL );
+	while( true ) {
+		sleep( 1 );
+		time_t now = time( NULL );
+		
+		if( reopenRequested ) {
+			reopenRequested = 0;
+			reopen();
+			opened = now;
+			continue;
+		}
+		
+		//Interval rotation happens on multiples of the interval, e.g. on the hour
+		bool rotateNow = rotateInterval > 0 && now / rotateInterval != opened / rotateInterval;
+		if( rotateBytes > 0 ) {
+			struct stat st;
+			if( fstat(logFd, &st) == 0 && (size_t)st.st_size >= rotateBytes ) {
+				rotateNow = true;
+			}
+		}
+		
+		if( rotateNow ) {
+			rotate();
+			opened = now;
+		}
 	}
+	return NULL;
+}
+
+void Logger::reopen() {
+	int fd = open( logPath.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644 );
+	if( fd == -1 ) {
+		info() << "Could not reopen logfile " << logPath << ", errno " << errno << endl;
+		return;
+	}
+	
+	//Atomically points logFd at the new file, writers never notice
+	dup2( fd, logFd );
+	close( fd );
+}
+
+void Logger::rotate() {
+	//Name the segment after when it was closed, so they sort by age
+	char suffix[32];
+	time_t now = time( NULL );
+	tm parts;
+	localtime_r( &now, &parts );
+	strftime( suffix, sizeof(suffix), ".%Y%m%d-%H%M%S", &parts );
+	string segment = logPath + suffix;
+	if( access(segment.c_str(), F_OK) == 0 || access((segment + ".gz").c_str(), F_OK) == 0 ) {
+		segment += "-1";
+	}
+	
+	//Lines written between the rename and the dup2 still land in the old segment
+	if( rename(logPath.c_str(), segment.c_str()) == -1 ) {
+		info() << "Could not rotate logfile " << logPath << ", errno " << errno << endl;
+		return;
+	}
+	reopen();
+	info() << "Rotated log, previous segment is " << segment << endl;
+	
+	//Compressing happens on this thread so nobody waits for it
+	if( compressSegments ) {
+		pid_t pid = fork();
+		if( pid == 0 ) {
+			execlp( "gzip", "gzip", "-f", "--", segment.c_str(), (char*)NULL );
+			_exit( 127 );
+		}
+		int status;
+		if( pid == -1 || waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0 ) {
+			info() << "Could not gzip log segment " << segment << endl;
+		}
+	}
+	
+	if( keepSegments > 0 ) {
+		prune();
+	}
+}
+
+void Logger::prune() {
+	//Segments are <logfile>.<date>-<time>[.gz] next to the log
+	string dir = ".";
+	string base = logPath;
+	size_t slash = logPath.rfind( '/' );
+	if( slash != string::npos ) {
+		dir = logPath.substr( 0, slash + 1 );
+		base = logPath.substr( slash + 1 );
+	}
+	base += ".";
+	
+	DIR* d = opendir( dir.c_str() );
+	if( d == NULL ) {
+		return;
+	}
+	vector<string> segments;
+	while( dirent* entry = readdir(d) ) {
+		string name = entry->d_name;
+		if( name.size() > base.size() && name.compare(0, base.size(), base) == 0
+				&& name[base.size()] >= '0' && name[base.size()] <= '9' ) {
+			segments.push_back( name );
+		}
+	}
+	closedir( d );
+	
+	//Oldest first, drop all but the newest keepSegments
+	sort( segments.begin(), segments.end() );
+	for( int i = 0; i + keepSegments < (int)segments.size(); i++ ) {
+		string path = ( slash != string::npos ? dir : string() ) + segments[i];
+		if( unlink(path.c_str()) == 0 ) {
+			info() << "Removed old log segment " << path << endl;
+		}
+	}
+}
+
+void Logger::sendTo( int fd ) {
+	logFile.flush();
+	dup3( fd, logFd, O_CLOEXEC );
+}
+
+void Logger::write( const char* data, size_t length ) {
+	logFile.write( data, length );
+	logFile.flush();
+}
+
+void Logger::setQuiet( bool quiet ) {
+	quietThread = quiet;
+}
+
+bool Logger::isQuiet() {
+	return quietThread;
 }
 
 ostream& Logger::info() {
@@ -37,7 +313,11 @@ ostream& Logger::info() {
 		throw string("Please run Logger::init()");
 	}
 	
-	logFile << "INFO: ";
+	if( quietThread ) {
+		return blackhole;
+	}
+	
+	writePrefix( "INFO: ", 6 );
 	ostream& retVal = logFile;
 	return retVal;
 }
@@ -47,12 +327,12 @@ ostream& Logger::debug() {
 		throw string("Please run Logger::init()");
 	}
 	
-	if( logLevel == Info ) {
+	if( logLevel == Info || quietThread ) {
 		ostream& retVal = blackhole;
 		return blackhole;
 	}
 	
-	logFile << "DEBUG: ";
+	writePrefix( "DEBUG: ", 7 );
 	ostream& retVal = logFile;
 	return retVal;
 }
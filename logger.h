@@ -3,22 +3,220 @@
 
 #include <string>
 #include <fstream>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <type_traits>
+#include <ext/stdio_filebuf.h>
 using namespace std;
 
+//Log a line formatted from a format string and arguments, e.g.
+//	  LOG_INFO( "Failed login from {} with credentials {}:{}", ip, user, pass );
+//	Each {} is replaced by the next argument, {{ and }} are literal braces.
+//	A format string that doesn't have one {} per argument, or an argument
+//	LogLine can't format, doesn't compile. Nothing is evaluated when the
+//	level is off or the thread is quiet, and the line is built without
+//	allocating and written in one go.
+#define LOG_INFO( format, ... ) LOG_AT( Logger::Info, format, ##__VA_ARGS__ )
+#define LOG_DEBUG( format, ... ) LOG_AT( Logger::Debug, format, ##__VA_ARGS__ )
+#define LOG_AT( level, format, ... ) \
+	do { \
+		static_assert( Logger::placeholders(format) == decltype(Logger::countArgs(__VA_ARGS__))::value, \
+			"the format string needs one {} per argument" ); \
+		if( Logger::enabled(level) ) { \
+			Logger::log( level, format, ##__VA_ARGS__ ); \
+		} \
+	} while( 0 )
+
+//Any basic_string of char, whatever its allocator, e.g. an ArenaString
+template<typename T> struct IsCharString : false_type {};
+template<typename Traits, typename Alloc> struct IsCharString< basic_string<char, Traits, Alloc> > : true_type {};
+
+//A log line being built in a fixed buffer, whatever doesn't fit is dropped
+class LogLine {
+    public:
+	LogLine( char* buf, size_t capacity ) : buf( buf ), capacity( capacity ), length( 0 ) {
+	}
+
+	void append( const char* data, size_t n ) {
+		if( n > capacity - length ) {
+			n = capacity - length;
+		}
+		memcpy( buf + length, data, n );
+		length += n;
+	}
+
+	//Strings, characters and numbers print the way an ostream prints them
+	template<typename T>
+	void append( const T& value ) {
+		if constexpr( is_same<T, bool>::value ) {
+			append( value ? "1" : "0", 1 );
+		} else if constexpr( is_same<T, char>::value || is_same<T, unsigned char>::value || is_same<T, signed char>::value ) {
+			append( (const char*) &value, 1 );
+		} else if constexpr( is_integral<T>::value || is_enum<T>::value ) {
+			appendInteger( (long long) value, (unsigned long long) value, is_signed<T>::value || is_enum<T>::value );
+		} else if constexpr( is_floating_point<T>::value ) {
+			char digits[32];
+			append( digits, snprintf(digits, sizeof(digits), "%g", (double) value) );
+		} else if constexpr( is_convertible<const T&, const char*>::value ) {
+			const char* s = value;
+			append( s, strlen(s) );
+		} else if constexpr( is_pointer<T>::value ) {
+			char digits[32];
+			append( digits, snprintf(digits, sizeof(digits), "%p", (const void*) value) );
+		} else {
+			static_assert( IsCharString<T>::value, "LogLine can't format this type" );
+			append( value.data(), value.size() );
+		}
+	}
+
+	size_t size() const {
+		return length;
+	}
+
+    protected:
+	void appendInteger( long long value, unsigned long long unsignedValue, bool isSigned ) {
+		char digits[24];
+		int n = sizeof(digits);
+		bool negative = isSigned && value < 0;
+		unsigned long long rest = negative ? 0 - (unsigned long long) value : unsignedValue;
+		do {
+			digits[--n] = '0' + rest % 10;
+			rest /= 10;
+		} while( rest > 0 );
+		if( negative ) {
+			digits[--n] = '-';
+		}
+		append( digits + n, sizeof(digits) - n );
+	}
+
+	char* buf;
+	size_t capacity;
+	size_t length;
+};
+
 class Logger {
     public:
 	enum LogLevel { Info, Debug };
 	static void init( string filename, LogLevel setLevel=Info );
 	static void shutdown();
+
+	//Rotate the log once it reaches maxBytes or every intervalSecs,
+	//	whichever comes first, 0 disables either. The old file is renamed
+	//	to <logfile>.<date>-<time>, optionally gzipped, and only the newest
+	//	keep of them are kept (0 keeps them all). Starts a background thread,
+	//	so call it after forking.
+	static void setRotation( size_t maxBytes, int intervalSecs, int keep, bool compress );
+
+	//Reopen the log file by name within a second, e.g. after an external
+	//	logrotate moved it. Safe to call from a signal handler.
+	static void reopenLater();
+
 	static ostream& info();
 	static ostream& debug();
 
+	//Whether lines at level are written by the calling thread
+	static bool enabled( LogLevel level ) {
+		return hasInited && !quietThread && ( level == Info || logLevel == Debug );
+	}
+
+	//What LOG_INFO and LOG_DEBUG run once enabled() said yes
+	template<typename... Args>
+	static void log( LogLevel level, const char* format, const Args&... args ) {
+		LogLine line( lineBuf, sizeof(lineBuf) - 1 );
+		char prefix[TimestampLength];
+		line.append( prefix, timestamp(prefix) );
+		line.append( level == Info ? " INFO: " : " DEBUG: ", level == Info ? 7 : 8 );
+		formatArgs( line, format, args... );
+		lineBuf[line.size()] = '\n';
+		writeLine( lineBuf, line.size() + 1 );
+	}
+
+	//The number of {} in format, -1 if it has a lone brace
+	static constexpr int placeholders( const char* format ) {
+		int count = 0;
+		for( ; *format != '\0'; format++ ) {
+			if( format[0] == '{' && format[1] == '}' ) {
+				count++;
+				format++;
+			} else if( ( format[0] == '{' && format[1] == '{' ) || ( format[0] == '}' && format[1] == '}' ) ) {
+				format++;
+			} else if( format[0] == '{' || format[0] == '}' ) {
+				return -1;
+			}
+		}
+		return count;
+	}
+
+	//Only ever used in decltype(), to count the arguments without evaluating them
+	template<typename... Args>
+	static integral_constant<int, sizeof...(Args)> countArgs( const Args&... );
+
+	//Write the log into fd instead of the file, e.g. a worker's pipe to the
+	//	supervisor. Lines up to PIPE_BUF bytes reach a pipe whole.
+	static void sendTo( int fd );
+
+	//Append already stamped lines as they are, e.g. relayed from a worker
+	static void write( const char* data, size_t length );
+
+	//Send everything the calling thread logs nowhere, e.g. for a session
+	//	that isn't supposed to leave a trace
+	static void setQuiet( bool quiet );
+	static bool isQuiet();
+
+	//Writes the wall-clock and monotonic time records are stamped with,
+	//	e.g. "2026-10-18T12:34:56.789Z mono=1234.567", and returns its
+	//	length. buf must hold at least TimestampLength bytes.
+	enum { TimestampLength = 64 };
+	static size_t timestamp( char* buf );
+
     protected:
+	static void writePrefix( const char* level, size_t levelLength );
+
+	//Copy format up to its next {}, which gets the first of args, and so on
+	static void formatArgs( LogLine& line, const char* format ) {
+		formatLiteral( line, format );
+	}
+
+	template<typename First, typename... Rest>
+	static void formatArgs( LogLine& line, const char* format, const First& first, const Rest&... rest ) {
+		format = formatLiteral( line, format );
+		line.append( first );
+		formatArgs( line, *format != '\0' ? format + 2 : format, rest... );
+	}
+
+	//Copy format up to the next {} or its end, returns where it stopped
+	static const char* formatLiteral( LogLine& line, const char* format );
+
+	//Write a finished line to the log with a single write()
+	static void writeLine( const char* data, size_t length );
+
+	//A line is built here, as long as what reaches a pipe whole
+	enum { LineLength = 4096 };
+	static __thread char lineBuf[LineLength];
+	static __thread bool quietThread;
+
+	static void* rotator( void* );
+	static void reopen();
+	static void rotate();
+	static void prune();
+
 	static bool hasInited;
 	static LogLevel logLevel;
-	static ofstream logFile;
+	static ostream logFile;
 	static ofstream blackhole;
 
+	//Writers only ever see logFd, a new file is swapped in underneath them with dup2()
+	static string logPath;
+	static int logFd;
+	static __gnu_cxx::stdio_filebuf<char>* logBuf;
+
+	static size_t rotateBytes;
+	static int rotateInterval;
+	static int keepSegments;
+	static bool compressSegments;
+	static volatile sig_atomic_t reopenRequested;
+
     public:
 };
 
@@ -5,25 +5,84 @@
 #include <pthread.h>
 #include <cstdlib>
 #include <csignal>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
+#include <sys/socket.h>
 using namespace std;
 
 #include "logger.h"
 #include "settings.h"
+#include "stats.h"
+#include "upgrade.h"
+#include "events.h"
+#include "sketches.h"
+#include "credentials.h"
+#include "signatures.h"
+#include "indicators.h"
+#include "accesslist.h"
+#include "geoip.h"
+#include "tarpit.h"
+#include "persona.h"
+#include "workers.h"
+#include "sessiontable.h"
+#include "trace.h"
 #include "TelnetServerSocket.h"
 #include "libsocket++/SocketException.h"
+#include "libsocket++/IOBackend.h"
 
 int startServer();
 void sigHandler( int sigNum );
+void hupHandler( int sigNum );
 void* handleConnection( void* );
-void incomingConnection( TelnetServerSocket* sock );
+void* quietConnection( void* );
+void incomingConnection( TelnetServerSocket* sock, void* (*entry)( void* ) = &handleConnection );
+void acceptConnections( TelnetServerSocket* listener, int wakeFd );
+void* acceptThread( void* );
+TelnetServerSocket* bindPersonaPort( int port );
+void startSessionServices();
+void serveSessions();
+void runWorker();
+void superviseWorkers();
+void drainHandler( int sigNum );
 void shutdownThread();
+void stopAccepting();
+void sayGoodbye( string message );
+int countSessions();
 
-//Make the following info global, so handleSigterm can shutdown stuff gracefully
-vector<pthread_t> activeThreads;
+//A running session, the fd lets a shutdown say goodbye to it
+struct ActiveSession {
+	pthread_t thread;
+	int fd;
+};
+
+//A port with a persona of its own, accepted on by its own thread. The
+//	main loop wakes it through the pipe once it's time to stop.
+struct PersonaPort {
+	TelnetServerSocket* socket;
+	int wakePipe[2];
+	pthread_t thread;
+};
+
+//Make the following info global, so a shutdown can drain the sessions gracefully
+vector<ActiveSession> activeThreads;
 auto_ptr<TelnetServerSocket> server;
+vector<PersonaPort> personaPorts;
+vector<int> tarpitListeners;
 pthread_mutex_t activeThreadsMutex = PTHREAD_MUTEX_INITIALIZER;
 
+//Written to when a signal arrives or a newer daemon has taken over the
+//	listening socket, which wakes the accept loop so it can stop and let
+//	the sessions drain
+int wakePipe[2] = { -1, -1 };
+volatile sig_atomic_t accepting = 1;
+volatile sig_atomic_t shutdownSignal = 0;
+volatile sig_atomic_t signalCount = 0;
+volatile sig_atomic_t hupCount = 0;
+
 //main() calls the startServer func
 int main( int argc, char* argv[] ) {
 	if( argc > 1 ) {
@@ -63,11 +122,19 @@ int main( int argc, char* argv[] ) {
 		return 127;
 	}
 
-	//Connect the SIGTERM handler
-	signal( SIGTERM, sigHandler );
-	signal( SIGINT, sigHandler );
-	signal( SIGQUIT, sigHandler );
-	signal( SIGABRT, sigHandler );
+	//Connect the SIGTERM handler, it only wakes the main loop which does the actual shutdown
+	struct sigaction action;
+	memset( &action, 0, sizeof(action) );
+	action.sa_handler = sigHandler;
+	action.sa_flags = SA_RESTART;
+	sigemptyset( &action.sa_mask );
+	sigaction( SIGTERM, &action, NULL );
+	sigaction( SIGINT, &action, NULL );
+	sigaction( SIGQUIT, &action, NULL );
+	
+	//SIGHUP reopens the log, for external log rotation, and reloads the access list
+	action.sa_handler = hupHandler;
+	sigaction( SIGHUP, &action, NULL );
 
 	return startServer(); //Start the server
 }
@@ -81,46 +148,175 @@ int startServer() {
 			Logger::init( Settings::getValue("logfile").asString() );
 		}
 			
-		//Create the socket, this will start listening
+		//If a daemon is already running, take its listening sockets over rather than binding
 		int listenPort = Settings::getValue("listen").asInt();
+		string upgradeSocket = Settings::getValue("upgrade_socket","").asString();
+		if( !upgradeSocket.empty() ) {
+			Upgrade::receiveListeners( upgradeSocket );
+		}
+		int inheritedFd = Upgrade::take( listenPort );
+		
+		//Create the socket, this will start listening
 		try {
 			//Setup a new socket and assign it to the auto_ptr which will delete it at the end of this function
-			server.reset( new TelnetServerSocket(listenPort) );
+			if( inheritedFd != -1 ) {
+				server.reset( new TelnetServerSocket(-1) );
+				if( !server->adopt(inheritedFd) ) {
+					throw string("bad fd");
+				}
+				Logger::info() << "Took over the listening socket from the running daemon" << endl;
+			} else {
+				server.reset( new TelnetServerSocket(listenPort) );
+			}
 		} catch(...) {
 			stringstream ss;
 			ss << "Could not bind to port " << listenPort;
 			throw ss.str();
 		}
+		
+		//Accepts poll the socket and the wake pipe, both processes may be accepting during an upgrade
+		server->set_non_blocking( true );
+		if( pipe2(wakePipe, O_CLOEXEC | O_NONBLOCK) == -1 ) {
+			throw string("Could not create wake pipe");
+		}
+		//Compile the logins the fake shell accepts
+		Credentials::load( Settings::getValue("credentials_file","").asString(),
+			Settings::getValue("valid_user","").asString(),
+			Settings::getValue("valid_pass","").asString(),
+			Settings::getValue("accept_after_attempts",0).asInt() );
+		
+		//Compile the command signatures
+		string signatureFile = Settings::getValue("signature_file","").asString();
+		if( !signatureFile.empty() ) {
+			Signatures::load( signatureFile );
+		}
+		
+		//Deduplicate the download URLs and hosts found in commands
+		Indicators::init( Settings::getValue("indicator_file","").asString(),
+			Settings::getValue("indicator_table_size",65536).asInt() );
+		
+		//ASN and country of the peers, for the events
+		string geoipFile = Settings::getValue("geoip_file","").asString();
+		if( !geoipFile.empty() ) {
+			GeoIp::load( geoipFile );
+		}
+		
+		//Networks that are dropped, served quietly or tarpitted
+		string accessList = Settings::getValue("access_list","").asString();
+		if( !accessList.empty() ) {
+			AccessList::load( accessList );
+		}
+		
+		//Pre-render the negotiation and banner every session starts with
+		TelnetNegotiation::setPolicy( Settings::getValue("telnet_will","echo").asString(),
+			Settings::getValue("telnet_allow_will","sga").asString(),
+			Settings::getValue("telnet_do","linemode naws ttype new-environ").asString(),
+			Settings::getValue("telnet_allow_do","").asString() );
+		string personaFile = Settings::getValue("persona","").asString();
+		server->setPersona( personaFile.empty() ? Persona::builtin( Settings::getValue("fumsg").asString() ) : Persona::load( personaFile ) );
+		
+		//Size the per-session arenas
+		SessionArena::setDefaultBudget( Settings::getValue("session_memory_budget",65536).asInt() );
+		TelnetServerSocket::setMaxLineLength( Settings::getValue("max_line_length",512).asInt() );
+		
+		//Pick the I/O backend, connections inherit it from the listening socket
+		string ioBackend = Settings::getValue("io_backend","blocking").asString();
+		server->set_backend( IOBackend::create(ioBackend) );
+		if( ioBackend != server->backend()->name() ) {
+			Logger::info() << "io_backend " << ioBackend << " is not available, using " << server->backend()->name() << endl;
+		}
+		
+		//More ports, each with a persona of its own, as port:file
+		istringstream personaPortList( Settings::getValue("persona_listen","").asString() );
+		string personaPortText;
+		while( personaPortList >> personaPortText ) {
+			size_t colon = personaPortText.find( ':' );
+			if( colon == string::npos ) {
+				throw string("persona_listen wants port:file, not ") + personaPortText;
+			}
+			int port = atoi( personaPortText.substr(0, colon).c_str() );
+			PersonaPort personaPort;
+			personaPort.socket = bindPersonaPort( port );
+			personaPort.socket->setPersona( Persona::load(personaPortText.substr(colon + 1)) );
+			personaPort.socket->set_backend( IOBackend::create(ioBackend) );
+			if( pipe2(personaPort.wakePipe, O_CLOEXEC | O_NONBLOCK) == -1 ) {
+				throw string("Could not create wake pipe");
+			}
+			personaPorts.push_back( personaPort );
+			Logger::info() << "bound to port " << port << " as " << personaPort.socket->getPersona()->name << endl;
+		}
+		
+		//The tarpit ports, bound before forking so the workers share them and the
+		//	supervisor can hand them over in an upgrade
+		istringstream tarpitPorts( Settings::getValue("tarpit_listen","").asString() );
+		int tarpitPort;
+		while( tarpitPorts >> tarpitPort ) {
+			tarpitListeners.push_back( Tarpit::listen(tarpitPort, Upgrade::take(tarpitPort)) );
+		}
+		
 		//Log this message to stdout as well and then fork so we become daemonized
-		Logger::info() << "bound to port " << listenPort << ", server started" << endl;
+		Logger::info() << "bound to port " << listenPort << " using the " << server->backend()->name() << " io backend, server started" << endl;
 		if( Settings::getValue("interactive",0).asInt() == 0 ) {
 			cout << "bound to port " << listenPort << ", server started" << endl;
 			if( fork() != 0 ) {
 				exit( 0 );
 			}
 		}
-			
-		//Start accepting connections on the socket
-		int maxThreadCount = Settings::getValue("max_thread_count").asInt();
-		activeThreads.reserve( maxThreadCount );
-		while( true ) {
-			//Block until the number of threads is below the minimum
-			while( true ) {
-				pthread_mutex_lock( &activeThreadsMutex );
-				int numThreads = activeThreads.size();
-				pthread_mutex_unlock( &activeThreadsMutex );
-				
-				if( numThreads < maxThreadCount ) {
-					break;
-				} else {
-					Logger::debug() << "Maximum thread count " << maxThreadCount << " reached, blocking connecting till threads finish" << endl;
-					sleep( 1 );
-				}
-			}
 		
-			//Accept the incoming connection
-			incomingConnection( server->accept() );
+		//Publish the live sessions for tools/faketelnetd-top, in one table the workers share
+		string sessionTable = Settings::getValue("session_table","").asString();
+		if( !sessionTable.empty() ) {
+			SessionTable::create( sessionTable, Settings::getValue("session_table_size",4096).asInt() );
+		}
+		
+		//Time the stages of every session, the clock is measured once for all workers
+		Trace::init( Settings::getValue("trace_events",0).asInt() != 0 );
+		
+		//Fork the workers before any thread is started, they share the listening sockets
+		int workerCount = Settings::getValue("workers",0).asInt();
+		if( workerCount > 0 ) {
+			Workers::start( workerCount, Settings::getValue("worker_ring_size",262144).asInt(), &runWorker );
+		}
+		
+		//Export session events to a collector, also from a background thread
+		string eventSocket = Settings::getValue("event_socket","").asString();
+		if( !eventSocket.empty() ) {
+			Events::init( eventSocket,
+				Settings::getValue("event_format","json").asString() == "binary" ? Events::Binary : Events::Json,
+				Settings::getValue("event_batch_count",64).asInt(),
+				Settings::getValue("event_batch_ms",200).asInt(),
+				Settings::getValue("event_queue_limit",10000).asInt(),
+				Settings::getValue("event_overflow","drop-oldest").asString() == "spill" ? Events::Spill : Events::DropOldest,
+				Settings::getValue("event_spill_file","").asString() );
+		}
+		
+		//Serve sessions here, or in workers which start those services themselves
+		if( workerCount == 0 ) {
+			startSessionServices();
+		}
+		
+		//Rotate the log from a background thread, which has to be started after forking
+		Logger::setRotation( Settings::getValue("log_rotate_size",0).asInt(),
+			Settings::getValue("log_rotate_interval",0).asInt(),
+			Settings::getValue("log_keep",0).asInt(),
+			Settings::getValue("log_compress",0).asInt() == 1 );
+		
+		//Let the old daemon go, and wait for the next upgrade ourselves
+		if( !upgradeSocket.empty() ) {
+			Upgrade::confirm();
+			vector<int> listenFds( 1, server->get_fd() );
+			for( size_t i = 0; i < personaPorts.size(); i++ ) {
+				listenFds.push_back( personaPorts[i].socket->get_fd() );
+			}
+			listenFds.insert( listenFds.end(), tarpitListeners.begin(), tarpitListeners.end() );
+			Upgrade::listen( upgradeSocket, listenFds, &stopAccepting );
+		}
+			
+		//With workers this process only supervises them from here on
+		if( workerCount > 0 ) {
+			superviseWorkers();
 		}
+		serveSessions();
 		
 	//Catch any expceptions, try to log them then print them to stderr as likely these are errors trying to start
 	} catch( std::exception & e ) {
@@ -141,10 +337,220 @@ int startServer() {
 	}
 }
 
-void incomingConnection( TelnetServerSocket* conn ) {
+void startSessionServices() {
+	//Hold tarpitted connections, and the connections to the tarpit ports, in one event loop.
+	//	Only when something uses it, it raises the open files limit and starts a thread.
+	if( !tarpitListeners.empty() || AccessList::uses(AccessList::Tarpit) ) {
+		Tarpit::init( server->getPersona()->greeting,
+			Settings::getValue("tarpit_interval",5000).asInt(),
+			Settings::getValue("tarpit_hold_time",14400).asInt(),
+			Settings::getValue("tarpit_buffer",1024).asInt(),
+			Settings::getValue("tarpit_max_connections",200000).asInt() );
+	}
+	
+	//Summarise the traffic per window, reported from a background thread as well
+	Sketches::init( Settings::getValue("sketch_window",86400).asInt(),
+		Settings::getValue("sketch_top",100).asInt() );
+}
+
+void serveSessions() {
+	//Start accepting connections on the sockets, the persona ports from threads of their own
+	activeThreads.reserve( Settings::getValue("max_thread_count").asInt() );
+	for( size_t i = 0; i < personaPorts.size(); i++ ) {
+		if( pthread_create(&personaPorts[i].thread, NULL, &acceptThread, &personaPorts[i]) != 0 ) {
+			throw string("Could not start the accept thread of a persona port");
+		}
+	}
+	acceptConnections( server.get(), wakePipe[0] );
+	
+	//The persona ports stop too, and are closed once their threads are done
+	for( size_t i = 0; i < personaPorts.size(); i++ ) {
+		char c = 0;
+		if( write(personaPorts[i].wakePipe[1], &c, 1) == -1 ) {
+			//A wakeup is pending already
+		}
+	}
+	for( size_t i = 0; i < personaPorts.size(); i++ ) {
+		pthread_join( personaPorts[i].thread, NULL );
+		delete personaPorts[i].socket;
+	}
+	
+	//Either a signal or an upgrade stopped us, close the port unless the new daemon has it
+	server.reset();
+	Tarpit::stopListening();
+	timespec start;
+	clock_gettime( CLOCK_MONOTONIC, &start );
+	
+	//An upgrade lets the sessions run their course, a shutdown asks them to leave
+	int drainTimeout = Settings::getValue("upgrade_drain_timeout",300).asInt();
+	int shutdownTimeout = Settings::getValue("shutdown_drain_timeout",10).asInt();
+	bool saidGoodbye = false;
+	int handledSignals = 0;
+	if( shutdownSignal == 0 ) {
+		Logger::info() << "Stopped accepting, draining " << countSessions() << " sessions for up to " << drainTimeout << " seconds" << endl;
+	}
+	
+	int numSessions;
+	while( true ) {
+		if( shutdownSignal != 0 && !saidGoodbye ) {
+			Logger::info() << "Caught signal " << shutdownSignal << ", draining " << countSessions() << " sessions for up to " << shutdownTimeout << " seconds" << endl;
+			sayGoodbye( Settings::getValue("shutdown_message","").asString() );
+			saidGoodbye = true;
+			handledSignals = signalCount;
+			
+			//The shutdown deadline counts from now, unless the upgrade one ends sooner
+			timespec now;
+			clock_gettime( CLOCK_MONOTONIC, &now );
+			int elapsed = now.tv_sec - start.tv_sec;
+			if( elapsed + shutdownTimeout < drainTimeout ) {
+				drainTimeout = elapsed + shutdownTimeout;
+			}
+		}
+		
+		numSessions = countSessions();
+		timespec now;
+		clock_gettime( CLOCK_MONOTONIC, &now );
+		long long elapsedMs = ( now.tv_sec - start.tv_sec ) * 1000LL + ( now.tv_nsec - start.tv_nsec ) / 1000000;
+		if( numSessions == 0 || elapsedMs >= drainTimeout * 1000LL ) {
+			break;
+		}
+		
+		//Another signal after the goodbye means don't wait any longer
+		if( saidGoodbye && signalCount != handledSignals ) {
+			Logger::info() << "Caught another signal, not waiting for the sessions" << endl;
+			break;
+		}
+		
+		//Sleep until the next check, or until a signal wakes us
+		pollfd pfd;
+		pfd.fd = wakePipe[0];
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if( poll(&pfd, 1, 100) == 1 ) {
+			char buf[16];
+			while( read(wakePipe[0], buf, sizeof(buf)) > 0 ) {}
+		}
+	}
+	
+	//Report how it went
+	timespec end;
+	clock_gettime( CLOCK_MONOTONIC, &end );
+	long long drainMs = ( end.tv_sec - start.tv_sec ) * 1000LL + ( end.tv_nsec - start.tv_nsec ) / 1000000;
+	if( numSessions == 0 ) {
+		Logger::info() << "All sessions finished after " << drainMs << "ms, exiting" << endl;
+	} else {
+		Logger::info() << "Gave up draining after " << drainMs << "ms with " << numSessions << " sessions left, exiting" << endl;
+	}
+	
+	//Hand the last events to the collector, then record the counters and flush the log
+	Indicators::shutdown();
+	Events::shutdown( 2000 );
+	if( Workers::current() == -1 ) {
+		Stats::log();
+		Trace::log();
+	}
+	Signatures::log();
+	Sketches::log();
+	AccessList::log();
+	Logger::shutdown();
+	
+	//Sessions that are still running may be using statics, so don't destroy them under their feet
+	_exit( 0 );
+}
+
+void runWorker() {
+	//Signals to this worker only wake it, so it needs wake pipes of its own
+	close( wakePipe[0] );
+	close( wakePipe[1] );
+	if( pipe2(wakePipe, O_CLOEXEC | O_NONBLOCK) == -1 ) {
+		throw string("Could not create wake pipe");
+	}
+	for( size_t i = 0; i < personaPorts.size(); i++ ) {
+		close( personaPorts[i].wakePipe[0] );
+		close( personaPorts[i].wakePipe[1] );
+		if( pipe2(personaPorts[i].wakePipe, O_CLOEXEC | O_NONBLOCK) == -1 ) {
+			throw string("Could not create wake pipe");
+		}
+	}
+	
+	//The supervisor sends SIGUSR2 when a newer daemon took over, which drains like an upgrade
+	struct sigaction action;
+	memset( &action, 0, sizeof(action) );
+	action.sa_handler = drainHandler;
+	action.sa_flags = SA_RESTART;
+	sigemptyset( &action.sa_mask );
+	sigaction( SIGUSR2, &action, NULL );
+	
+	//An io_uring can't be shared with the supervisor
+	string ioBackend = server->backend()->name();
+	server->set_backend( IOBackend::create(ioBackend) );
+	for( size_t i = 0; i < personaPorts.size(); i++ ) {
+		personaPorts[i].socket->set_backend( IOBackend::create(ioBackend) );
+	}
+	
+	//Everything we report goes through the supervisor
+	Logger::sendTo( Workers::logFd() );
+	Stats::share( Workers::stats() );
+	Trace::share( Workers::histograms() );
+	if( !Settings::getValue("event_socket","").asString().empty() ) {
+		Events::initRing( Workers::ring(),
+			Settings::getValue("event_batch_count",64).asInt(),
+			Settings::getValue("event_batch_ms",200).asInt(),
+			Settings::getValue("event_queue_limit",10000).asInt() );
+	}
+	Logger::info() << "Worker " << Workers::current() << " started" << endl;
+	
+	startSessionServices();
+	serveSessions();
+}
+
+void superviseWorkers() {
+	//Relay what the workers report and restart the ones that die. Signals are
+	//	passed on: SIGHUP as is, a shutdown as SIGTERM, and an upgrade as SIGUSR2
+	//	which makes them drain like after one.
+	int handledHups = hupCount;
+	int handledSignals = 0;
+	bool stopping = false;
+	while( Workers::supervise(wakePipe[0], 100) > 0 || !stopping ) {
+		char buf[16];
+		while( read(wakePipe[0], buf, sizeof(buf)) > 0 ) {}
+		
+		if( hupCount != handledHups ) {
+			handledHups = hupCount;
+			Workers::signalAll( SIGHUP );
+		}
+		if( !accepting && !stopping ) {
+			stopping = true;
+			handledSignals = signalCount;
+			Workers::stop( shutdownSignal != 0 ? SIGTERM : SIGUSR2 );
+			Logger::info() << "Stopping the workers" << endl;
+			
+			//Close the ports unless the new daemon has them
+			server.reset();
+			for( size_t i = 0; i < personaPorts.size(); i++ ) {
+				delete personaPorts[i].socket;
+			}
+			personaPorts.clear();
+			Tarpit::stopListening();
+		} else if( stopping && signalCount != handledSignals ) {
+			//Another signal means don't wait, and a shutdown after an upgrade means goodbye
+			handledSignals = signalCount;
+			Workers::signalAll( SIGTERM );
+		}
+	}
+	
+	Logger::info() << "All workers finished, exiting" << endl;
+	Events::shutdown( 2000 );
+	Stats::log();
+	Trace::log();
+	Logger::shutdown();
+	_exit( 0 );
+}
+
+void incomingConnection( TelnetServerSocket* conn, void* (*entry)( void* ) ) {
 	try {
 		//Log the incoming connection
-		Logger::info() << "Incoming connection from " << conn->addressAsString() << endl;
+		LOG_INFO( "Incoming connection from {}", conn->addressAsString() );
 		
 		//Lock the activeThreadsMutex - we will be inserting a new thread id into the vector
 		//	We lock the mutex before the tread is created as there is a possibility that
@@ -160,95 +566,264 @@ void incomingConnection( TelnetServerSocket* conn ) {
 		pthread_mutex_lock( &activeThreadsMutex );
 		
 		//Create the thread
-		activeThreads.push_back( (pthread_t)(-1) );
-		int retVal = pthread_create( &(activeThreads.back()), NULL, &handleConnection, (void*)conn );
+		ActiveSession session;
+		session.thread = (pthread_t)(-1);
+		session.fd = conn->get_fd();
+		activeThreads.push_back( session );
+		int retVal = pthread_create( &(activeThreads.back().thread), NULL, entry, (void*)conn );
 		
 		//Check the retval
 		if( retVal == 0 ) {
 			//Detach the thread, meaning it will free the resources immediately after it exits, rather than waiting for pthread_join
-			pthread_detach( activeThreads.back() );
+			pthread_detach( activeThreads.back().thread );
 			
-			Logger::debug() << "Started thread " << activeThreads.back() << " to handle connection" << endl;
+			LOG_DEBUG( "Started thread {} to handle connection", activeThreads.back().thread );
 		} else {
 			//Delete the connection as it couldn't be processed
 			activeThreads.erase( activeThreads.end() );
 			delete conn;
 			
 			//Log the event
-			Logger::info() << "Couldn't start thread to handle connection, pthread_create returned " << retVal << ", disconnecting socket" << endl;
+			LOG_INFO( "Couldn't start thread to handle connection, pthread_create returned {}, disconnecting socket", retVal );
 		}
 		
 		//Unlock activeThreads
 		pthread_mutex_unlock( &activeThreadsMutex );
 	} catch( SocketException & e ) {
-		Logger::info() << "Exception occurred in handleConnection:" << endl;
-		Logger::info() << "\t" << e.description() << endl;
+		LOG_INFO( "Exception occurred in handleConnection:" );
+		LOG_INFO( "\t{}", e.description() );
 	} catch( std::exception & e ) {
-		Logger::info() << "Exception occurred in handleConnection:" << endl;
-		Logger::info() << "\t" << e.what() << endl;
+		LOG_INFO( "Exception occurred in handleConnection:" );
+		LOG_INFO( "\t{}", e.what() );
+	}
+}
+
+void acceptConnections( TelnetServerSocket* listener, int wakeFd ) {
+	int maxThreadCount = Settings::getValue("max_thread_count").asInt();
+	while( accepting ) {
+		//Block until the number of threads is below the minimum
+		while( true ) {
+			pthread_mutex_lock( &activeThreadsMutex );
+			int numThreads = activeThreads.size();
+			pthread_mutex_unlock( &activeThreadsMutex );
+			
+			if( numThreads < maxThreadCount || !accepting ) {
+				break;
+			} else {
+				LOG_DEBUG( "Maximum thread count {} reached, blocking connecting till threads finish", maxThreadCount );
+				sleep( 1 );
+			}
+		}
+	
+		//Accept the incoming connection, NULL means we were woken to stop or reload.
+		//	Signals only wake the main loop, so it's the one reloading.
+		if( listener == server.get() ) {
+			AccessList::reloadIfRequested();
+		}
+		TelnetServerSocket* conn = listener->accept( wakeFd );
+		if( conn == NULL ) {
+			char buf[16];
+			while( read(wakeFd, buf, sizeof(buf)) > 0 ) {}
+			continue;
+		}
+		
+		//Listed networks may not get a session at all
+		switch( AccessList::check((const sockaddr*) &conn->get_address()) ) {
+			case AccessList::Drop:
+				delete conn;
+				break;
+			case AccessList::Quiet:
+				Logger::setQuiet( true );
+				incomingConnection( conn, &quietConnection );
+				Logger::setQuiet( false );
+				break;
+			case AccessList::Tarpit:
+				Tarpit::hold( conn->detach() );
+				delete conn;
+				break;
+			default:
+				incomingConnection( conn );
+				break;
+		}
+	}
+}
+
+void* acceptThread( void* param ) {
+	PersonaPort* port = (PersonaPort*) param;
+	try {
+		acceptConnections( port->socket, port->wakePipe[0] );
+	} catch( SocketException & e ) {
+		LOG_INFO( "Stopped accepting on a persona port: {}", e.description() );
 	}
+	return NULL;
+}
+
+TelnetServerSocket* bindPersonaPort( int port ) {
+	//The socket a running daemon handed over already listens, and has the connections it queued
+	TelnetServerSocket* sock = new TelnetServerSocket( -1 );
+	int fd = Upgrade::take( port );
+	if( fd != -1 ) {
+		if( !sock->adopt(fd) ) {
+			close( fd );
+			delete sock;
+			stringstream ss;
+			ss << "Could not take over port " << port;
+			throw ss.str();
+		}
+		sock->set_non_blocking( true );
+		Logger::info() << "Took over port " << port << " from the running daemon" << endl;
+		return sock;
+	}
+	
+	fd = socket( AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+	int on = 1;
+	setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on) );
+	
+	sockaddr_in addr;
+	memset( &addr, 0, sizeof(addr) );
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = INADDR_ANY;
+	addr.sin_port = htons( port );
+	if( fd == -1 || bind(fd, (sockaddr*) &addr, sizeof(addr)) == -1 || listen(fd, SOMAXCONN) == -1 || !sock->adopt(fd) ) {
+		close( fd );
+		delete sock;
+		stringstream ss;
+		ss << "Could not bind to port " << port;
+		throw ss.str();
+	}
+	sock->set_non_blocking( true );
+	return sock;
 }
 
 void* handleConnection( void* param ) {
+	//Setup an auto_ptr to delete the socket when this function ends
+	auto_ptr<TelnetServerSocket> sock( (TelnetServerSocket*)param );
+	Trace& trace = sock->getTrace();
+	trace.mark( Trace::ThreadStart );
+	string remoteHost = sock->addressAsString();
+	
+	//Everything the session says comes from the persona of the port it came in on
+	const Persona* persona = sock->getPersona();
+	LOG_DEBUG( "{} gets the {} persona", remoteHost, persona->name );
+	
+	//Which state the session is in, so a read timeout can be blamed on it
+	const char* state = "login";
+	Stats::Counter idleCounter = Stats::ReclaimedIdleLogin;
+	
+	//A quiet session is served like any other but leaves no trace: no log
+	//	lines, events, sketches, indicators, recordings or hook runs
+	bool quiet = Logger::isQuiet();
+	
+	//Where the peer is announced from goes along with all of its events
+	const Origin* origin = GeoIp::lookup( (const sockaddr*) &sock->get_address() );
+	if( origin != NULL ) {
+		LOG_INFO( "{} is in AS{}{}{}{}{}", remoteHost, origin->asn, origin->country[0] ? " " : "", origin->country,
+			origin->org[0] ? " " : "", origin->org );
+	}
+	if( !quiet ) {
+		Events::emit( Events::Connect, remoteHost, origin );
+		Sketches::connection( remoteHost );
+	}
+	
+	//Time the session until it ends, a quiet one sends no trace event
+	TraceScope traceScope( trace, remoteHost, origin, !quiet );
+	
+	//Show the session in the live session table, unless it's quiet
+	PublishedSession published( sock->get_fd(), sock->get_address(), !quiet );
+	
 	try {	
-		//Setup an auto_ptr to delete the socket when this function ends
-		auto_ptr<TelnetServerSocket> sock( (TelnetServerSocket*)param );
-		
-		//Setup some vars
-		string fumsg = Settings::getValue("fumsg").asString();
-		string remoteHost = sock->addressAsString();
-		string validUser = Settings::getValue("valid_user").asString();
-		string validPass = Settings::getValue("valid_pass").asString();
-		string username;
-		string password;
+		//Everything the session reads goes into the connection's arena, sized once up front
+		ArenaAllocator<char> alloc( sock->getArena() );
+		size_t maxLineLength = Settings::getValue("max_line_length",512).asInt();
+		ArenaString username( alloc );
+		ArenaString password( alloc );
+		ArenaString line( alloc );
+		username.reserve( maxLineLength );
+		password.reserve( maxLineLength );
+		line.reserve( maxLineLength );
 	
+		//Limit how long the session may hold its slot. Timeouts are in seconds.
+		int loginTimeout = Settings::getValue("timeout_login",60).asInt() * 1000;
+		int passwordTimeout = Settings::getValue("timeout_password",60).asInt() * 1000;
+		int shellTimeout = Settings::getValue("timeout_shell",300).asInt() * 1000;
+		sock->set_lifetime( Settings::getValue("max_session_time",1800).asInt() * 1000 );
+		sock->set_min_rate( Settings::getValue("min_bytes",0).asInt(), Settings::getValue("min_bytes_interval",60).asInt() * 1000 );
+		
+		//Keep a byte for byte recording of the session for tools/replay
+		string recordDir = quiet ? "" : Settings::getValue("record_dir","").asString();
+		if( !recordDir.empty() ) {
+			static long recordingCount = 0;
+			timespec now;
+			clock_gettime( CLOCK_REALTIME, &now );
+			stringstream path;
+			path << recordDir << "/" << now.tv_sec << "-" << remoteHost << "-" << __sync_add_and_fetch( &recordingCount, 1 ) << ".rec";
+			int fd = open( path.str().c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600 );
+			if( fd != -1 ) {
+				sock->set_recording( fd );
+			} else {
+				LOG_INFO( "Could not create recording {}, errno {}", path.str(), errno );
+			}
+		}
+		
 		sock->init();
 		
 		//Run the connect_exec as configured
-		string connect_exec = Settings::getValue("connect_exec","").asString();
+		string connect_exec = quiet ? "" : Settings::getValue("connect_exec","").asString();
 		if( !connect_exec.empty() ) {
 			//Do string replacement on the parameter
 			if( connect_exec.find("%ip") != string::npos ) {
 				connect_exec.replace( connect_exec.find("%ip"), 3, remoteHost );
 			}
 			
+			//Don't keep the client waiting on the banner while the hook runs
+			sock->flush();
+			trace.mark( Trace::Greeting );
+			
 			//Log and run the command
-			Logger::info() << "Running connect_exec '" << connect_exec << "'" << endl;
+			LOG_INFO( "Running connect_exec '{}'", connect_exec );
+			unsigned long long hookStart = Trace::now();
 			int exitCode = system( connect_exec.c_str() );
-			Logger::info() << "connect_exec finished with exit code " << exitCode << endl;
+			trace.span( Trace::Hook, hookStart );
+			LOG_INFO( "connect_exec finished with exit code {}", exitCode );
 		}
 		
-		//Get the username
-		(*sock) << "Telnet server could not log you in using NTML authentication.\r\n"
-			<< "Your password may have expired.\r\n"
-			<< "Login using username and password\r\n"
-			<< "\r\n"
-			<< "Welcome to Microsoft Telnet Service\r\n"
-			<< "\r\n";
-		
 		//Let the user try go "log in"
 		int maxTries = Settings::getValue("max_login_attempts").asInt();
 		bool loggedin = false;
 		for( int tries = 0; tries <= maxTries; tries++ ) {
-			(*sock) << "login: ";
-			username = sock->getLine();
-			Logger::debug() << "Received username " << username << endl;
+			published.update( SessionLogin, sock->bytes_received(), sock->bytes_sent(), username.c_str() );
+			(*sock) << persona->loginPrompt;
+			state = "login";
+			idleCounter = Stats::ReclaimedIdleLogin;
+			sock->set_read_timeout( loginTimeout );
+			sock->getLine( username );
+			LOG_DEBUG( "Received username {}", username );
 			
 			//Get the password
-			(*sock) << "password: ";
-			password = sock->getLine( true );
+			published.update( SessionPassword, sock->bytes_received(), sock->bytes_sent(), username.c_str() );
+			(*sock) << persona->passwordPrompt;
+			state = "password";
+			idleCounter = Stats::ReclaimedIdlePassword;
+			sock->set_read_timeout( passwordTimeout );
+			sock->getLine( password, true );
 			(*sock) << "\r\n";
 			
 			//Check the username and password we received
-			if( username == validUser && password == validPass ) {
+			bool accepted = Credentials::accept( username.data(), username.size(), password.data(), password.size(), tries + 1 );
+			trace.mark( Trace::Login );
+			if( accepted ) {
 				//Mark that we had a successful log
 				loggedin = true;
 				
 				//Send a message to the log
-				Logger::info() << "Successful login from " << sock->addressAsString() << " with credentials " << username << ":" << password << endl;
+				LOG_INFO( "Successful login from {} with credentials {}:{}", sock->addressAsString(), username, password );
+				if( !quiet ) {
+					Events::emit( Events::LoginSuccess, remoteHost, origin, username.c_str(), password.c_str() );
+					Sketches::login( username.c_str(), password.c_str() );
+				}
 				
 				//Run the successful login cmd as configured
-				string login_exec = Settings::getValue("login_exec","").asString();
+				string login_exec = quiet ? "" : Settings::getValue("login_exec","").asString();
 				if( !login_exec.empty() ) {
 					//Do string replacement on the parameters
 					if( login_exec.find("%ip") != string::npos ) {
@@ -256,31 +831,41 @@ void* handleConnection( void* param ) {
 					}
 			
 					if( login_exec.find("%user") != string::npos ) {
-						login_exec.replace( login_exec.find("%user"), 5, username );
+						login_exec.replace( login_exec.find("%user"), 5, username.c_str() );
 					}
 				
 					if( login_exec.find("%pass") != string::npos ) {
-						login_exec.replace( login_exec.find("%pass"), 5, password );
+						login_exec.replace( login_exec.find("%pass"), 5, password.c_str() );
 					}
 			
 					//Do some logging
-					Logger::info() << "Running login_exec '" << login_exec << "'" << endl;
+					sock->flush();
+					LOG_INFO( "Running login_exec '{}'", login_exec );
+					unsigned long long hookStart = Trace::now();
 					int exitCode = system( login_exec.c_str() );
-					Logger::info() << "login_exec finished with exit code " << exitCode << endl;
+					trace.span( Trace::Hook, hookStart );
+					LOG_INFO( "login_exec finished with exit code {}", exitCode );
 				}
+				(*sock) << persona->motd;
 				
 				//Leave the loop since the login was successful
 				break;
 			} else {
 				//Provide that delay that most systems do when a bad password was entered
-				sleep( 1 );
+				unsigned long long delayStart = Trace::now();
+				usleep( persona->failDelayMs * 1000 );
+				trace.span( Trace::FailDelay, delayStart );
 				
 				//Send back a message that the login attempt failed
-				(*sock) << "\r\n";
-				Logger::info() << "Failed login from " << sock->addressAsString() << " with credentials " << username << ":" << password << endl;
+				(*sock) << persona->loginFailed;
+				LOG_INFO( "Failed login from {} with credentials {}:{}", sock->addressAsString(), username, password );
+				if( !quiet ) {
+					Events::emit( Events::LoginFail, remoteHost, origin, username.c_str(), password.c_str() );
+					Sketches::login( username.c_str(), password.c_str() );
+				}
 				
 				//Run the login_fail_exec as configured
-				string login_fail_exec = Settings::getValue("login_fail_exec","").asString();
+				string login_fail_exec = quiet ? "" : Settings::getValue("login_fail_exec","").asString();
 				if( !login_fail_exec.empty() ) {
 					//Do string replacement on the parameters
 					if( login_fail_exec.find("%ip") != string::npos ) {
@@ -288,17 +873,20 @@ void* handleConnection( void* param ) {
 					}
 			
 					if( login_fail_exec.find("%user") != string::npos ) {
-						login_fail_exec.replace( login_fail_exec.find("%user"), 5, username );
+						login_fail_exec.replace( login_fail_exec.find("%user"), 5, username.c_str() );
 					}
 				
 					if( login_fail_exec.find("%pass") != string::npos ) {
-						login_fail_exec.replace( login_fail_exec.find("%pass"), 5, password );
+						login_fail_exec.replace( login_fail_exec.find("%pass"), 5, password.c_str() );
 					}
 			
 					//Do some logging
-					Logger::info() << "Running login_fail_exec '" << login_fail_exec << "'" << endl;
+					sock->flush();
+					LOG_INFO( "Running login_fail_exec '{}'", login_fail_exec );
+					unsigned long long hookStart = Trace::now();
 					int exitCode = system( login_fail_exec.c_str() );
-					Logger::info() << "login_fail_exec finished with exit code " << exitCode << endl;
+					trace.span( Trace::Hook, hookStart );
+					LOG_INFO( "login_fail_exec finished with exit code {}", exitCode );
 				}
 				
 				//Go back to the start of the loop, to let the user try to login again
@@ -308,20 +896,41 @@ void* handleConnection( void* param ) {
 		
 		//If we didn't see a good login that the user hit max login attempts
 		if( !loggedin ) {
-			Logger::info() << "Disconnecting " << remoteHost << " after max login attempts of " << maxTries << endl;
+			LOG_INFO( "Disconnecting {} after max login attempts of {}", remoteHost, maxTries );
+			if( !quiet ) {
+				Events::emit( Events::Disconnect, remoteHost, origin, username.c_str() );
+			}
 			
 			shutdownThread();
 		}
 		
 		//Start accepting commands into a fake shell
-		string cmd_exec = Settings::getValue("cmd_exec","").asString();
+		string cmd_exec = quiet ? "" : Settings::getValue("cmd_exec","").asString();
+		state = "shell";
+		idleCounter = Stats::ReclaimedIdleShell;
+		sock->set_read_timeout( shellTimeout );
+		published.update( SessionShell, sock->bytes_received(), sock->bytes_sent(), username.c_str() );
 		while( true ) {
 			//Print the fake command prompt
-			(*sock) << "C:\\Documents and Settings\\" << username << ">";
+			persona->sendPrompt( sock.get(), username.c_str() );
 			
-			//Read the command line and log it
-			string line = sock->getLine();
-			Logger::info() << username << "@" << remoteHost << " entered command: " << line << endl;
+			//Read the command line, tag it with the signatures it contains and log it
+			sock->getLine( line );
+			published.update( SessionShell, sock->bytes_received(), sock->bytes_sent(), username.c_str(), line.data(), line.size() );
+			int signatureIds[Signatures::MaxMatches];
+			int numSignatures = Signatures::match( line.data(), line.size(), signatureIds );
+			char tags[256];
+			Signatures::describe( signatureIds, numSignatures, tags, sizeof(tags) );
+			if( numSignatures > 0 ) {
+				LOG_INFO( "{}@{} entered command: {} [{}]", username, remoteHost, line, tags );
+			} else {
+				LOG_INFO( "{}@{} entered command: {}", username, remoteHost, line );
+			}
+			if( !quiet ) {
+				Events::emit( Events::Command, remoteHost, origin, username.c_str(), "", line.c_str(), tags );
+				Indicators::scan( line.data(), line.size(), remoteHost, origin, username.c_str() );
+				Sketches::command( line.c_str() );
+			}
 			
 			//Run the cmd_exec as configured
 			if( !cmd_exec.empty() ) {
@@ -331,81 +940,162 @@ void* handleConnection( void* param ) {
 				}
 			
 				if( cmd_exec.find("%user") != string::npos ) {
-					cmd_exec.replace( cmd_exec.find("%user"), 5, username );
+					cmd_exec.replace( cmd_exec.find("%user"), 5, username.c_str() );
 				}
 				
 				if( cmd_exec.find("%pass") != string::npos ) {
-					cmd_exec.replace( cmd_exec.find("%pass"), 5, password );
+					cmd_exec.replace( cmd_exec.find("%pass"), 5, password.c_str() );
 				}
 				
 				if( cmd_exec.find("%cmd") != string::npos ) {
-					cmd_exec.replace( cmd_exec.find("%cmd"), 4, line );
+					cmd_exec.replace( cmd_exec.find("%cmd"), 4, line.c_str() );
 				}
 			
 				//Do some logging and run the command
-				Logger::info() << "Running cmd_exec '" << cmd_exec << "'" << endl;
+				sock->flush();
+				LOG_INFO( "Running cmd_exec '{}'", cmd_exec );
+				unsigned long long hookStart = Trace::now();
 				int exitCode = system( cmd_exec.c_str() );
-				Logger::info() << "cmd_exec finished with exit code " << exitCode << endl;
+				trace.span( Trace::Hook, hookStart );
+				LOG_INFO( "cmd_exec finished with exit code {}", exitCode );
+			}
+			
+			//Take as long to answer as the device would
+			if( persona->responseDelayMs > 0 ) {
+				usleep( persona->responseDelayMs * 1000 );
 			}
 			
-			//implement a fake 'dir' output
-			if( line == "dir" ) {
-				(*sock) << "08/11/2008   12:30 PM        <DIR>          .\r\n";
-				(*sock) << "08/11/2008   12:30 PM        <DIR>          ..\r\n";
-				(*sock) << "08/11/2008   12:30 PM        <DIR>          ..\r\n";
-				(*sock) << "08/11/2008   12:30 PM        <DIR>          Start Menu\r\n";
-				(*sock) << "08/11/2008   12:30 PM        <DIR>          My Documents\r\n";
-				(*sock) << "08/11/2008   12:30 PM        <DIR>          Favorites\r\n";
-				(*sock) << "08/11/2008   12:30 PM        <DIR>          Desktop\r\n";
+			//answer the commands the persona knows
+			if( const string* reply = persona->reply(line.data(), line.size()) ) {
+				(*sock) << *reply;
 				
 			//let the user logout
-			} else if( line == "exit" || line == "logout" || line == "quit" ) {
+			} else if( persona->isExit(line.data(), line.size()) ) {
 				break;
 				
-			//default to printing the 'fu' message
+			//play along with commands a signature has a response for
+			} else if( const string* response = Signatures::response(signatureIds, numSignatures) ) {
+				(*sock) << *response;
+				
+			//default to the persona's answer to anything else, the 'fu' message unless it has one
 			} else {
-				(*sock) << fumsg << "\r\n";
-				break;
+				persona->sendUnknown( sock.get(), line.c_str() );
+				if( persona->unknownDisconnect ) {
+					break;
+				}
 			}
 		}
 		
 		//Log that the user has been disconnected
-		Logger::info() << "Ending session from " << sock->addressAsString() << endl;
+		LOG_INFO( "Ending session from {}", sock->addressAsString() );
+		LOG_DEBUG( "Session from {} used {} bytes of its arena", remoteHost, sock->getArena()->used() );
+		if( !quiet ) {
+			Events::emit( Events::Disconnect, remoteHost, origin, username.c_str() );
+		}
 		shutdownThread();
+	} catch( SocketTimeout & e ) {
+		//Free the slot, and keep count of which rule did it
+		Stats::Counter counter = idleCounter;
+		const char* reason = "idle timeout";
+		if( e.rule() == SocketTimeout::Lifetime ) {
+			counter = Stats::ReclaimedLifetime;
+			reason = "max session time";
+		} else if( e.rule() == SocketTimeout::MinRate ) {
+			counter = Stats::ReclaimedMinRate;
+			reason = "min bytes per interval";
+		}
+		Stats::increment( counter );
+		LOG_INFO( "Reclaiming slot from {}: {} in {} state ({}={})", remoteHost, reason, state,
+			Stats::name(counter), Stats::get(counter) );
 	} catch( std::exception & e ) {
-		Logger::info() << "handleConnection: " << e.what() << endl;
+		LOG_INFO( "handleConnection: {}", e.what() );
 	} catch( string & e ) {
-		Logger::info() << "handleConnection: " << e << endl;
+		LOG_INFO( "handleConnection: {}", e );
 	} catch( SocketException & e ) {
-		Logger::info() << "handleConnection: " << e.description() << endl;
+		LOG_INFO( "handleConnection: {}", e.description() );
 	}
 	
+	if( !quiet ) {
+		Events::emit( Events::Disconnect, remoteHost, origin );
+	}
 	shutdownThread();
 }
 
+void* quietConnection( void* param ) {
+	Logger::setQuiet( true );
+	return handleConnection( param );
+}
+
 void sigHandler( int sigNum ) {
-	//Log a message that we caught a signal
-	try {
-		Logger::info() << "Caught signal " << sigNum << ", shutting down" << endl;
-	} catch(...) {
-		cerr << "Caught signal " << sigNum << ", shutting down" << endl;
-	}
+	//Only async-signal-safe calls in here, the main loop does the rest
+	int savedErrno = errno;
+	shutdownSignal = sigNum;
+	signalCount++;
+	accepting = 0;
 	
-	//Kill any sub-threads we have going right now
-	for( int i = 0; i < activeThreads.size(); i++ ) {
-		if( pthread_cancel(activeThreads[i]) != 0 ) {
-			cerr << "Could not pthread_cancel thread " << activeThreads[i] << endl;
-		}
+	char c = sigNum;
+	if( wakePipe[1] != -1 && write(wakePipe[1], &c, 1) == -1 ) {
+		//The pipe is full, so the main loop has a wakeup pending already
 	}
+	errno = savedErrno;
+}
+
+void hupHandler( int sigNum ) {
+	int savedErrno = errno;
+	Logger::reopenLater();
+	AccessList::reloadLater();
+	hupCount++;
 	
-	//Delete the primary listening socket
-	server.release();
-	
-	//Shutdown the logging mechanism
-	Logger::shutdown();
+	//Wake the accept loop so the new rules apply to the very next connection
+	char c = sigNum;
+	if( wakePipe[1] != -1 && write(wakePipe[1], &c, 1) == -1 ) {
+		//The pipe is full, so the main loop has a wakeup pending already
+	}
+	errno = savedErrno;
+}
+
+void drainHandler( int sigNum ) {
+	//Like stopAccepting(), for a worker whose supervisor was upgraded
+	int savedErrno = errno;
+	accepting = 0;
+	char c = sigNum;
+	if( write(wakePipe[1], &c, 1) == -1 ) {
+		//The pipe is full, so the main loop has a wakeup pending already
+	}
+	errno = savedErrno;
+}
+
+void sayGoodbye( string message ) {
+	//Send the message and end the reads, which makes each session wrap up on its own
+	if( !message.empty() ) {
+		message = "\r\n" + message + "\r\n";
+	}
 	
-	//Exit the program
-	exit( 0 );
+	//The fds stay open while we hold the mutex, a session removes itself before closing its socket
+	pthread_mutex_lock( &activeThreadsMutex );
+	for( size_t i = 0; i < activeThreads.size(); i++ ) {
+		if( !message.empty() ) {
+			send( activeThreads[i].fd, message.data(), message.size(), MSG_NOSIGNAL | MSG_DONTWAIT );
+		}
+		shutdown( activeThreads[i].fd, SHUT_RD );
+	}
+	pthread_mutex_unlock( &activeThreadsMutex );
+}
+
+int countSessions() {
+	pthread_mutex_lock( &activeThreadsMutex );
+	int numSessions = activeThreads.size();
+	pthread_mutex_unlock( &activeThreadsMutex );
+	return numSessions;
+}
+
+void stopAccepting() {
+	//Called from the upgrade thread once the new daemon is accepting
+	accepting = 0;
+	char c = 0;
+	if( write(wakePipe[1], &c, 1) == -1 && errno != EAGAIN ) {
+		LOG_INFO( "Could not wake the accept loop, errno {}", errno );
+	}
 }
 
 void shutdownThread() {
@@ -413,9 +1103,9 @@ void shutdownThread() {
 	pthread_mutex_lock( &activeThreadsMutex );
 	
 	//Find the specified thread and remove it from the list
-	for( int i = 0; i <= activeThreads.size(); i++ ) {
-		if( activeThreads[i] == pthread_self() ) {
-			Logger::debug() << "Removing thread " << pthread_self() << " from active thread list" << endl;
+	for( int i = 0; i < activeThreads.size(); i++ ) {
+		if( activeThreads[i].thread == pthread_self() ) {
+			LOG_DEBUG( "Removing thread {} from active thread list", pthread_self() );
 			activeThreads.erase( activeThreads.begin()+i );
 		}
 	}
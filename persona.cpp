@@ -0,0 +1,203 @@
+#include "persona.h"
+
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+
+#include "logger.h"
+#include "TelnetNegotiation.h"
+
+//Orders the command table, and finds a line in it without copying the line
+struct CommandOrder {
+	bool operator()( const pair<string, string>& a, const pair<string, string>& b ) const {
+		return a.first < b.first;
+	}
+	bool operator()( const pair<string, string>& a, const pair<const char*, size_t>& b ) const {
+		return a.first.compare( 0, string::npos, b.first, b.second ) < 0;
+	}
+};
+
+//Turn the escapes of a persona value into the bytes that get sent
+static string unescape( const string& value ) {
+	string out;
+	for( size_t i = 0; i < value.size(); i++ ) {
+		if( value[i] != '\\' || i + 1 == value.size() ) {
+			out += value[i];
+			continue;
+		}
+		switch( value[++i] ) {
+			case 'n': out += "\r\n"; break;
+			case 't': out += '\t'; break;
+			case 's': out += ' '; break;
+			case 'e': out += '\x1b'; break;
+			default: out += value[i]; break;
+		}
+	}
+	return out;
+}
+
+//Split text around the first placeholder, returns whether it was there
+static bool splitTemplate( const string& text, const char* placeholder, PromptTemplate& split ) {
+	size_t at = text.find( placeholder );
+	if( at == string::npos ) {
+		split.prefix = text;
+		split.suffix.clear();
+		return false;
+	}
+	split.prefix = text.substr( 0, at );
+	split.suffix = text.substr( at + strlen(placeholder) );
+	return true;
+}
+
+Persona::Persona() : unknownDisconnect( false ), failDelayMs( 1000 ), responseDelayMs( 0 ),
+	promptHasUser( false ), unknownHasCommand( false ) {
+	loginPrompt = "login: ";
+	passwordPrompt = "password: ";
+	loginFailed = "\r\n";
+}
+
+const Persona* Persona::load( const string& path ) {
+	ifstream file( path.c_str() );
+	if( !file.good() ) {
+		throw string("Cannot read the persona in ") + path;
+	}
+
+	Persona* persona = new Persona();
+	persona->name = path;
+	string banner;
+	int linenum = 0;
+	string line;
+	while( getline(file, line) ) {
+		linenum++;
+		if( line.empty() || line[0] == '#' ) {
+			continue;
+		}
+		size_t pos = line.find( '=' );
+		if( pos == string::npos ) {
+			delete persona;
+			stringstream ss;
+			ss << "Syntax error reading persona " << path << " at line " << linenum;
+			throw ss.str();
+		}
+
+		string key = line.substr( 0, pos );
+		string value = unescape( line.substr(pos + 1) );
+		if( key.compare(0, 8, "command ") == 0 ) {
+			persona->addCommand( key.substr(8), value );
+		} else if( key == "name" ) {
+			persona->name = value;
+		} else if( key == "banner" ) {
+			banner = value;
+		} else if( key == "login_prompt" ) {
+			persona->loginPrompt = value;
+		} else if( key == "password_prompt" ) {
+			persona->passwordPrompt = value;
+		} else if( key == "login_failed" ) {
+			persona->loginFailed = value;
+		} else if( key == "fail_delay" ) {
+			persona->failDelayMs = atoi( value.c_str() );
+		} else if( key == "motd" ) {
+			persona->motd = value;
+		} else if( key == "prompt" ) {
+			persona->promptHasUser = splitTemplate( value, "%user", persona->shellPrompt );
+		} else if( key == "exit" ) {
+			istringstream words( value );
+			string word;
+			while( words >> word ) {
+				persona->exits.push_back( word );
+			}
+		} else if( key == "unknown" ) {
+			persona->unknownHasCommand = splitTemplate( value, "%cmd", persona->unknown );
+		} else if( key == "unknown_disconnect" ) {
+			persona->unknownDisconnect = atoi( value.c_str() ) != 0;
+		} else if( key == "response_delay" ) {
+			persona->responseDelayMs = atoi( value.c_str() );
+		} else {
+			delete persona;
+			stringstream ss;
+			ss << "Unknown key " << key << " in persona " << path << " at line " << linenum;
+			throw ss.str();
+		}
+	}
+
+	persona->render( banner );
+	LOG_INFO( "Loaded persona {} from {} with {} commands", persona->name, path, persona->commands.size() );
+	return persona;
+}
+
+const Persona* Persona::builtin( const string& fumsg ) {
+	Persona* persona = new Persona();
+	persona->name = "windows";
+	persona->shellPrompt.prefix = "C:\\Documents and Settings\\";
+	persona->shellPrompt.suffix = ">";
+	persona->promptHasUser = true;
+	persona->unknown.prefix = fumsg + "\r\n";
+	persona->unknownDisconnect = true;
+	persona->exits.push_back( "exit" );
+	persona->exits.push_back( "logout" );
+	persona->exits.push_back( "quit" );
+	persona->addCommand( "dir",
+		"08/11/2008   12:30 PM        <DIR>          .\r\n"
+		"08/11/2008   12:30 PM        <DIR>          ..\r\n"
+		"08/11/2008   12:30 PM        <DIR>          ..\r\n"
+		"08/11/2008   12:30 PM        <DIR>          Start Menu\r\n"
+		"08/11/2008   12:30 PM        <DIR>          My Documents\r\n"
+		"08/11/2008   12:30 PM        <DIR>          Favorites\r\n"
+		"08/11/2008   12:30 PM        <DIR>          Desktop\r\n" );
+	persona->render( "Telnet server could not log you in using NTML authentication.\r\n"
+		"Your password may have expired.\r\n"
+		"Login using username and password\r\n"
+		"\r\n"
+		"Welcome to Microsoft Telnet Service\r\n"
+		"\r\n" );
+	return persona;
+}
+
+void Persona::addCommand( const string& command, const string& reply ) {
+	commands.push_back( make_pair(command, reply) );
+}
+
+void Persona::render( const string& banner ) {
+	//Every offer goes out in the same write as the banner
+	greeting = TelnetNegotiation::initialOffers();
+	greeting += banner;
+
+	//A later line for the same command replaces an earlier one
+	stable_sort( commands.begin(), commands.end(), CommandOrder() );
+	size_t kept = 0;
+	for( size_t i = 0; i < commands.size(); i++ ) {
+		if( kept > 0 && commands[kept - 1].first == commands[i].first ) {
+			kept--;
+		}
+		commands[kept++] = commands[i];
+	}
+	commands.resize( kept );
+}
+
+const string* Persona::reply( const char* line, size_t length ) const {
+	vector< pair<string, string> >::const_iterator found =
+		lower_bound( commands.begin(), commands.end(), make_pair(line, length), CommandOrder() );
+	if( found == commands.end() || found->first.compare(0, string::npos, line, length) != 0 ) {
+		return NULL;
+	}
+	return &found->second;
+}
+
+bool Persona::isExit( const char* line, size_t length ) const {
+	for( size_t i = 0; i < exits.size(); i++ ) {
+		if( exits[i].compare(0, string::npos, line, length) == 0 ) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void Persona::sendPrompt( TelnetServerSocket* sock, const char* user ) const {
+	sock->sendPrompt( shellPrompt, promptHasUser ? user : "" );
+}
+
+void Persona::sendUnknown( TelnetServerSocket* sock, const char* line ) const {
+	sock->sendPrompt( unknown, unknownHasCommand ? line : "" );
+}
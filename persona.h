@@ -0,0 +1,87 @@
+#ifndef __PERSONA_H
+#define __PERSONA_H
+
+#include <string>
+#include <vector>
+#include <utility>
+using namespace std;
+
+#include "TelnetServerSocket.h"
+
+//What a listening port pretends to be: its banner, login flow, shell prompt,
+//	the commands it answers and how quickly. Every persona is loaded once at
+//	startup and rendered into the exact bytes its sessions send, which never
+//	change afterwards, so a session only carries a pointer to its persona
+//	and all of them share the buffers.
+//
+//	A persona file has one key=value per line, like the settings file, with
+//	nothing trimmed. In values \n is a telnet newline (CR LF), \t a tab, \e
+//	an escape and \\ a backslash. Lines starting with # are comments.
+//	  name=busybox                 used in the log
+//	  banner=...                   sent once the connection is up
+//	  login_prompt=login:\s        \s is a space, for the end of a value
+//	  password_prompt=Password:\s
+//	  login_failed=\nLogin incorrect\n
+//	  fail_delay=1000              milliseconds before login_failed
+//	  motd=...                     sent after a successful login
+//	  prompt=%user@router:~#\s     %user is replaced by the login name
+//	  command uname -a=Linux...    the reply to a command line, repeatable
+//	  exit=exit logout quit        commands ending the session
+//	  unknown=-sh: %cmd: not found\n   the reply to anything else
+//	  unknown_disconnect=0         hang up after the unknown reply
+//	  response_delay=0             milliseconds before every reply
+//	Commands a signature has a response for get that response instead.
+class Persona {
+    public:
+	//Load and render the persona in path, throws a string if it can't be
+	//	read or has a bad line. Call after the TelnetNegotiation policy is
+	//	set, the greeting starts with its offers.
+	static const Persona* load( const string& path );
+
+	//The Windows Telnet Service persona faketelnetd always had, which
+	//	answers unknown commands with fumsg and hangs up
+	static const Persona* builtin( const string& fumsg );
+
+	//The reply to a command line, NULL if it isn't in the command table
+	const string* reply( const char* line, size_t length ) const;
+
+	bool isExit( const char* line, size_t length ) const;
+
+	//Queue the shell prompt for user
+	void sendPrompt( TelnetServerSocket* sock, const char* user ) const;
+
+	//Queue the reply to a command line that isn't in the table
+	void sendUnknown( TelnetServerSocket* sock, const char* line ) const;
+
+	string name;
+
+	//The negotiation offers followed by the banner
+	string greeting;
+
+	string loginPrompt;
+	string passwordPrompt;
+	string loginFailed;
+	string motd;
+	bool unknownDisconnect;
+
+	int failDelayMs;
+	int responseDelayMs;
+
+    protected:
+	Persona();
+
+	//The prompt and unknown reply split around %user and %cmd, when they have them
+	PromptTemplate shellPrompt;
+	PromptTemplate unknown;
+	bool promptHasUser;
+	bool unknownHasCommand;
+
+	//Commands sorted for a binary search, with their replies
+	vector< pair<string, string> > commands;
+	vector<string> exits;
+
+	void render( const string& banner );
+	void addCommand( const string& command, const string& reply );
+};
+
+#endif
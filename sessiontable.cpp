@@ -0,0 +1,142 @@
+#include "sessiontable.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include "logger.h"
+
+SessionSlot* SessionTable::slots = NULL;
+unsigned int SessionTable::numSlots = 0;
+unsigned int SessionTable::nextSlot = 0;
+
+void SessionTable::create( const string& path, int useNumSlots ) {
+	//Built aside and renamed into place, so a reader still mapping the
+	//	table of an earlier daemon never sees it shrink under it.
+	//	Peers, users and commands, so only for the daemon's group.
+	string newPath = path + ".new";
+	int fd = open( newPath.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0640 );
+	if( fd == -1 ) {
+		throw string("Could not create the session table ") + newPath;
+	}
+	numSlots = useNumSlots > 0 ? useNumSlots : 1;
+	size_t length = sizeof(SessionTableHeader) + numSlots * sizeof(SessionSlot);
+	char* mem = NULL;
+	if( ftruncate(fd, length) == 0 ) {
+		mem = (char*) mmap( NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+	}
+	close( fd );
+	if( mem == NULL || mem == MAP_FAILED ) {
+		unlink( newPath.c_str() );
+		throw string("Could not map the session table ") + newPath;
+	}
+
+	SessionTableHeader* header = (SessionTableHeader*) mem;
+	memcpy( header->magic, "FTSESS1", 8 );
+	header->slotSize = sizeof(SessionSlot);
+	header->numSlots = numSlots;
+	slots = (SessionSlot*)( mem + sizeof(SessionTableHeader) );
+	if( rename(newPath.c_str(), path.c_str()) == -1 ) {
+		unlink( newPath.c_str() );
+		throw string("Could not move the session table to ") + path;
+	}
+	Logger::info() << "Publishing up to " << numSlots << " sessions in " << path << endl;
+}
+
+int SessionTable::claim( int fd, const sockaddr_in& peer ) {
+	if( slots == NULL ) {
+		return -1;
+	}
+
+	//Start where the last claim left off, the slots before it were likely taken
+	int pid = getpid();
+	unsigned int start = nextSlot;
+	for( unsigned int i = 0; i < numSlots; i++ ) {
+		unsigned int slot = ( start + i ) % numSlots;
+		if( slots[slot].owner != 0 || !__sync_bool_compare_and_swap(&slots[slot].owner, 0, pid) ) {
+			continue;
+		}
+		nextSlot = slot + 1;
+
+		sockaddr_in local;
+		socklen_t localLength = sizeof(local);
+		memset( &local, 0, sizeof(local) );
+		getsockname( fd, (sockaddr*) &local, &localLength );
+		timespec now;
+		clock_gettime( CLOCK_REALTIME_COARSE, &now );
+
+		SessionSlot& s = slots[slot];
+		s.seq++;
+		__sync_synchronize();
+		s.peer = peer.sin_addr.s_addr;
+		s.peerPort = ntohs( peer.sin_port );
+		s.port = ntohs( local.sin_port );
+		s.state = SessionLogin;
+		s.startMs = now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+		s.bytesIn = 0;
+		s.bytesOut = 0;
+		s.user[0] = '\0';
+		s.command[0] = '\0';
+		__sync_synchronize();
+		s.seq++;
+		return slot;
+	}
+	return -1;
+}
+
+void SessionTable::update( int slot, SessionState state, unsigned long long bytesIn, unsigned long long bytesOut,
+		const char* user, const char* command, size_t commandLength ) {
+	if( slot < 0 ) {
+		return;
+	}
+	SessionSlot& s = slots[slot];
+	s.seq++;
+	__sync_synchronize();
+	s.state = state;
+	s.bytesIn = bytesIn;
+	s.bytesOut = bytesOut;
+	strncpy( s.user, user, sizeof(s.user) - 1 );
+	s.user[sizeof(s.user) - 1] = '\0';
+	if( command != NULL ) {
+		size_t length = commandLength < sizeof(s.command) - 1 ? commandLength : sizeof(s.command) - 1;
+		memcpy( s.command, command, length );
+		s.command[length] = '\0';
+	}
+	__sync_synchronize();
+	s.seq++;
+}
+
+void SessionTable::release( int slot ) {
+	if( slot < 0 ) {
+		return;
+	}
+	SessionSlot& s = slots[slot];
+	s.seq++;
+	__sync_synchronize();
+	s.state = SessionFree;
+	__sync_synchronize();
+	s.seq++;
+	s.owner = 0;
+}
+
+void SessionTable::releaseOwner( int pid ) {
+	if( slots == NULL ) {
+		return;
+	}
+
+	//Whatever the dead process was in the middle of, seq has to end up even
+	for( unsigned int i = 0; i < numSlots; i++ ) {
+		SessionSlot& s = slots[i];
+		if( s.owner != pid ) {
+			continue;
+		}
+		s.seq = ( s.seq | 1 ) + 1;
+		s.state = SessionFree;
+		__sync_synchronize();
+		s.owner = 0;
+	}
+}
@@ -0,0 +1,115 @@
+#ifndef __SESSIONTABLE_H
+#define __SESSIONTABLE_H
+
+#include <string>
+#include <cstring>
+#include <netinet/in.h>
+using namespace std;
+
+enum SessionState { SessionFree, SessionLogin, SessionPassword, SessionShell };
+
+//One session, two cache lines. Only the session serving it writes a slot,
+//	under its seqlock: seq is odd while the slot is being changed.
+struct SessionSlot {
+	volatile unsigned int seq;
+	volatile int owner; //pid of the process serving it, 0 when free
+	unsigned int peer; //IPv4 address in network order
+	unsigned short peerPort;
+	unsigned short port; //local port it came in on
+	unsigned char state;
+	unsigned char pad[7];
+	long long startMs; //wall-clock ms since the epoch
+	unsigned long long bytesIn;
+	unsigned long long bytesOut;
+	char user[24];
+	char command[56]; //the start of the last command line
+};
+
+struct SessionTableHeader {
+	char magic[8];
+	unsigned int slotSize;
+	unsigned int numSlots;
+	char pad[48];
+};
+
+//The sessions being served right now, published in a file mapped into
+//	memory so tools/faketelnetd-top can watch them without the log. With
+//	workers the table is mapped before forking and shared by all of them.
+//
+//	The file is a SessionTableHeader ("FTSESS1") followed by numSlots
+//	SessionSlots. A session claims a free slot with a compare and swap on
+//	owner and updates it as it moves from state to state and runs commands.
+//	Readers copy a slot and retry when seq was odd or changed meanwhile, so
+//	they never lock anything and never write to the table. Quiet sessions
+//	aren't published.
+class SessionTable {
+    public:
+	//Create the table in path, throws a string if it can't
+	static void create( const string& path, int numSlots );
+
+	//Claim a slot for the session on fd, -1 if the table is off or full
+	static int claim( int fd, const sockaddr_in& peer );
+
+	//Publish the session's state, traffic so far, user and last command
+	static void update( int slot, SessionState state, unsigned long long bytesIn, unsigned long long bytesOut,
+		const char* user, const char* command=NULL, size_t commandLength=0 );
+
+	static void release( int slot );
+
+	//Free the slots of a process that died without releasing them
+	static void releaseOwner( int pid );
+
+	//Copy slot into copy without locking, false if it kept changing
+	static bool read( const SessionSlot* slot, SessionSlot& copy ) {
+		for( int tries = 0; tries < 100; tries++ ) {
+			unsigned int seq = slot->seq;
+			__sync_synchronize();
+			if( seq & 1 ) {
+				continue;
+			}
+			memcpy( &copy, (const void*) slot, sizeof(copy) );
+			__sync_synchronize();
+			if( slot->seq == seq ) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	static const char* stateName( int state ) {
+		switch( state ) {
+			case SessionLogin: return "login";
+			case SessionPassword: return "password";
+			case SessionShell: return "shell";
+			default: return "free";
+		}
+	}
+
+    protected:
+	static SessionSlot* slots;
+	static unsigned int numSlots;
+	static unsigned int nextSlot;
+};
+
+//A session's slot for as long as it's in scope, which includes a thread
+//	ending in pthread_exit() since that unwinds the stack. An unpublished
+//	one takes no slot and ignores updates.
+class PublishedSession {
+    public:
+	PublishedSession( int fd, const sockaddr_in& peer, bool publish ) : slot( publish ? SessionTable::claim(fd, peer) : -1 ) {
+	}
+
+	~PublishedSession() {
+		SessionTable::release( slot );
+	}
+
+	void update( SessionState state, unsigned long long bytesIn, unsigned long long bytesOut,
+			const char* user, const char* command=NULL, size_t commandLength=0 ) {
+		SessionTable::update( slot, state, bytesIn, bytesOut, user, command, commandLength );
+	}
+
+    protected:
+	int slot;
+};
+
+#endif
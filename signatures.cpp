@@ -0,0 +1,209 @@
+#include "signatures.h"
+
+#include <fstream>
+#include <deque>
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
+
+#include "logger.h"
+
+vector<string> Signatures::names;
+vector<string> Signatures::responses;
+long* Signatures::counters = NULL;
+unsigned char Signatures::byteClass[256];
+int Signatures::numClasses = 1;
+vector<unsigned int> Signatures::transitions;
+vector<unsigned int> Signatures::outputStart;
+vector<unsigned short> Signatures::outputs;
+
+static string unescape( const string& s ) {
+	string out;
+	for( size_t i = 0; i < s.size(); i++ ) {
+		if( s[i] != '\\' || i + 1 == s.size() ) {
+			out += s[i];
+			continue;
+		}
+		switch( s[++i] ) {
+			case 'n': out += "\r\n"; break;
+			case 'r': out += '\r'; break;
+			case 't': out += '\t'; break;
+			default: out += s[i]; break;
+		}
+	}
+	return out;
+}
+
+void Signatures::load( const string& path ) {
+	ifstream in( path.c_str() );
+	if( !in ) {
+		throw string("Could not read signatures from ") + path;
+	}
+
+	//Read the patterns, and which signature each belongs to
+	vector<string> patterns;
+	vector<int> patternIds;
+	string line;
+	while( getline(in, line) ) {
+		if( !line.empty() && line[line.size() - 1] == '\r' ) {
+			line.erase( line.size() - 1 );
+		}
+		size_t tab = line.find( '\t' );
+		if( line.empty() || line[0] == '#' || tab == string::npos || tab == 0 ) {
+			continue;
+		}
+		size_t tab2 = line.find( '\t', tab + 1 );
+		string name = line.substr( 0, tab );
+		string pattern = line.substr( tab + 1, tab2 == string::npos ? string::npos : tab2 - tab - 1 );
+		string response = tab2 == string::npos ? "" : unescape( line.substr(tab2 + 1) );
+		if( pattern.empty() ) {
+			continue;
+		}
+
+		int id = find( names.begin(), names.end(), name ) - names.begin();
+		if( id == (int)names.size() ) {
+			names.push_back( name );
+			responses.push_back( response );
+		} else if( responses[id].empty() ) {
+			responses[id] = response;
+		}
+		patterns.push_back( pattern );
+		patternIds.push_back( id );
+	}
+	counters = new long[names.size()]();
+
+	//Every byte used in a pattern gets its own class, the rest share class 0
+	memset( byteClass, 0, sizeof(byteClass) );
+	numClasses = 1;
+	for( size_t p = 0; p < patterns.size(); p++ ) {
+		for( size_t i = 0; i < patterns[p].size(); i++ ) {
+			unsigned char c = patterns[p][i];
+			if( byteClass[c] == 0 ) {
+				byteClass[c] = numClasses++;
+			}
+		}
+	}
+
+	//Build the trie, with 0 standing for a missing edge until it is filled in below
+	const unsigned int none = 0;
+	transitions.assign( numClasses, none );
+	vector< vector<unsigned short> > matches( 1 );
+	for( size_t p = 0; p < patterns.size(); p++ ) {
+		unsigned int state = 0;
+		for( size_t i = 0; i < patterns[p].size(); i++ ) {
+			unsigned int& next = transitions[state * numClasses + byteClass[(unsigned char)patterns[p][i]]];
+			if( next == none ) {
+				next = matches.size();
+				matches.push_back( vector<unsigned short>() );
+				transitions.resize( transitions.size() + numClasses, none );
+			}
+			state = transitions[state * numClasses + byteClass[(unsigned char)patterns[p][i]]];
+		}
+		matches[state].push_back( patternIds[p] );
+	}
+
+	//Breadth first, point every missing edge where the failure link would lead,
+	//	and let each state report what its failure state reports
+	size_t numStates = matches.size();
+	vector<unsigned int> fail( numStates, 0 );
+	deque<unsigned int> queue;
+	for( int c = 0; c < numClasses; c++ ) {
+		unsigned int child = transitions[c];
+		if( child != none ) {
+			queue.push_back( child );
+		}
+	}
+	while( !queue.empty() ) {
+		unsigned int state = queue.front();
+		queue.pop_front();
+		const vector<unsigned short>& inherited = matches[fail[state]];
+		matches[state].insert( matches[state].end(), inherited.begin(), inherited.end() );
+
+		for( int c = 0; c < numClasses; c++ ) {
+			unsigned int& next = transitions[state * numClasses + c];
+			unsigned int viaFail = transitions[fail[state] * numClasses + c];
+			if( next == none ) {
+				next = viaFail;
+			} else {
+				fail[next] = viaFail;
+				queue.push_back( next );
+			}
+		}
+	}
+
+	//Flatten what each state reports, sorted so lines report in file order
+	outputStart.assign( numStates + 1, 0 );
+	outputs.clear();
+	for( size_t s = 0; s < numStates; s++ ) {
+		sort( matches[s].begin(), matches[s].end() );
+		matches[s].erase( unique(matches[s].begin(), matches[s].end()), matches[s].end() );
+		outputStart[s] = outputs.size();
+		outputs.insert( outputs.end(), matches[s].begin(), matches[s].end() );
+	}
+	outputStart[numStates] = outputs.size();
+
+	Logger::info() << "Loaded " << names.size() << " signatures from " << patterns.size() << " patterns, "
+		<< numStates << " states of " << numClasses << " byte classes" << endl;
+}
+
+int Signatures::match( const char* line, size_t length, int* ids ) {
+	if( transitions.empty() ) {
+		return 0;
+	}
+
+	const unsigned int* table = &transitions[0];
+	const unsigned int* starts = &outputStart[0];
+	int count = 0;
+	unsigned int state = 0;
+	for( size_t i = 0; i < length; i++ ) {
+		state = table[state * numClasses + byteClass[(unsigned char)line[i]]];
+		for( unsigned int o = starts[state]; o < starts[state + 1]; o++ ) {
+			int id = outputs[o];
+			bool seen = false;
+			for( int j = 0; j < count && !seen; j++ ) {
+				seen = ids[j] == id;
+			}
+			if( !seen && count < MaxMatches ) {
+				ids[count++] = id;
+			}
+		}
+	}
+
+	sort( ids, ids + count );
+	for( int i = 0; i < count; i++ ) {
+		__sync_fetch_and_add( &counters[ids[i]], 1 );
+	}
+	return count;
+}
+
+const string& Signatures::name( int id ) {
+	return names[id];
+}
+
+const string* Signatures::response( const int* ids, int count ) {
+	for( int i = 0; i < count; i++ ) {
+		if( !responses[ids[i]].empty() ) {
+			return &responses[ids[i]];
+		}
+	}
+	return NULL;
+}
+
+void Signatures::describe( const int* ids, int count, char* buf, size_t size ) {
+	size_t used = 0;
+	buf[0] = '\0';
+	for( int i = 0; i < count; i++ ) {
+		int n = snprintf( buf + used, size - used, "%s%s", i > 0 ? "," : "", names[ids[i]].c_str() );
+		if( n < 0 || used + n >= size ) {
+			buf[used] = '\0';
+			break;
+		}
+		used += n;
+	}
+}
+
+void Signatures::log() {
+	for( size_t i = 0; i < names.size(); i++ ) {
+		Logger::info() << "stat signature_" << names[i] << "=" << __sync_fetch_and_add( &counters[i], 0 ) << endl;
+	}
+}
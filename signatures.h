@@ -0,0 +1,59 @@
+#ifndef __SIGNATURES_H
+#define __SIGNATURES_H
+
+#include <string>
+#include <vector>
+using namespace std;
+
+//Tags the commands typed into the fake shell with the signatures they
+//	contain, e.g. a wget or tftp dropper or /bin/busybox ECCHI. All patterns
+//	are compiled into one Aho-Corasick automaton, so a line is matched
+//	against every signature in a single pass over its bytes.
+//
+//	The automaton is a complete DFA in one flat table, states times byte
+//	classes: bytes that appear in no pattern share class 0, which keeps a
+//	row to a few dozen entries instead of 256.
+//
+//	The file has one pattern per line: the signature id, a tab, the
+//	pattern, and optionally a tab and the response the shell sends instead
+//	of the usual error (\n, \r, \t and \\ are unescaped in it). Several
+//	lines may share an id. Patterns match anywhere in the line and are
+//	case sensitive. Lines starting with # are comments.
+class Signatures {
+    public:
+	//Most signatures one line reports
+	enum { MaxMatches = 16 };
+
+	//Compile the signatures in path, throws a string if it can't be read
+	static void load( const string& path );
+
+	//Find the signatures in line, writing their ids (in file order) to ids.
+	//	Counts every signature found and returns how many there were.
+	static int match( const char* line, size_t length, int* ids );
+
+	static const string& name( int id );
+
+	//The response of the first of ids that has one, or NULL
+	static const string* response( const int* ids, int count );
+
+	//Write "name,name" for ids into buf
+	static void describe( const int* ids, int count, char* buf, size_t size );
+
+	//Write the per signature counters to the info log
+	static void log();
+
+    protected:
+	static vector<string> names;
+	static vector<string> responses;
+	static long* counters;
+
+	//The automaton: byte classes, the flat transition table, and the
+	//	signatures each state reports as ranges of outputs
+	static unsigned char byteClass[256];
+	static int numClasses;
+	static vector<unsigned int> transitions;
+	static vector<unsigned int> outputStart;
+	static vector<unsigned short> outputs;
+};
+
+#endif
@@ -0,0 +1,309 @@
+#include "sketches.h"
+
+#include <cmath>
+#include <cstring>
+#include <cstdio>
+#include <climits>
+#include <algorithm>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "hash.h"
+
+bool Sketches::enabled = false;
+int Sketches::windowSecs = 0;
+int Sketches::topK = 100;
+Sketches::Window Sketches::windows[2];
+volatile int Sketches::active = 0;
+
+HyperLogLog::HyperLogLog() {
+	clear();
+}
+
+void HyperLogLog::add( unsigned long long hash ) {
+	//The first Precision bits pick the register, which keeps the longest run of leading zeros after them
+	unsigned int index = hash >> ( 64 - Precision );
+	unsigned long long rest = ( hash << Precision ) | ( 1ULL << ( Precision - 1 ) );
+	unsigned char rank = __builtin_clzll( rest ) + 1;
+
+	unsigned char cur = registers[index];
+	while( rank > cur ) {
+		unsigned char seen = __sync_val_compare_and_swap( &registers[index], cur, rank );
+		if( seen == cur ) {
+			break;
+		}
+		cur = seen;
+	}
+}
+
+double HyperLogLog::estimate() const {
+	const double m = Registers;
+	double sum = 0;
+	int zeros = 0;
+	for( int i = 0; i < Registers; i++ ) {
+		sum += ldexp( 1.0, -registers[i] );
+		if( registers[i] == 0 ) {
+			zeros++;
+		}
+	}
+
+	double estimate = 0.7213 / ( 1 + 1.079 / m ) * m * m / sum;
+
+	//Small cardinalities are counted better by how many registers are still empty
+	if( estimate <= 2.5 * m && zeros > 0 ) {
+		estimate = m * log( m / zeros );
+	}
+	return estimate;
+}
+
+void HyperLogLog::clear() {
+	memset( registers, 0, sizeof(registers) );
+}
+
+SpaceSaving::SpaceSaving() {
+	slots = NULL;
+	mask = 0;
+}
+
+void SpaceSaving::init( size_t capacity ) {
+	size_t size = Probe;
+	while( size < capacity ) {
+		size *= 2;
+	}
+	slots = new Slot[size];
+	mask = size - 1;
+	clear();
+}
+
+void SpaceSaving::add( const char* key, size_t length ) {
+	if( slots == NULL ) {
+		return;
+	}
+	if( length > KeyLength - 1 ) {
+		length = KeyLength - 1;
+	}
+
+	//0 marks an empty slot
+	unsigned long long h = hashBytes( key, length );
+	if( h == 0 ) {
+		h = 1;
+	}
+
+	//Give up after a few lost races rather than spin, the value then goes uncounted
+	for( int attempt = 0; attempt < 4; attempt++ ) {
+		Slot* victim = NULL;
+		long victimCount = LONG_MAX;
+		for( size_t i = 0; i < Probe; i++ ) {
+			Slot* slot = &slots[( h + i ) & mask];
+			if( slot->hash == h ) {
+				__sync_fetch_and_add( &slot->count, 1 );
+				return;
+			}
+			long count = slot->count;
+			if( count < victimCount ) {
+				victim = slot;
+				victimCount = count;
+			}
+		}
+
+		//Take the least counted slot over, an odd version means someone else is writing it
+		unsigned int version = victim->version;
+		if( ( version & 1 ) || !__sync_bool_compare_and_swap(&victim->version, version, version + 1) ) {
+			continue;
+		}
+		long count = victim->count;
+		victim->hash = 0;
+		memcpy( victim->key, key, length );
+		victim->key[length] = '\0';
+		victim->error = count;
+		victim->count = count + 1;
+		__sync_synchronize();
+		victim->hash = h;
+		__sync_synchronize();
+		victim->version = version + 2;
+		return;
+	}
+}
+
+static bool byCount( const SpaceSaving::Entry& a, const SpaceSaving::Entry& b ) {
+	return a.count > b.count;
+}
+
+void SpaceSaving::top( size_t k, vector<SpaceSaving::Entry>& entries ) const {
+	entries.clear();
+	if( slots == NULL ) {
+		return;
+	}
+
+	for( size_t i = 0; i <= mask; i++ ) {
+		const Slot& slot = slots[i];
+		Entry entry;
+
+		//Read the slot again if a writer got in the way, skip it if that keeps happening
+		for( int attempt = 0; attempt < 4; attempt++ ) {
+			unsigned int version = slot.version;
+			__sync_synchronize();
+			if( version & 1 ) {
+				continue;
+			}
+			unsigned long long h = slot.hash;
+			entry.key.assign( slot.key, strnlen(slot.key, KeyLength) );
+			entry.count = slot.count;
+			entry.error = slot.error;
+			__sync_synchronize();
+			if( slot.version != version ) {
+				continue;
+			}
+			if( h != 0 ) {
+				entries.push_back( entry );
+			}
+			break;
+		}
+	}
+
+	sort( entries.begin(), entries.end(), byCount );
+	if( entries.size() > k ) {
+		entries.resize( k );
+	}
+}
+
+void SpaceSaving::clear() {
+	if( slots != NULL ) {
+		memset( (void*)slots, 0, sizeof(Slot) * ( mask + 1 ) );
+	}
+}
+
+const char* Sketches::distinctName( Distinct distinct ) {
+	switch( distinct ) {
+		case DistinctIps: return "distinct_ips";
+		case DistinctUsers: return "distinct_users";
+		case DistinctPasswords: return "distinct_passwords";
+		default: return "unknown";
+	}
+}
+
+const char* Sketches::topListName( TopList list ) {
+	switch( list ) {
+		case TopCredentials: return "top_credentials";
+		case TopCommands: return "top_commands";
+		case TopNetworks: return "top_networks";
+		default: return "unknown";
+	}
+}
+
+void Sketches::init( int windowSecs, int topK ) {
+	Sketches::windowSecs = windowSecs;
+	Sketches::topK = topK;
+
+	//Space-Saving is accurate for the top k when it has a few times k slots
+	for( int w = 0; w < 2; w++ ) {
+		for( int i = 0; i < NumTopLists; i++ ) {
+			windows[w].top[i].init( topK * 4 );
+		}
+	}
+	windows[0].start = time( NULL );
+	enabled = true;
+
+	if( windowSecs > 0 ) {
+		pthread_t thread;
+		pthread_create( &thread, NULL, &reporter, NULL );
+		pthread_detach( thread );
+	}
+}
+
+void Sketches::connection( const string& ip ) {
+	if( !enabled ) {
+		return;
+	}
+	Window& window = windows[active];
+	window.distinct[DistinctIps].add( hashBytes(ip.data(), ip.size()) );
+
+	//Count the /24 the address is in
+	size_t lastDot = ip.rfind( '.' );
+	if( lastDot != string::npos ) {
+		char network[32];
+		int length = snprintf( network, sizeof(network), "%.*s.0/24", (int)lastDot, ip.data() );
+		if( length > 0 && length < (int)sizeof(network) ) {
+			window.top[TopNetworks].add( network, length );
+		}
+	}
+}
+
+void Sketches::login( const char* user, const char* pass ) {
+	if( !enabled ) {
+		return;
+	}
+	Window& window = windows[active];
+	size_t userLength = strlen( user );
+	size_t passLength = strlen( pass );
+	window.distinct[DistinctUsers].add( hashBytes(user, userLength) );
+	window.distinct[DistinctPasswords].add( hashBytes(pass, passLength) );
+
+	char credential[SpaceSaving::KeyLength];
+	int length = snprintf( credential, sizeof(credential), "%s:%s", user, pass );
+	if( length >= (int)sizeof(credential) ) {
+		length = sizeof(credential) - 1;
+	}
+	window.top[TopCredentials].add( credential, length );
+}
+
+void Sketches::command( const char* cmd ) {
+	if( !enabled ) {
+		return;
+	}
+	windows[active].top[TopCommands].add( cmd, strlen(cmd) );
+}
+
+void* Sketches::reporter( void* ) {
+	while( true ) {
+		//Windows line up with the clock, like log_rotate_interval
+		time_t now = time( NULL );
+		time_t end = ( now / windowSecs + 1 ) * windowSecs;
+		while( time(NULL) < end ) {
+			sleep( 1 );
+		}
+
+		//Sessions move on to the other window. Give the ones that were in the
+		//	middle of an update a moment, then report the old window and clear it.
+		int old = active;
+		windows[!old].start = end;
+		active = !old;
+		sleep( 1 );
+		report( windows[old], end );
+		for( int i = 0; i < NumDistinct; i++ ) {
+			windows[old].distinct[i].clear();
+		}
+		for( int i = 0; i < NumTopLists; i++ ) {
+			windows[old].top[i].clear();
+		}
+	}
+	return NULL;
+}
+
+void Sketches::log() {
+	if( enabled ) {
+		report( windows[active], time(NULL) );
+	}
+}
+
+void Sketches::report( Window& window, time_t end ) {
+	char from[32], to[32];
+	struct tm tm;
+	strftime( from, sizeof(from), "%Y-%m-%dT%H:%M:%SZ", gmtime_r(&window.start, &tm) );
+	strftime( to, sizeof(to), "%Y-%m-%dT%H:%M:%SZ", gmtime_r(&end, &tm) );
+	Logger::info() << "sketch window " << from << " to " << to << endl;
+
+	for( int i = 0; i < NumDistinct; i++ ) {
+		Logger::info() << "sketch " << distinctName( (Distinct)i ) << "=" << (long)( window.distinct[i].estimate() + 0.5 ) << endl;
+	}
+
+	vector<SpaceSaving::Entry> entries;
+	for( int i = 0; i < NumTopLists; i++ ) {
+		window.top[i].top( topK, entries );
+		for( size_t rank = 0; rank < entries.size(); rank++ ) {
+			Logger::info() << "sketch " << topListName( (TopList)i ) << " #" << rank + 1 << " count=" << entries[rank].count
+				<< " error=" << entries[rank].error << " " << entries[rank].key << endl;
+		}
+	}
+}
@@ -0,0 +1,105 @@
+#ifndef __SKETCHES_H
+#define __SKETCHES_H
+
+#include <string>
+#include <vector>
+#include <time.h>
+using namespace std;
+
+//Counts distinct values in a fixed 4KB, with about 1.6% standard error.
+//	add() can be called from any thread without locking.
+class HyperLogLog {
+    public:
+	enum { Precision = 12, Registers = 1 << Precision };
+
+	HyperLogLog();
+	void add( unsigned long long hash );
+	double estimate() const;
+	void clear();
+
+    protected:
+	unsigned char registers[Registers];
+};
+
+//Space-Saving heavy hitters in a fixed number of slots. add() takes no lock:
+//	a value hashes to a run of Probe slots, increments its slot there if it
+//	has one, and otherwise takes over the slot with the lowest count, which
+//	it claims with a compare and swap on the slot's version. A slot's count
+//	overestimates its value by at most its error.
+class SpaceSaving {
+    public:
+	enum { KeyLength = 48, Probe = 8 };
+
+	struct Entry {
+		string key;
+		long count;
+		long error;
+	};
+
+	SpaceSaving();
+
+	//capacity is rounded up to a power of two
+	void init( size_t capacity );
+	void add( const char* key, size_t length );
+
+	//The k entries with the highest counts, highest first
+	void top( size_t k, vector<Entry>& entries ) const;
+	void clear();
+
+    protected:
+	struct Slot {
+		volatile unsigned int version;
+		volatile unsigned long long hash;
+		volatile long count;
+		volatile long error;
+		char key[KeyLength];
+	};
+
+	Slot* slots;
+	size_t mask;
+};
+
+//Streaming summaries of the traffic, so questions like "how many distinct
+//	IPs today" or "top 100 credentials" don't need the log reprocessed.
+//	Every window the summaries are written to the info log and start over,
+//	and Sketches::log() reports the window so far. Memory is fixed when
+//	init() is called, however much traffic arrives.
+class Sketches {
+    public:
+	enum Distinct { DistinctIps, DistinctUsers, DistinctPasswords, NumDistinct };
+	enum TopList { TopCredentials, TopCommands, TopNetworks, NumTopLists };
+
+	//Keep the topK values of each list per window of windowSecs. Starts a
+	//	background thread when windowSecs > 0, so call it after forking.
+	//	Until then the observe calls do nothing.
+	static void init( int windowSecs, int topK );
+
+	//Called from the session event points
+	static void connection( const string& ip );
+	static void login( const char* user, const char* pass );
+	static void command( const char* cmd );
+
+	//Write the current window to the info log
+	static void log();
+
+	static const char* distinctName( Distinct distinct );
+	static const char* topListName( TopList list );
+
+    protected:
+	struct Window {
+		time_t start;
+		HyperLogLog distinct[NumDistinct];
+		SpaceSaving top[NumTopLists];
+	};
+
+	static void* reporter( void* );
+	static void report( Window& window, time_t end );
+
+	static bool enabled;
+	static int windowSecs;
+	static int topK;
+	static Window windows[2];
+	static volatile int active;
+};
+
+#endif
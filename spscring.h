@@ -0,0 +1,81 @@
+#ifndef __SPSCRING_H
+#define __SPSCRING_H
+
+#include <cstring>
+#include <cstddef>
+
+//A ring of length-prefixed records between exactly one producer and one
+//	consumer, which may be different processes sharing the memory. Neither
+//	side locks: the producer only moves tail and the consumer only moves
+//	head, each publishing its move after the bytes it covers with a full
+//	barrier. The two live on separate cache lines so the sides don't fight
+//	over one.
+//
+//	Place one with new( mem ) SpscRing( capacity ) in memory of at least
+//	bytesFor( capacity ) bytes. capacity has to be a power of two.
+class SpscRing {
+    public:
+	explicit SpscRing( size_t capacity ) : head( 0 ), tail( 0 ), capacity( capacity ) {
+	}
+
+	static size_t bytesFor( size_t capacity ) {
+		return sizeof(SpscRing) + capacity;
+	}
+
+	//Append a record, false if there isn't room for all of it
+	bool push( const void* record, unsigned int length ) {
+		unsigned long long start = tail;
+		__sync_synchronize();
+		if( sizeof(length) + length > capacity - ( start - head ) ) {
+			return false;
+		}
+		copyIn( start, &length, sizeof(length) );
+		copyIn( start + sizeof(length), record, length );
+		__sync_synchronize();
+		tail = start + sizeof(length) + length;
+		return true;
+	}
+
+	//Take the oldest record into buf, returns its length, 0 when the ring
+	//	is empty. A record longer than max is skipped and returns max + 1.
+	size_t pop( char* buf, size_t max ) {
+		unsigned long long start = head;
+		__sync_synchronize();
+		if( start == tail ) {
+			return 0;
+		}
+		__sync_synchronize();
+		unsigned int length;
+		copyOut( start, &length, sizeof(length) );
+		size_t result = length <= max ? length : max + 1;
+		if( length <= max ) {
+			copyOut( start + sizeof(length), buf, length );
+		}
+		__sync_synchronize();
+		head = start + sizeof(length) + length;
+		return result;
+	}
+
+    protected:
+	void copyIn( unsigned long long at, const void* src, size_t length ) {
+		size_t offset = at & ( capacity - 1 );
+		size_t first = length < capacity - offset ? length : capacity - offset;
+		memcpy( data + offset, src, first );
+		memcpy( data, (const char*)src + first, length - first );
+	}
+
+	void copyOut( unsigned long long at, void* dst, size_t length ) const {
+		size_t offset = at & ( capacity - 1 );
+		size_t first = length < capacity - offset ? length : capacity - offset;
+		memcpy( dst, data + offset, first );
+		memcpy( (char*)dst + first, data, length - first );
+	}
+
+	//Bytes ever consumed and ever produced, the ring holds tail - head of them
+	volatile unsigned long long head __attribute__(( aligned(64) ));
+	volatile unsigned long long tail __attribute__(( aligned(64) ));
+	size_t capacity __attribute__(( aligned(64) ));
+	char data[];
+};
+
+#endif
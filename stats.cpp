@@ -0,0 +1,90 @@
+#include "stats.h"
+
+#include "logger.h"
+
+long Stats::ownCounters[Stats::NumCounters];
+long* Stats::counters = Stats::ownCounters;
+vector<const long*> Stats::included;
+
+void Stats::increment( Counter counter, long amount ) {
+	__sync_fetch_and_add( &counters[counter], amount );
+}
+
+void Stats::max( Counter counter, long value ) {
+	long cur = __sync_fetch_and_add( &counters[counter], 0 );
+	while( value > cur ) {
+		long seen = __sync_val_compare_and_swap( &counters[counter], cur, value );
+		if( seen == cur ) {
+			break;
+		}
+		cur = seen;
+	}
+}
+
+long Stats::get( Counter counter ) {
+	//Peaks are the highest any process saw, everything else adds up
+	bool peak = counter == ArenaBytesPeak || counter == TarpitHeldPeak;
+	long total = __sync_fetch_and_add( &counters[counter], 0 );
+	for( size_t i = 0; i < included.size(); i++ ) {
+		long value = __sync_fetch_and_add( (long*) &included[i][counter], 0 );
+		if( !peak ) {
+			total += value;
+		} else if( value > total ) {
+			total = value;
+		}
+	}
+	return total;
+}
+
+void Stats::share( long* shared ) {
+	counters = shared;
+}
+
+void Stats::include( const long* shared ) {
+	included.push_back( shared );
+}
+
+const char* Stats::name( Counter counter ) {
+	switch( counter ) {
+		case ReclaimedIdleLogin: return "reclaimed_idle_login";
+		case ReclaimedIdlePassword: return "reclaimed_idle_password";
+		case ReclaimedIdleShell: return "reclaimed_idle_shell";
+		case ReclaimedLifetime: return "reclaimed_lifetime";
+		case ReclaimedMinRate: return "reclaimed_min_rate";
+		case ArenaSessions: return "arena_sessions";
+		case ArenaBytes: return "arena_bytes";
+		case ArenaBytesPeak: return "arena_bytes_peak";
+		case ArenaBudgetExceeded: return "arena_budget_exceeded";
+		case LinesTruncated: return "lines_truncated";
+		case EventsSent: return "events_sent";
+		case EventsDropped: return "events_dropped";
+		case EventsSpilled: return "events_spilled";
+		case NegotiationErrors: return "negotiation_errors";
+		case IndicatorsSeen: return "indicators_seen";
+		case IndicatorsNew: return "indicators_new";
+		case TarpitAccepted: return "tarpit_accepted";
+		case TarpitHeld: return "tarpit_held";
+		case TarpitHeldPeak: return "tarpit_held_peak";
+		case TarpitReleased: return "tarpit_released";
+		case TarpitHoldSecs: return "tarpit_hold_secs";
+		default: return "unknown";
+	}
+}
+
+void Stats::log() {
+	for( int i = 0; i < NumCounters; i++ ) {
+		Logger::info() << "stat " << name( (Counter)i ) << "=" << get( (Counter)i ) << endl;
+	}
+	
+	//Average session footprint, for sizing hosts
+	long sessions = get( ArenaSessions );
+	if( sessions > 0 ) {
+		Logger::info() << "stat arena_bytes_per_session=" << get( ArenaBytes ) / sessions << endl;
+	}
+	
+	//How long the tarpit keeps scanners busy
+	long released = get( TarpitReleased );
+	if( released > 0 ) {
+		Logger::info() << "stat tarpit_avg_hold_secs=" << get( TarpitHoldSecs ) / released << endl;
+	}
+}
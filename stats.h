@@ -0,0 +1,60 @@
+#ifndef __STATS_H
+#define __STATS_H
+
+#include <string>
+#include <vector>
+using namespace std;
+
+//Process wide counters, safe to bump from any thread. With workers each
+//	worker counts into its own slot of shared memory, and the supervisor
+//	reports the sum of them all, or for a peak the highest of them.
+class Stats {
+    public:
+	enum Counter {
+		ReclaimedIdleLogin,
+		ReclaimedIdlePassword,
+		ReclaimedIdleShell,
+		ReclaimedLifetime,
+		ReclaimedMinRate,
+		ArenaSessions,
+		ArenaBytes,
+		ArenaBytesPeak,
+		ArenaBudgetExceeded,
+		LinesTruncated,
+		EventsSent,
+		EventsDropped,
+		EventsSpilled,
+		NegotiationErrors,
+		IndicatorsSeen,
+		IndicatorsNew,
+		TarpitAccepted,
+		TarpitHeld,
+		TarpitHeldPeak,
+		TarpitReleased,
+		TarpitHoldSecs,
+		NumCounters
+	};
+	
+	static void increment( Counter counter, long amount=1 );
+	
+	//Raise the counter to value if it is lower
+	static void max( Counter counter, long value );
+	static long get( Counter counter );
+	static const char* name( Counter counter );
+	
+	//Count into shared, NumCounters longs, from now on, for a worker
+	static void share( long* shared );
+	
+	//Add the counters in shared to what get() returns, for the supervisor
+	static void include( const long* shared );
+	
+	//Write every counter to the info log
+	static void log();
+
+    protected:
+	static long ownCounters[NumCounters];
+	static long* counters;
+	static vector<const long*> included;
+};
+
+#endif
@@ -0,0 +1,302 @@
+#include "tarpit.h"
+
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+
+#include "logger.h"
+#include "stats.h"
+
+//Resolution of the timer wheel, and how often the totals are logged
+static const int TICK_MS = 100;
+static const long long REPORT_MS = 600000;
+
+static const unsigned int NONE = 0xffffffff;
+
+//since is in milliseconds from the start of the loop, which only has to
+//	stay ahead of the hold time. sent is how much of the banner went out.
+struct Tarpit::Held {
+	int fd;
+	unsigned int next;
+	unsigned int since;
+	unsigned short sent;
+};
+
+string Tarpit::banner;
+int Tarpit::intervalTicks = 1;
+int Tarpit::holdMs = 0;
+int Tarpit::bufferBytes = 0;
+size_t Tarpit::maxConnections = 0;
+vector<Tarpit::Held> Tarpit::held;
+unsigned int Tarpit::freeList = NONE;
+size_t Tarpit::numHeld = 0;
+vector<unsigned int> Tarpit::wheel;
+unsigned long long Tarpit::currentTick = 0;
+vector<int> Tarpit::listeners;
+bool Tarpit::listenersPaused = false;
+int Tarpit::epollFd = -1;
+int Tarpit::handoffPipe[2] = { -1, -1 };
+long long Tarpit::startMs = 0;
+
+static long long monotonicMs() {
+	timespec now;
+	clock_gettime( CLOCK_MONOTONIC, &now );
+	return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+void Tarpit::init( const string& banner, int intervalMs, int holdSecs, int bufferBytes, int maxConnections ) {
+	Tarpit::banner = banner.empty() ? string( "\r\n" ) : banner.substr( 0, 0xffff );
+	intervalTicks = intervalMs / TICK_MS > 0 ? intervalMs / TICK_MS : 1;
+	holdMs = holdSecs > 0 ? holdSecs * 1000 : 0;
+	Tarpit::bufferBytes = bufferBytes;
+	Tarpit::maxConnections = maxConnections;
+
+	//All the connections in a slot are due together, so the wheel just has to outlast the interval
+	size_t slots = 1;
+	while( slots <= (size_t)intervalTicks ) {
+		slots *= 2;
+	}
+	wheel.assign( slots, NONE );
+
+	//Every held connection is an fd
+	rlimit limit;
+	if( getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max ) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit( RLIMIT_NOFILE, &limit );
+	}
+	if( getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < (rlim_t)maxConnections ) {
+		Logger::info() << "The open files limit of " << limit.rlim_cur << " won't let the tarpit hold "
+			<< maxConnections << " connections" << endl;
+	}
+
+	epollFd = epoll_create1( EPOLL_CLOEXEC );
+	//Neither end blocks, an accept loop must not wait for a busy tarpit
+	if( epollFd == -1 || pipe2(handoffPipe, O_CLOEXEC | O_NONBLOCK) == -1 ) {
+		throw string("Could not set up the tarpit");
+	}
+	epoll_event event;
+	memset( &event, 0, sizeof(event) );
+	event.events = EPOLLIN;
+	event.data.fd = handoffPipe[0];
+	epoll_ctl( epollFd, EPOLL_CTL_ADD, handoffPipe[0], &event );
+
+	//Accepted sockets inherit the small buffers, and the window they advertise is set before accept()
+	for( size_t i = 0; i < listeners.size(); i++ ) {
+		setsockopt( listeners[i], SOL_SOCKET, SO_RCVBUF, &bufferBytes, sizeof(bufferBytes) );
+		setsockopt( listeners[i], SOL_SOCKET, SO_SNDBUF, &bufferBytes, sizeof(bufferBytes) );
+		event.data.fd = listeners[i];
+		epoll_ctl( epollFd, EPOLL_CTL_ADD, listeners[i], &event );
+	}
+
+	//Only the loop touches listeners from here on
+	startMs = monotonicMs();
+	pthread_t thread;
+	if( pthread_create(&thread, NULL, &loop, NULL) != 0 ) {
+		throw string("Could not start the tarpit thread");
+	}
+	pthread_detach( thread );
+}
+
+int Tarpit::listen( int port, int inheritedFd ) {
+	//The socket a running daemon handed over already listens, and has the connections it queued
+	if( inheritedFd != -1 ) {
+		fcntl( inheritedFd, F_SETFL, fcntl(inheritedFd, F_GETFL) | O_NONBLOCK );
+		listeners.push_back( inheritedFd );
+		Logger::info() << "Tarpit took over port " << port << endl;
+		return inheritedFd;
+	}
+
+	int fd = socket( AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+	int on = 1;
+	setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on) );
+
+	sockaddr_in addr;
+	memset( &addr, 0, sizeof(addr) );
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = INADDR_ANY;
+	addr.sin_port = htons( port );
+	if( fd == -1 || bind(fd, (sockaddr*) &addr, sizeof(addr)) == -1 || ::listen(fd, SOMAXCONN) == -1 ) {
+		close( fd );
+		throw string("Could not bind the tarpit to port ") + strerror( errno );
+	}
+
+	listeners.push_back( fd );
+	Logger::info() << "Tarpit listening on port " << port << endl;
+	return fd;
+}
+
+void Tarpit::hold( int fd ) {
+	//A full pipe means the loop is behind, and the connection isn't worth waiting for
+	if( epollFd == -1 || write(handoffPipe[1], &fd, sizeof(fd)) != sizeof(fd) ) {
+		close( fd );
+	}
+}
+
+void Tarpit::stopListening() {
+	//Without a loop, as in a supervisor, the listeners are only held
+	if( epollFd == -1 ) {
+		for( size_t i = 0; i < listeners.size(); i++ ) {
+			close( listeners[i] );
+		}
+		listeners.clear();
+		return;
+	}
+
+	//Only done once on the way out, so this one may wait for room
+	int stop = -1;
+	while( epollFd != -1 && write(handoffPipe[1], &stop, sizeof(stop)) == -1 && errno == EAGAIN ) {
+		usleep( 1000 );
+	}
+}
+
+void* Tarpit::loop( void* ) {
+	epoll_event events[64];
+	long long nextTick = startMs + TICK_MS;
+	long long nextReport = startMs + REPORT_MS;
+	while( true ) {
+		long long now = monotonicMs();
+		int n = epoll_wait( epollFd, events, 64, nextTick > now ? nextTick - now : 0 );
+		now = monotonicMs();
+		for( int i = 0; i < n; i++ ) {
+			int fd = events[i].data.fd;
+			if( fd == handoffPipe[0] ) {
+				//Connections handed over from the accept loop, -1 asks us to stop listening
+				int handed[64];
+				ssize_t length;
+				while( ( length = read(fd, handed, sizeof(handed)) ) > 0 ) {
+					for( size_t j = 0; j < length / sizeof(int); j++ ) {
+						if( handed[j] != -1 ) {
+							add( handed[j], now );
+							continue;
+						}
+						for( size_t k = 0; k < listeners.size(); k++ ) {
+							close( listeners[k] );
+						}
+						listeners.clear();
+					}
+				}
+				continue;
+			}
+
+			int conn;
+			while( ( conn = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC) ) != -1 ) {
+				add( conn, now );
+			}
+
+			//Out of fds the pending connection stays queued and the listener
+			//	stays readable, so stop watching them rather than spin
+			if( errno == EMFILE || errno == ENFILE ) {
+				watchListeners( 0 );
+			}
+		}
+
+		//Catch up on every tick that came due, even after a stall, then try
+		//	accepting again in case releasing connections freed some fds
+		if( nextTick <= now && listenersPaused ) {
+			watchListeners( EPOLLIN );
+		}
+		while( nextTick <= now ) {
+			tick( now );
+			nextTick += TICK_MS;
+		}
+		if( now >= nextReport ) {
+			report();
+			nextReport += REPORT_MS;
+		}
+	}
+	return NULL;
+}
+
+void Tarpit::watchListeners( unsigned int events ) {
+	epoll_event event;
+	memset( &event, 0, sizeof(event) );
+	event.events = events;
+	for( size_t i = 0; i < listeners.size(); i++ ) {
+		event.data.fd = listeners[i];
+		epoll_ctl( epollFd, EPOLL_CTL_MOD, listeners[i], &event );
+	}
+	listenersPaused = events == 0;
+}
+
+void Tarpit::add( int fd, long long now ) {
+	if( numHeld >= maxConnections ) {
+		close( fd );
+		return;
+	}
+	setsockopt( fd, SOL_SOCKET, SO_SNDBUF, &bufferBytes, sizeof(bufferBytes) );
+	setsockopt( fd, SOL_SOCKET, SO_RCVBUF, &bufferBytes, sizeof(bufferBytes) );
+
+	unsigned int slot = freeList;
+	if( slot != NONE ) {
+		freeList = held[slot].next;
+	} else {
+		slot = held.size();
+		held.resize( held.size() + 1 );
+	}
+	Held& conn = held[slot];
+	conn.fd = fd;
+	conn.since = now - startMs;
+	conn.sent = 0;
+
+	//The first byte goes out one interval from now, like all the ones after it
+	unsigned int& due = wheel[( currentTick + intervalTicks ) & ( wheel.size() - 1 )];
+	conn.next = due;
+	due = slot;
+
+	numHeld++;
+	Stats::increment( Stats::TarpitAccepted );
+	Stats::increment( Stats::TarpitHeld );
+	Stats::max( Stats::TarpitHeldPeak, numHeld );
+}
+
+void Tarpit::tick( long long now ) {
+	currentTick++;
+	size_t mask = wheel.size() - 1;
+	unsigned int slot = wheel[currentTick & mask];
+	wheel[currentTick & mask] = NONE;
+	unsigned int elapsedBase = now - startMs;
+	while( slot != NONE ) {
+		Held& conn = held[slot];
+		unsigned int next = conn.next;
+
+		//A full send buffer just means the peer isn't reading, which is fine
+		ssize_t sent = send( conn.fd, banner.data() + conn.sent, 1, MSG_DONTWAIT | MSG_NOSIGNAL );
+		bool gone = sent == -1 && errno != EAGAIN && errno != EWOULDBLOCK;
+		if( gone || ( holdMs > 0 && elapsedBase - conn.since >= (unsigned int)holdMs ) ) {
+			release( slot, now );
+		} else {
+			if( sent == 1 ) {
+				conn.sent = ( conn.sent + 1 ) % banner.size();
+			}
+			unsigned int& due = wheel[( currentTick + intervalTicks ) & mask];
+			conn.next = due;
+			due = slot;
+		}
+		slot = next;
+	}
+}
+
+void Tarpit::release( unsigned int slot, long long now ) {
+	Held& conn = held[slot];
+	close( conn.fd );
+	Stats::increment( Stats::TarpitHeld, -1 );
+	Stats::increment( Stats::TarpitReleased );
+	Stats::increment( Stats::TarpitHoldSecs, ( (unsigned int)( now - startMs ) - conn.since ) / 1000 );
+	conn.fd = -1;
+	conn.next = freeList;
+	freeList = slot;
+	numHeld--;
+}
+
+void Tarpit::report() {
+	long released = Stats::get( Stats::TarpitReleased );
+	Logger::info() << "Tarpit holding " << numHeld << " connections, released " << released << " after "
+		<< ( released > 0 ? Stats::get(Stats::TarpitHoldSecs) / released : 0 ) << " seconds on average" << endl;
+}
@@ -0,0 +1,73 @@
+#ifndef __TARPIT_H
+#define __TARPIT_H
+
+#include <string>
+#include <vector>
+using namespace std;
+
+//Holds scanners for hours at next to no cost: one thread runs an epoll
+//	loop over the tarpit's listening ports, and a timer wheel drips the
+//	banner to every held connection one byte at a time, starting over
+//	once it's all out. Nothing is ever read, so a scanner that keeps
+//	talking only fills a deliberately small receive buffer.
+//
+//	A held connection is a 16 byte slot in one array and its socket, no
+//	thread, stack or buffer of its own, so 100k+ of them fit on one core.
+//	A peer that has gone is noticed when the next byte can't be sent.
+class Tarpit {
+    public:
+	//Start the loop: every intervalMs send each held connection the next
+	//	byte of banner, let go of it after holdSecs (0 keeps it until the
+	//	peer leaves), and turn away connections past maxConnections. Sockets
+	//	get send and receive buffers of bufferBytes. Starts a background
+	//	thread, so call it after forking.
+	static void init( const string& banner, int intervalMs, int holdSecs, int bufferBytes, int maxConnections );
+
+	//Accept connections on port straight into the tarpit once init() starts
+	//	the loop, so call it before that, and before forking for the workers
+	//	to share it. Adopts inheritedFd unless it's -1. Returns the listening
+	//	fd, throws a string if it can't be bound.
+	static int listen( int port, int inheritedFd );
+
+	//Hold an already accepted connection, the tarpit owns fd from now on.
+	//	Safe to call from any thread and never blocks, a connection the
+	//	loop is too far behind to take is closed.
+	static void hold( int fd );
+
+	//Close the tarpit's listening ports, the held connections stay. Also
+	//	closes them when the loop was never started.
+	static void stopListening();
+
+    protected:
+	struct Held;
+
+	static void* loop( void* );
+	static void add( int fd, long long now );
+	static void tick( long long now );
+	static void release( unsigned int slot, long long now );
+	static void report();
+	static void watchListeners( unsigned int events );
+
+	static string banner;
+	static int intervalTicks;
+	static int holdMs;
+	static int bufferBytes;
+	static size_t maxConnections;
+
+	//Held connections by slot, with free slots chained through the free list
+	static vector<Held> held;
+	static unsigned int freeList;
+	static size_t numHeld;
+
+	//Each wheel slot chains the connections due on that tick
+	static vector<unsigned int> wheel;
+	static unsigned long long currentTick;
+
+	static vector<int> listeners;
+	static bool listenersPaused;
+	static int epollFd;
+	static int handoffPipe[2];
+	static long long startMs;
+};
+
+#endif
@@ -0,0 +1,134 @@
+// Stand-in event collector for faketelnetd
+//
+// Listens on the unix socket given as event_socket and prints every event it
+// receives, one per line. Binary frames (-b) are decoded to the same fields
+// the JSON format carries. -s sleeps between reads to play a slow collector,
+// which lets the daemon's event_overflow policy be exercised.
+
+#include <iostream>
+#include <string>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+using namespace std;
+
+static const char* typeNames[] = { "connect", "login_success", "login_fail", "command", "disconnect", "indicator", "trace" };
+
+unsigned long long readBigEndian( const unsigned char* p, int bytes ) {
+	unsigned long long value = 0;
+	for( int i = 0; i < bytes; i++ ) {
+		value = ( value << 8 ) | p[i];
+	}
+	return value;
+}
+
+//Decodes the complete frames at the front of buf, leaving any partial one
+void printFrames( string& buf ) {
+	size_t used = 0;
+	while( buf.size() - used >= 4 ) {
+		const unsigned char* p = (const unsigned char*)buf.data() + used;
+		size_t length = readBigEndian( p, 4 );
+		if( buf.size() - used < 4 + length ) {
+			break;
+		}
+
+		const unsigned char* body = p + 4;
+		int type = body[1];
+		unsigned long long wallMs = readBigEndian( body + 2, 8 );
+		unsigned long long monoMs = readBigEndian( body + 10, 8 );
+		cout << "time=" << wallMs << " mono=" << monoMs << " type=" << ( type < 7 ? typeNames[type] : "unknown" );
+
+		//ip, user, pass, cmd and (from version 2) tags follow as length-prefixed
+		//	strings, then (from version 3) the asn, country and AS name
+		static const char* fields[] = { "ip", "user", "pass", "cmd", "tags", "asn", "country", "as_org" };
+		size_t pos = 18;
+		for( int i = 0; i < 8 && pos + 2 <= length; i++ ) {
+			if( i == 5 ) {
+				if( pos + 4 > length ) {
+					break;
+				}
+				unsigned long long asn = readBigEndian( body + pos, 4 );
+				if( asn != 0 ) {
+					cout << " asn=" << asn;
+				}
+				pos += 4;
+				continue;
+			}
+			size_t fieldLength = readBigEndian( body + pos, 2 );
+			pos += 2;
+			if( fieldLength > 0 ) {
+				cout << " " << fields[i] << "=" << string( (const char*)body + pos, fieldLength );
+			}
+			pos += fieldLength;
+		}
+		cout << endl;
+
+		used += 4 + length;
+	}
+	buf.erase( 0, used );
+}
+
+void usage() {
+	cerr << "usage: eventcat [-b] [-s ms] socket-path" << endl;
+	exit( 1 );
+}
+
+int main( int argc, char* argv[] ) {
+	bool binary = false;
+	int sleepMs = 0;
+
+	int c;
+	while( (c = getopt(argc, argv, "bs:")) != -1 ) {
+		switch( c ) {
+			case 'b': binary = true; break;
+			case 's': sleepMs = atoi( optarg ); break;
+			default: usage();
+		}
+	}
+	if( optind != argc - 1 ) {
+		usage();
+	}
+	string path = argv[optind];
+
+	sockaddr_un addr;
+	memset( &addr, 0, sizeof(addr) );
+	addr.sun_family = AF_UNIX;
+	strncpy( addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1 );
+
+	int server = socket( AF_UNIX, SOCK_STREAM, 0 );
+	unlink( path.c_str() );
+	if( server == -1 || bind(server, (sockaddr*)&addr, sizeof(addr)) == -1 || listen(server, 1) == -1 ) {
+		perror( "eventcat" );
+		return 1;
+	}
+
+	//Serve one collector connection after another, like a forwarder that restarts
+	while( true ) {
+		int fd = accept( server, NULL, NULL );
+		if( fd == -1 ) {
+			continue;
+		}
+		cerr << "eventcat: daemon connected" << endl;
+
+		string buf;
+		char tmp[4096];
+		int n;
+		while( (n = read(fd, tmp, sizeof(tmp))) > 0 ) {
+			if( binary ) {
+				buf.append( tmp, n );
+				printFrames( buf );
+			} else {
+				cout.write( tmp, n );
+				cout.flush();
+			}
+			if( sleepMs > 0 ) {
+				usleep( sleepMs * 1000 );
+			}
+		}
+		close( fd );
+		cerr << "eventcat: daemon disconnected" << endl;
+	}
+}
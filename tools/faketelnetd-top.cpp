@@ -0,0 +1,228 @@
+// Live view of the sessions faketelnetd is serving
+//
+// Maps the daemon's session_table read-only and shows one line per session,
+// redrawn every -i ms. Slots are copied under their seqlock without taking
+// any lock, so watching never holds up a session. -s picks the order: age
+// (oldest first), in, out (most bytes first), peer, port or state. -n prints
+// the table once and exits, for scripts.
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <csignal>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+using namespace std;
+
+#include "../sessiontable.h"
+
+struct Table {
+	const SessionTableHeader* header;
+	const SessionSlot* slots;
+	size_t length;
+	ino_t inode;
+};
+
+static string sortKey = "age";
+
+long long wallMs() {
+	timespec now;
+	clock_gettime( CLOCK_REALTIME, &now );
+	return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+//Maps the table at path, a daemon that restarted will have replaced it
+bool mapTable( const string& path, Table& table ) {
+	int fd = open( path.c_str(), O_RDONLY | O_CLOEXEC );
+	if( fd == -1 ) {
+		return false;
+	}
+	struct stat st;
+	void* mem = MAP_FAILED;
+	if( fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(SessionTableHeader) ) {
+		mem = mmap( NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+	}
+	close( fd );
+	if( mem == MAP_FAILED ) {
+		return false;
+	}
+
+	const SessionTableHeader* header = (const SessionTableHeader*) mem;
+	if( memcmp(header->magic, "FTSESS1", 8) != 0 || header->slotSize != sizeof(SessionSlot)
+			|| sizeof(SessionTableHeader) + header->numSlots * sizeof(SessionSlot) > (size_t)st.st_size ) {
+		munmap( mem, st.st_size );
+		return false;
+	}
+	table.header = header;
+	table.slots = (const SessionSlot*)( header + 1 );
+	table.length = st.st_size;
+	table.inode = st.st_ino;
+	return true;
+}
+
+bool before( const SessionSlot& a, const SessionSlot& b ) {
+	if( sortKey == "in" ) {
+		return a.bytesIn > b.bytesIn;
+	} else if( sortKey == "out" ) {
+		return a.bytesOut > b.bytesOut;
+	} else if( sortKey == "peer" ) {
+		return ntohl( a.peer ) < ntohl( b.peer );
+	} else if( sortKey == "port" ) {
+		return a.port < b.port;
+	} else if( sortKey == "state" ) {
+		return a.state > b.state;
+	}
+	return a.startMs < b.startMs;
+}
+
+//The sessions of processes that are still around, a slot is skipped when it kept changing
+void collect( const Table& table, vector<SessionSlot>& sessions, int& torn ) {
+	sessions.clear();
+	torn = 0;
+	for( unsigned int i = 0; i < table.header->numSlots; i++ ) {
+		const SessionSlot* slot = table.slots + i;
+		if( slot->owner == 0 ) {
+			continue;
+		}
+		SessionSlot copy;
+		if( !SessionTable::read(slot, copy) ) {
+			torn++;
+			continue;
+		}
+		if( copy.state == SessionFree || copy.owner == 0 || ( kill(copy.owner, 0) == -1 && errno == ESRCH ) ) {
+			continue;
+		}
+		sessions.push_back( copy );
+	}
+	sort( sessions.begin(), sessions.end(), before );
+}
+
+string duration( long long ms ) {
+	char buf[32];
+	long long s = ms > 0 ? ms / 1000 : 0;
+	if( s >= 3600 ) {
+		snprintf( buf, sizeof(buf), "%lld:%02lld:%02lld", s / 3600, s / 60 % 60, s % 60 );
+	} else {
+		snprintf( buf, sizeof(buf), "%lld:%02lld", s / 60, s % 60 );
+	}
+	return buf;
+}
+
+void print( const Table& table, const vector<SessionSlot>& sessions, int torn, int rows ) {
+	int counts[4] = { 0, 0, 0, 0 };
+	for( size_t i = 0; i < sessions.size(); i++ ) {
+		counts[sessions[i].state & 3]++;
+	}
+	cout << sessions.size() << " of " << table.header->numSlots << " slots, " << counts[SessionLogin] << " login, "
+		<< counts[SessionPassword] << " password, " << counts[SessionShell] << " shell";
+	if( torn > 0 ) {
+		cout << ", " << torn << " changing";
+	}
+	cout << ", sorted by " << sortKey << endl << endl;
+
+	cout << left << setw(22) << "PEER" << right << setw(6) << "PORT" << "  " << left << setw(9) << "STATE"
+		<< right << setw(9) << "AGE" << setw(10) << "IN" << setw(10) << "OUT" << "  " << left << setw(16) << "USER"
+		<< "COMMAND" << endl;
+	long long now = wallMs();
+	for( size_t i = 0; i < sessions.size() && ( rows <= 0 || (int)i < rows ); i++ ) {
+		const SessionSlot& s = sessions[i];
+		char peer[INET_ADDRSTRLEN + 8];
+		in_addr addr;
+		addr.s_addr = s.peer;
+		inet_ntop( AF_INET, &addr, peer, INET_ADDRSTRLEN );
+		snprintf( peer + strlen(peer), 8, ":%u", s.peerPort );
+
+		//Whatever the peer typed, minus what would mess up the terminal
+		string command( s.command, strnlen(s.command, sizeof(s.command)) );
+		string user( s.user, strnlen(s.user, sizeof(s.user)) );
+		for( size_t j = 0; j < command.size(); j++ ) {
+			if( (unsigned char)command[j] < 0x20 || command[j] == 0x7f ) {
+				command[j] = '?';
+			}
+		}
+		for( size_t j = 0; j < user.size(); j++ ) {
+			if( (unsigned char)user[j] < 0x20 || user[j] == 0x7f ) {
+				user[j] = '?';
+			}
+		}
+
+		cout << left << setw(22) << peer << right << setw(6) << s.port << "  " << left << setw(9)
+			<< SessionTable::stateName(s.state) << right << setw(9) << duration(now - s.startMs) << setw(10) << s.bytesIn
+			<< setw(10) << s.bytesOut << "  " << left << setw(16) << user.substr(0, 15) << command << endl;
+	}
+	if( rows > 0 && (int)sessions.size() > rows ) {
+		cout << "... " << sessions.size() - rows << " more" << endl;
+	}
+}
+
+void usage() {
+	cerr << "usage: faketelnetd-top [-s age|in|out|peer|port|state] [-i ms] [-n] session-table" << endl;
+	exit( 1 );
+}
+
+int main( int argc, char* argv[] ) {
+	int intervalMs = 1000;
+	bool once = false;
+
+	int c;
+	while( (c = getopt(argc, argv, "s:i:n")) != -1 ) {
+		switch( c ) {
+			case 's': sortKey = optarg; break;
+			case 'i': intervalMs = atoi( optarg ); break;
+			case 'n': once = true; break;
+			default: usage();
+		}
+	}
+	if( optind != argc - 1 || intervalMs <= 0 ) {
+		usage();
+	}
+	string path = argv[optind];
+
+	Table table;
+	if( !mapTable(path, table) ) {
+		cerr << "faketelnetd-top: " << path << " is not a session table" << endl;
+		return 1;
+	}
+
+	vector<SessionSlot> sessions;
+	int torn;
+	if( once ) {
+		collect( table, sessions, torn );
+		print( table, sessions, torn, 0 );
+		return 0;
+	}
+
+	while( true ) {
+		//Follow the table when a new daemon replaces it
+		struct stat st;
+		Table replaced;
+		if( stat(path.c_str(), &st) == 0 && st.st_ino != table.inode && mapTable(path, replaced) ) {
+			munmap( (void*) table.header, table.length );
+			table = replaced;
+		}
+
+		//Leave room for the header lines and the "more" line
+		int rows = 0;
+		winsize ws;
+		if( ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 4 ) {
+			rows = ws.ws_row - 4;
+		}
+
+		collect( table, sessions, torn );
+		cout << "\033[H\033[2J";
+		print( table, sessions, torn, rows );
+		cout.flush();
+		usleep( intervalMs * 1000 );
+	}
+}
@@ -0,0 +1,186 @@
+// Simple load generator for faketelnetd
+//
+// Opens a number of concurrent connections that each repeatedly log in, run a
+// command and disconnect, then reports sessions per second and session latency.
+// Run it against the daemon once per io_backend setting to compare backends.
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+using namespace std;
+
+struct Options {
+	string host;
+	int port;
+	int concurrency;
+	int duration;
+	string user;
+	string pass;
+	string command;
+};
+
+struct WorkerResult {
+	long sessions;
+	long failures;
+	long long bytesIn;
+	vector<double> latencies;
+};
+
+Options opts;
+volatile bool stopping = false;
+
+double now() {
+	timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//Read from the socket until the given marker shows up, returns false on EOF or error
+bool readUntil( int fd, const char* marker, long long& bytesIn ) {
+	string buf;
+	char tmp[4096];
+	while( buf.find(marker) == string::npos ) {
+		int n = recv( fd, tmp, sizeof(tmp), 0 );
+		if( n <= 0 ) {
+			return false;
+		}
+		bytesIn += n;
+		buf.append( tmp, n );
+	}
+	return true;
+}
+
+bool sendAll( int fd, const string& s ) {
+	return send( fd, s.data(), s.size(), MSG_NOSIGNAL ) == (ssize_t)s.size();
+}
+
+bool runSession( WorkerResult& result ) {
+	int fd = socket( AF_INET, SOCK_STREAM, 0 );
+	if( fd == -1 ) {
+		return false;
+	}
+
+	int on = 1;
+	setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on) );
+
+	sockaddr_in addr;
+	memset( &addr, 0, sizeof(addr) );
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons( opts.port );
+	inet_pton( AF_INET, opts.host.c_str(), &addr.sin_addr );
+
+	bool ok = connect( fd, (sockaddr*)&addr, sizeof(addr) ) == 0
+		&& readUntil( fd, "login: ", result.bytesIn )
+		&& sendAll( fd, opts.user + "\r\n" )
+		&& readUntil( fd, "password: ", result.bytesIn )
+		&& sendAll( fd, opts.pass + "\r\n" )
+		&& readUntil( fd, ">", result.bytesIn )
+		&& sendAll( fd, opts.command + "\r\n" );
+
+	//Drain whatever the server sends until it hangs up on us
+	if( ok ) {
+		char tmp[4096];
+		int n;
+		while( (n = recv(fd, tmp, sizeof(tmp), 0)) > 0 ) {
+			result.bytesIn += n;
+		}
+	}
+
+	close( fd );
+	return ok;
+}
+
+void* worker( void* param ) {
+	WorkerResult* result = (WorkerResult*) param;
+	while( !stopping ) {
+		double start = now();
+		if( runSession(*result) ) {
+			result->sessions++;
+			result->latencies.push_back( now() - start );
+		} else {
+			result->failures++;
+		}
+	}
+	return NULL;
+}
+
+void usage() {
+	cerr << "usage: loadgen [-h host] [-p port] [-c concurrency] [-d seconds]" << endl
+		<< "               [-u user] [-P pass] [-x command]" << endl;
+	exit( 1 );
+}
+
+int main( int argc, char* argv[] ) {
+	opts.host = "127.0.0.1";
+	opts.port = 23;
+	opts.concurrency = 10;
+	opts.duration = 10;
+	opts.user = "Administrator";
+	opts.pass = "password";
+	opts.command = "exit";
+
+	int c;
+	while( (c = getopt(argc, argv, "h:p:c:d:u:P:x:")) != -1 ) {
+		switch( c ) {
+			case 'h': opts.host = optarg; break;
+			case 'p': opts.port = atoi( optarg ); break;
+			case 'c': opts.concurrency = atoi( optarg ); break;
+			case 'd': opts.duration = atoi( optarg ); break;
+			case 'u': opts.user = optarg; break;
+			case 'P': opts.pass = optarg; break;
+			case 'x': opts.command = optarg; break;
+			default: usage();
+		}
+	}
+
+	vector<WorkerResult> results( opts.concurrency );
+	vector<pthread_t> threads( opts.concurrency );
+	double start = now();
+	for( int i = 0; i < opts.concurrency; i++ ) {
+		results[i].sessions = 0;
+		results[i].failures = 0;
+		results[i].bytesIn = 0;
+		pthread_create( &threads[i], NULL, &worker, &results[i] );
+	}
+
+	sleep( opts.duration );
+	stopping = true;
+	for( int i = 0; i < opts.concurrency; i++ ) {
+		pthread_join( threads[i], NULL );
+	}
+	double elapsed = now() - start;
+
+	//Merge the per-worker results
+	long sessions = 0, failures = 0;
+	long long bytesIn = 0;
+	vector<double> latencies;
+	for( int i = 0; i < opts.concurrency; i++ ) {
+		sessions += results[i].sessions;
+		failures += results[i].failures;
+		bytesIn += results[i].bytesIn;
+		latencies.insert( latencies.end(), results[i].latencies.begin(), results[i].latencies.end() );
+	}
+	sort( latencies.begin(), latencies.end() );
+
+	cout << "sessions:     " << sessions << " (" << failures << " failed)" << endl;
+	cout << "sessions/sec: " << sessions / elapsed << endl;
+	cout << "bytes in:     " << bytesIn << endl;
+	if( !latencies.empty() ) {
+		cout << "latency p50:  " << latencies[latencies.size() / 2] * 1000 << " ms" << endl;
+		cout << "latency p99:  " << latencies[latencies.size() * 99 / 100] * 1000 << " ms" << endl;
+		cout << "latency max:  " << latencies.back() * 1000 << " ms" << endl;
+	}
+
+	return failures > 0 && sessions == 0 ? 1 : 0;
+}
@@ -0,0 +1,315 @@
+// Session replay for faketelnetd
+//
+// Plays recorded sessions against a running daemon and checks that it sends
+// back exactly what it sent when the session was recorded. Recordings are the
+// .rec files the daemon writes to record_dir (see Socket::set_recording()).
+// Any other file is taken as raw client bytes, sent in one go and not checked.
+//
+// -s sets the speed: 1 replays with the original timing, 10 ten times as fast,
+// and 0 as fast as possible, sending each chunk as soon as the output that
+// preceded it in the recording has arrived.
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+using namespace std;
+
+struct Options {
+	string host;
+	int port;
+	int concurrency;
+	int repeat;
+	double speed;
+	int timeout;
+	bool check;
+};
+
+//A chunk the client sent, and how much output the server had sent before it
+struct Input {
+	unsigned int ms;
+	size_t outputBefore;
+	string data;
+};
+
+struct Recording {
+	string path;
+	vector<Input> inputs;
+	string expected;
+	bool checked;
+};
+
+struct WorkerResult {
+	long replays;
+	long failures;
+	long mismatches;
+};
+
+Options opts;
+vector<Recording> recordings;
+long nextJob = 0;
+long totalJobs = 0;
+pthread_mutex_t outputMutex = PTHREAD_MUTEX_INITIALIZER;
+
+double now() {
+	timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+unsigned int readBigEndian( const unsigned char* p ) {
+	return ( p[0] << 24 ) | ( p[1] << 16 ) | ( p[2] << 8 ) | p[3];
+}
+
+bool load( const string& path, Recording& rec ) {
+	ifstream in( path.c_str(), ios::binary );
+	if( !in ) {
+		return false;
+	}
+	stringstream ss;
+	ss << in.rdbuf();
+	string data = ss.str();
+
+	rec.path = path;
+	rec.checked = data.compare( 0, 7, "FTREC1\n" ) == 0;
+	if( !rec.checked ) {
+		Input input;
+		input.ms = 0;
+		input.outputBefore = 0;
+		input.data = data;
+		rec.inputs.push_back( input );
+		return true;
+	}
+
+	size_t pos = 7;
+	while( pos + 9 <= data.size() ) {
+		const unsigned char* header = (const unsigned char*)data.data() + pos;
+		unsigned int ms = readBigEndian( header + 1 );
+		unsigned int length = readBigEndian( header + 5 );
+		if( pos + 9 + length > data.size() ) {
+			cerr << path << ": truncated chunk at offset " << pos << ", ignoring the rest" << endl;
+			break;
+		}
+		if( header[0] == '<' ) {
+			Input input;
+			input.ms = ms;
+			input.outputBefore = rec.expected.size();
+			input.data = data.substr( pos + 9, length );
+			rec.inputs.push_back( input );
+		} else {
+			rec.expected.append( data, pos + 9, length );
+		}
+		pos += 9 + length;
+	}
+	return true;
+}
+
+//Printable version of part of a transcript
+string escape( const string& s, size_t from, size_t length ) {
+	string out;
+	char tmp[8];
+	for( size_t i = from; i < s.size() && i < from + length; i++ ) {
+		unsigned char c = s[i];
+		if( c >= 0x20 && c < 0x7f && c != '\\' ) {
+			out += c;
+		} else {
+			snprintf( tmp, sizeof(tmp), "\\x%02x", c );
+			out += tmp;
+		}
+	}
+	return out;
+}
+
+//Reads whatever is available within waitMs, returns false once the server hung up
+bool receive( int fd, string& received, int waitMs ) {
+	pollfd pfd;
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	if( poll(&pfd, 1, waitMs) <= 0 ) {
+		return true;
+	}
+
+	char tmp[4096];
+	int n = recv( fd, tmp, sizeof(tmp), 0 );
+	if( n <= 0 ) {
+		return false;
+	}
+	received.append( tmp, n );
+	return true;
+}
+
+//Returns 0 on a match, 1 on a mismatch, 2 if the replay itself failed
+int replay( const Recording& rec ) {
+	int fd = socket( AF_INET, SOCK_STREAM, 0 );
+	if( fd == -1 ) {
+		return 2;
+	}
+	int on = 1;
+	setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on) );
+
+	sockaddr_in addr;
+	memset( &addr, 0, sizeof(addr) );
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons( opts.port );
+	inet_pton( AF_INET, opts.host.c_str(), &addr.sin_addr );
+	if( connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0 ) {
+		close( fd );
+		return 2;
+	}
+
+	string received;
+	bool open = true;
+	double start = now();
+	double giveUp = start + opts.timeout;
+	for( size_t i = 0; i < rec.inputs.size() && open; i++ ) {
+		const Input& input = rec.inputs[i];
+		while( open ) {
+			//Wait for the recorded time, or for the output the client saw first
+			int waitMs = 0;
+			if( opts.speed > 0 ) {
+				waitMs = ( start + input.ms / 1000.0 / opts.speed - now() ) * 1000;
+			} else if( received.size() < input.outputBefore ) {
+				waitMs = ( giveUp - now() ) * 1000;
+			}
+			if( waitMs <= 0 ) {
+				break;
+			}
+			open = receive( fd, received, waitMs );
+			if( now() >= giveUp ) {
+				open = false;
+			}
+		}
+		if( open && send(fd, input.data.data(), input.data.size(), MSG_NOSIGNAL) != (ssize_t)input.data.size() ) {
+			open = false;
+		}
+	}
+
+	//Collect the rest, until the server hangs up or everything expected is in
+	while( open && now() < giveUp && ( !rec.checked || received.size() < rec.expected.size() ) ) {
+		open = receive( fd, received, ( giveUp - now() ) * 1000 );
+	}
+	close( fd );
+
+	if( !rec.checked ) {
+		return 0;
+	}
+	if( received == rec.expected ) {
+		return 0;
+	}
+
+	size_t diff = 0;
+	while( diff < received.size() && diff < rec.expected.size() && received[diff] == rec.expected[diff] ) {
+		diff++;
+	}
+	size_t from = diff > 20 ? diff - 20 : 0;
+	pthread_mutex_lock( &outputMutex );
+	cerr << rec.path << ": output differs at byte " << diff << " (expected " << rec.expected.size()
+		<< " bytes, got " << received.size() << ")" << endl
+		<< "  expected: " << escape( rec.expected, from, 60 ) << endl
+		<< "  got:      " << escape( received, from, 60 ) << endl;
+	pthread_mutex_unlock( &outputMutex );
+	return 1;
+}
+
+void* worker( void* param ) {
+	WorkerResult* result = (WorkerResult*) param;
+	while( true ) {
+		long job = __sync_fetch_and_add( &nextJob, 1 );
+		if( job >= totalJobs ) {
+			break;
+		}
+
+		int status = replay( recordings[job % recordings.size()] );
+		result->replays++;
+		if( status == 1 ) {
+			result->mismatches++;
+		} else if( status == 2 ) {
+			result->failures++;
+		}
+	}
+	return NULL;
+}
+
+void usage() {
+	cerr << "usage: replay [-h host] [-p port] [-c concurrency] [-n repeat]" << endl
+		<< "              [-s speed] [-t timeout] [-q] recording..." << endl;
+	exit( 1 );
+}
+
+int main( int argc, char* argv[] ) {
+	opts.host = "127.0.0.1";
+	opts.port = 23;
+	opts.concurrency = 1;
+	opts.repeat = 1;
+	opts.speed = 1;
+	opts.timeout = 30;
+	opts.check = true;
+
+	int c;
+	while( (c = getopt(argc, argv, "h:p:c:n:s:t:q")) != -1 ) {
+		switch( c ) {
+			case 'h': opts.host = optarg; break;
+			case 'p': opts.port = atoi( optarg ); break;
+			case 'c': opts.concurrency = atoi( optarg ); break;
+			case 'n': opts.repeat = atoi( optarg ); break;
+			case 's': opts.speed = atof( optarg ); break;
+			case 't': opts.timeout = atoi( optarg ); break;
+			case 'q': opts.check = false; break;
+			default: usage();
+		}
+	}
+	if( optind >= argc || opts.concurrency < 1 ) {
+		usage();
+	}
+
+	for( int i = optind; i < argc; i++ ) {
+		Recording rec;
+		if( !load(argv[i], rec) ) {
+			cerr << "Could not read " << argv[i] << endl;
+			return 1;
+		}
+		rec.checked = rec.checked && opts.check;
+		recordings.push_back( rec );
+	}
+	totalJobs = (long)recordings.size() * opts.repeat;
+
+	vector<WorkerResult> results( opts.concurrency );
+	vector<pthread_t> threads( opts.concurrency );
+	double start = now();
+	for( int i = 0; i < opts.concurrency; i++ ) {
+		results[i].replays = 0;
+		results[i].failures = 0;
+		results[i].mismatches = 0;
+		pthread_create( &threads[i], NULL, &worker, &results[i] );
+	}
+	for( int i = 0; i < opts.concurrency; i++ ) {
+		pthread_join( threads[i], NULL );
+	}
+	double elapsed = now() - start;
+
+	long replays = 0, failures = 0, mismatches = 0;
+	for( int i = 0; i < opts.concurrency; i++ ) {
+		replays += results[i].replays;
+		failures += results[i].failures;
+		mismatches += results[i].mismatches;
+	}
+
+	cout << "replays:      " << replays << " (" << failures << " failed, " << mismatches << " mismatched)" << endl;
+	cout << "replays/sec:  " << replays / elapsed << endl;
+
+	return failures > 0 || mismatches > 0 ? 1 : 0;
+}
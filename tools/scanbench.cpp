@@ -0,0 +1,227 @@
+// Benchmark for the input fast path of faketelnetd
+//
+// Builds a buffer that looks like a script a bot pastes (lines of shell
+// commands, CR LF terminated) and splits it into lines the way getLine() does:
+// once a byte at a time, as the scalar path did, and once with each
+// InputScan implementation finding the plain runs, which are then copied in
+// bulk. Reports MB/s for each and checks they all produce the same lines.
+//
+// The same buffer also goes through EscapeParser a byte at a time, and a few
+// inputs with escape sequences in them have to split into the right lines.
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <unistd.h>
+#include <time.h>
+using namespace std;
+
+#include "../inputscan.h"
+#include "../EscapeParser.h"
+
+typedef size_t (*FindFunction)( const char*, size_t );
+
+double now() {
+	timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+string makeInput( size_t size, int lineLength ) {
+	static const char* words[] = { "cd", "/tmp;", "wget", "http://203.0.113.7/bins/x86", "-O", "-", "|", "sh;",
+		"chmod", "+x", "busybox", "tftp", "-g", "-r", "mips", "echo", "-e", "'\\x41\\x4b'", "cat", "/proc/cpuinfo" };
+	string input;
+	string line;
+	srand( 1 );
+	while( input.size() < size ) {
+		line.clear();
+		while( (int)line.size() < lineLength ) {
+			line += words[rand() % (sizeof(words) / sizeof(words[0]))];
+			line += ' ';
+		}
+		input += line;
+		input += "\r\n";
+	}
+	return input;
+}
+
+//What getLine() did per character: check it, append it, echo it
+size_t splitBytewise( const string& input, string& line, string& echo ) {
+	size_t lines = 0;
+	for( size_t i = 0; i < input.size(); i++ ) {
+		unsigned char c = input[i];
+		if( c < 0x20 || c == 0x7f || c == 0xff ) {
+			if( c == '\r' ) {
+				lines += line.size();
+				line.clear();
+				i++;
+			}
+			continue;
+		}
+		line += c;
+		echo.append( (const char*)&c, 1 );
+	}
+	return lines;
+}
+
+//The fast path: find the run, append and echo it in one go
+size_t splitRuns( FindFunction find, const string& input, string& line, string& echo ) {
+	size_t lines = 0;
+	const char* data = input.data();
+	size_t length = input.size();
+	size_t i = 0;
+	while( i < length ) {
+		size_t run = find( data + i, length - i );
+		line.append( data + i, run );
+		echo.append( data + i, run );
+		i += run;
+		if( i < length ) {
+			if( data[i] == '\r' ) {
+				lines += line.size();
+				line.clear();
+				i++;
+			}
+			i++;
+		}
+	}
+	return lines;
+}
+
+//What getLine() does with the bytes that aren't plain: feed the escape parser
+size_t splitEscapes( const string& input, string& line, string& echo, vector<string>* lines=NULL ) {
+	EscapeParser escapes;
+	size_t lineBytes = 0;
+	for( size_t i = 0; i < input.size(); i++ ) {
+		int c = escapes.feed( input[i] );
+		if( c == EscapeParser::None || c >= EscapeParser::KeyUp ) {
+			continue;
+		}
+		if( c < 0x20 || c == 0x7f || c == 0xff ) {
+			if( c == '\r' ) {
+				lineBytes += line.size();
+				if( lines != NULL ) {
+					lines->push_back( line );
+				}
+				line.clear();
+			}
+			continue;
+		}
+		line += (char)c;
+		echo.append( 1, (char)c );
+	}
+	return lineBytes;
+}
+
+//Sequences that have to come apart into the lines after the |
+bool checkEscapes() {
+	static const char* cases[][2] = {
+		{ "ls\x1b[A\x1b[1;5C\x1bOP -l\r\n", "ls -l" },
+		{ "\x1b]0;title\x07id\r\n", "id" },
+		{ "\x1bP1$r\x1b\\pwd\r\n", "pwd" },
+		{ "ec\x1b[?1;2cho\r\n", "echo" },
+		{ "\x1b]0;never terminated\r\nuname -a\r\n", "|uname -a" },
+		{ "\x1b_apc\x1b\r\nid\r\n", "|id" },
+		{ "\x1b^pm\x18" "cat\r\n", "cat" }
+	};
+	bool ok = true;
+	for( size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++ ) {
+		string line, echo;
+		vector<string> lines;
+		splitEscapes( cases[i][0], line, echo, &lines );
+		string got;
+		for( size_t l = 0; l < lines.size(); l++ ) {
+			got += ( l > 0 ? "|" : "" ) + lines[l];
+		}
+		if( got != cases[i][1] ) {
+			cerr << "escape case " << i << ": got \"" << got << "\", expected \"" << cases[i][1] << "\"" << endl;
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+void usage() {
+	cerr << "usage: scanbench [-s size] [-l line length] [-n iterations]" << endl;
+	exit( 1 );
+}
+
+int main( int argc, char* argv[] ) {
+	size_t size = 64 * 1024;
+	int lineLength = 200;
+	int iterations = 2000;
+
+	int c;
+	while( (c = getopt(argc, argv, "s:l:n:")) != -1 ) {
+		switch( c ) {
+			case 's': size = atol( optarg ); break;
+			case 'l': lineLength = atoi( optarg ); break;
+			case 'n': iterations = atoi( optarg ); break;
+			default: usage();
+		}
+	}
+
+	string input = makeInput( size, lineLength );
+	string line, echo;
+	line.reserve( 4096 );
+	echo.reserve( input.size() );
+
+	struct Variant {
+		const char* name;
+		FindFunction find;
+	};
+	vector<Variant> variants;
+	variants.push_back( (Variant){ "scalar", InputScan::findSpecialScalar } );
+	variants.push_back( (Variant){ "sse2", InputScan::findSpecialSse2 } );
+	if( strcmp(InputScan::implementation(), "avx2") == 0 ) {
+		variants.push_back( (Variant){ "avx2", InputScan::findSpecialAvx2 } );
+	}
+
+	cout << "input: " << input.size() << " bytes, lines of ~" << lineLength << ", " << iterations << " iterations" << endl;
+	cout << "findSpecial() uses " << InputScan::implementation() << endl;
+
+	double start = now();
+	size_t expected = 0;
+	for( int i = 0; i < iterations; i++ ) {
+		echo.clear();
+		expected = splitBytewise( input, line, echo );
+	}
+	double baseline = input.size() * (double)iterations / ( now() - start ) / 1e6;
+	printf( "%-20s %10.1f MB/s\n", "bytewise", baseline );
+
+	bool ok = true;
+	for( size_t v = 0; v < variants.size(); v++ ) {
+		size_t lines = 0;
+		start = now();
+		for( int i = 0; i < iterations; i++ ) {
+			echo.clear();
+			lines = splitRuns( variants[v].find, input, line, echo );
+		}
+		double rate = input.size() * (double)iterations / ( now() - start ) / 1e6;
+		printf( "runs, %-14s %10.1f MB/s  %5.1fx\n", variants[v].name, rate, rate / baseline );
+		if( lines != expected ) {
+			cerr << variants[v].name << ": got " << lines << " line bytes, expected " << expected << endl;
+			ok = false;
+		}
+	}
+
+	size_t lines = 0;
+	start = now();
+	for( int i = 0; i < iterations; i++ ) {
+		echo.clear();
+		lines = splitEscapes( input, line, echo );
+	}
+	double rate = input.size() * (double)iterations / ( now() - start ) / 1e6;
+	printf( "%-20s %10.1f MB/s  %5.1fx\n", "escape parser", rate, rate / baseline );
+	if( lines != expected ) {
+		cerr << "escape parser: got " << lines << " line bytes, expected " << expected << endl;
+		ok = false;
+	}
+	if( !checkEscapes() ) {
+		ok = false;
+	}
+
+	return ok ? 0 : 1;
+}
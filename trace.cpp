@@ -0,0 +1,189 @@
+#include "trace.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <unistd.h>
+
+#include "logger.h"
+#include "events.h"
+
+bool Trace::useTsc = false;
+double Trace::ticksPerUs = 1000;
+bool Trace::emitEvents = false;
+long Trace::ownHistograms[Trace::HistogramLongs];
+long* Trace::histograms = Trace::ownHistograms;
+vector<const long*> Trace::included;
+
+void Trace::init( bool useEmitEvents ) {
+	emitEvents = useEmitEvents;
+
+#ifdef TRACE_TSC
+	//Only a TSC that ticks at one rate through frequency changes and sleep
+	//	states measures time
+	ifstream cpuinfo( "/proc/cpuinfo" );
+	string line;
+	while( getline(cpuinfo, line) ) {
+		if( line.compare(0, 5, "flags") == 0 ) {
+			useTsc = line.find( " constant_tsc" ) != string::npos && line.find( " nonstop_tsc" ) != string::npos;
+			break;
+		}
+	}
+	if( useTsc ) {
+		timespec monoStart, monoEnd;
+		clock_gettime( CLOCK_MONOTONIC, &monoStart );
+		unsigned long long tscStart = __rdtsc();
+		usleep( 10000 );
+		clock_gettime( CLOCK_MONOTONIC, &monoEnd );
+		unsigned long long tscEnd = __rdtsc();
+		double us = ( monoEnd.tv_sec - monoStart.tv_sec ) * 1e6 + ( monoEnd.tv_nsec - monoStart.tv_nsec ) / 1e3;
+		ticksPerUs = ( tscEnd - tscStart ) / us;
+		LOG_INFO( "Timing session stages with the TSC at {} ticks per us", (long)( ticksPerUs + 0.5 ) );
+		return;
+	}
+#endif
+	LOG_INFO( "Timing session stages with CLOCK_MONOTONIC" );
+}
+
+Trace::Trace() : numSpans( 0 ), accepted( 0 ), last( 0 ), reachedMask( 0 ) {
+}
+
+void Trace::start() {
+	accepted = now();
+	last = accepted;
+}
+
+void Trace::mark( Stage stage ) {
+	unsigned long long begin = last;
+	last = now();
+	reachedMask |= 1 << stage;
+	record( stage, begin, last );
+}
+
+bool Trace::reached( Stage stage ) const {
+	return ( reachedMask & ( 1 << stage ) ) != 0;
+}
+
+void Trace::span( Stage stage, unsigned long long begin ) {
+	record( stage, begin, now() );
+}
+
+void Trace::record( Stage stage, unsigned long long begin, unsigned long long end ) {
+	if( numSpans == MaxSpans ) {
+		add( stage, end - begin );
+		return;
+	}
+	spans[numSpans].begin = begin;
+	spans[numSpans].end = end;
+	spans[numSpans].stage = stage;
+	numSpans++;
+}
+
+void Trace::finish( const string& ip, const Origin* origin, bool emit ) {
+	if( accepted == 0 ) {
+		return;
+	}
+	record( Session, accepted, now() );
+
+	//One string of stage=microseconds, in the order they happened
+	string text;
+	for( int i = 0; i < numSpans; i++ ) {
+		unsigned long long ticks = spans[i].end - spans[i].begin;
+		add( (Stage) spans[i].stage, ticks );
+		if( emitEvents && emit ) {
+			char item[48];
+			snprintf( item, sizeof(item), "%s%s=%llu", text.empty() ? "" : ",", name((Stage) spans[i].stage),
+				(unsigned long long)( ticks / ticksPerUs ) );
+			text += item;
+		}
+	}
+	if( emitEvents && emit ) {
+		Events::emit( Events::Trace, ip, origin, "", "", text.c_str() );
+	}
+	accepted = 0;
+}
+
+void Trace::add( Stage stage, unsigned long long ticks ) {
+	//Bucket b holds spans of less than 2^b microseconds, and at least half that
+	unsigned long long us = (unsigned long long)( ticks / ticksPerUs );
+	int bucket = us == 0 ? 0 : 64 - __builtin_clzll( us );
+	if( bucket >= NumBuckets ) {
+		bucket = NumBuckets - 1;
+	}
+	__sync_fetch_and_add( &histograms[stage * NumBuckets + bucket], 1 );
+}
+
+long Trace::get( int stage, int bucket ) {
+	int i = stage * NumBuckets + bucket;
+	long total = __sync_fetch_and_add( &histograms[i], 0 );
+	for( size_t j = 0; j < included.size(); j++ ) {
+		total += __sync_fetch_and_add( (long*) &included[j][i], 0 );
+	}
+	return total;
+}
+
+void Trace::share( long* shared ) {
+	histograms = shared;
+}
+
+void Trace::include( const long* shared ) {
+	included.push_back( shared );
+}
+
+//The upper bound of a bucket, readable
+static string bucketLimit( int bucket ) {
+	unsigned long long us = 1ULL << bucket;
+	char buf[32];
+	if( us < 10000 ) {
+		snprintf( buf, sizeof(buf), "%lluus", us );
+	} else if( us < 10000000 ) {
+		snprintf( buf, sizeof(buf), "%llums", us / 1000 );
+	} else {
+		snprintf( buf, sizeof(buf), "%llus", us / 1000000 );
+	}
+	return buf;
+}
+
+void Trace::log() {
+	for( int stage = 0; stage < NumStages; stage++ ) {
+		long counts[NumBuckets];
+		long total = 0;
+		for( int bucket = 0; bucket < NumBuckets; bucket++ ) {
+			counts[bucket] = get( stage, bucket );
+			total += counts[bucket];
+		}
+		if( total == 0 ) {
+			continue;
+		}
+
+		//The bucket each percentile falls in, reported as its upper bound
+		static const int percentiles[] = { 50, 90, 99, 100 };
+		static const char* labels[] = { "p50", "p90", "p99", "max" };
+		stringstream line;
+		line << "latency " << name( (Stage) stage ) << " count=" << total;
+		int bucket = 0;
+		long seen = counts[0];
+		for( int i = 0; i < 4; i++ ) {
+			long wanted = ( total * percentiles[i] + 99 ) / 100;
+			while( seen < wanted && bucket < NumBuckets - 1 ) {
+				seen += counts[++bucket];
+			}
+			line << " " << labels[i] << "<" << bucketLimit( bucket );
+		}
+		LOG_INFO( "{}", line.str() );
+	}
+}
+
+const char* Trace::name( Stage stage ) {
+	switch( stage ) {
+		case ThreadStart: return "thread_start";
+		case Greeting: return "greeting";
+		case FirstByte: return "first_byte";
+		case Login: return "login";
+		case FailDelay: return "fail_delay";
+		case Hook: return "hook";
+		case Session: return "session";
+		default: return "unknown";
+	}
+}
@@ -0,0 +1,128 @@
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#include <string>
+#include <vector>
+#include <ctime>
+using namespace std;
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define TRACE_TSC
+#endif
+
+struct Origin;
+
+//Where the time of a session goes. Each connection keeps the spans of its
+//	stages in a fixed array, time stamped with the TSC where it ticks at a
+//	constant rate and CLOCK_MONOTONIC elsewhere. When the session ends they
+//	are added to process wide histograms, and with trace_events set also
+//	sent as a trace event.
+//
+//	Milestones follow each other, each span runs from the one before:
+//	  thread_start  accepted until the session's thread runs
+//	  greeting      until the negotiation and banner went out, together
+//	  first_byte    until the peer sent something
+//	  login         until each login attempt was decided
+//	Other spans time one thing wherever it happens:
+//	  fail_delay    the pause after a failed login
+//	  hook          one run of connect_exec, login_exec, login_fail_exec or cmd_exec
+//	  session       accepted until disconnected
+//
+//	The histograms have log2 buckets of microseconds. With workers each one
+//	counts into its own slot of shared memory, which the supervisor sums up.
+class Trace {
+    public:
+	enum Stage { ThreadStart, Greeting, FirstByte, Login, FailDelay, Hook, Session, NumStages };
+	enum { NumBuckets = 32, HistogramLongs = NumStages * NumBuckets };
+
+	//Pick the clock, measuring the TSC's rate. Call once before forking.
+	static void init( bool emitEvents );
+
+	//Now, in ticks of the clock init() picked
+	static unsigned long long now() {
+#ifdef TRACE_TSC
+		if( useTsc ) {
+			return __rdtsc();
+		}
+#endif
+		timespec ts;
+		clock_gettime( CLOCK_MONOTONIC, &ts );
+		return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	}
+
+	Trace();
+
+	//The connection was accepted, the clock starts
+	void start();
+
+	//Reached a milestone
+	void mark( Stage stage );
+	bool reached( Stage stage ) const;
+
+	//Something that started at begin, a now() value, is done
+	void span( Stage stage, unsigned long long begin );
+
+	//The session ended: add the spans to the histograms and, if asked to,
+	//	send them as a trace event for ip
+	void finish( const string& ip, const Origin* origin, bool emit );
+
+	//Count into shared, HistogramLongs longs, from now on, for a worker
+	static void share( long* shared );
+
+	//Add the histograms in shared to what log() reports, for the supervisor
+	static void include( const long* shared );
+
+	//Write the percentiles of every stage to the info log
+	static void log();
+
+	static const char* name( Stage stage );
+
+    protected:
+	struct Span {
+		unsigned long long begin;
+		unsigned long long end;
+		unsigned char stage;
+	};
+
+	//Spans past the array go straight to the histograms, but not into the event
+	enum { MaxSpans = 32 };
+
+	void record( Stage stage, unsigned long long begin, unsigned long long end );
+	static void add( Stage stage, unsigned long long ticks );
+	static long get( int stage, int bucket );
+
+	Span spans[MaxSpans];
+	int numSpans;
+	unsigned long long accepted;
+	unsigned long long last;
+	unsigned int reachedMask;
+
+	static bool useTsc;
+	static double ticksPerUs;
+	static bool emitEvents;
+	static long ownHistograms[HistogramLongs];
+	static long* histograms;
+	static vector<const long*> included;
+};
+
+//Finishes a session's trace when it goes out of scope, which includes a
+//	thread ending in pthread_exit() since that unwinds the stack
+class TraceScope {
+    public:
+	TraceScope( Trace& trace, const string& ip, const Origin* origin, bool emit )
+		: trace( trace ), ip( ip ), origin( origin ), emit( emit ) {
+	}
+
+	~TraceScope() {
+		trace.finish( ip, origin, emit );
+	}
+
+    protected:
+	Trace& trace;
+	const string& ip;
+	const Origin* origin;
+	bool emit;
+};
+
+#endif
@@ -0,0 +1,262 @@
+#include "upgrade.h"
+
+#include <cstring>
+#include <cerrno>
+#include <sstream>
+#include <pthread.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+using namespace std;
+
+#include "logger.h"
+
+int Upgrade::upstreamFd = -1;
+int Upgrade::serverFd = -1;
+map<int, int> Upgrade::handed;
+vector<int> Upgrade::listenFds;
+vector<int> Upgrade::listenPorts;
+void (*Upgrade::onHandoff)() = NULL;
+
+//How long the old daemon waits for the new one to confirm
+static const int confirmTimeoutMs = 30000;
+
+//The most sockets one handover carries, and the longest greeting for them
+static const size_t maxListeners = 64;
+static const size_t maxGreeting = 512;
+
+static const char handoffMsg[] = "faketelnetd-listeners";
+static const char confirmMsg[] = "accepting\n";
+
+static bool fillAddress( const string& path, sockaddr_un& addr ) {
+	memset( &addr, 0, sizeof(addr) );
+	addr.sun_family = AF_UNIX;
+	if( path.size() >= sizeof(addr.sun_path) ) {
+		return false;
+	}
+	strcpy( addr.sun_path, path.c_str() );
+	return true;
+}
+
+bool Upgrade::receiveListeners( string path ) {
+	sockaddr_un addr;
+	if( !fillAddress(path, addr) ) {
+		throw string("upgrade_socket path is too long: ") + path;
+	}
+
+	int fd = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+	if( fd == -1 ) {
+		return false;
+	}
+
+	//Nobody there means this is a plain start
+	if( connect(fd, (sockaddr*)&addr, sizeof(addr)) == -1 ) {
+		close( fd );
+		return false;
+	}
+
+	//The listening sockets arrive as ancillary data along with the start of the greeting
+	char buf[maxGreeting];
+	iovec iov;
+	iov.iov_base = buf;
+	iov.iov_len = sizeof(buf);
+
+	char control[CMSG_SPACE(sizeof(int) * maxListeners)];
+	msghdr msg;
+	memset( &msg, 0, sizeof(msg) );
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	ssize_t len;
+	do {
+		len = recvmsg( fd, &msg, MSG_CMSG_CLOEXEC );
+	} while( len == -1 && errno == EINTR );
+
+	cmsghdr* cmsg = CMSG_FIRSTHDR( &msg );
+	if( len <= 0 || cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ) {
+		close( fd );
+		throw string("Daemon at ") + path + string(" did not hand over its listening sockets");
+	}
+	size_t count = ( cmsg->cmsg_len - CMSG_LEN(0) ) / sizeof(int);
+	int received[maxListeners];
+	memcpy( received, CMSG_DATA(cmsg), count * sizeof(int) );
+
+	//The rest of the greeting, up to its newline
+	string greeting( buf, len );
+	while( greeting.find('\n') == string::npos && greeting.size() < maxGreeting ) {
+		len = recv( fd, buf, sizeof(buf), 0 );
+		if( len == 0 || ( len == -1 && errno != EINTR ) ) {
+			break;
+		}
+		greeting.append( buf, len > 0 ? len : 0 );
+	}
+
+	istringstream words( greeting );
+	string hello;
+	words >> hello;
+	vector<int> ports;
+	int port;
+	while( words >> port ) {
+		ports.push_back( port );
+	}
+	if( hello != handoffMsg || ports.size() != count ) {
+		for( size_t i = 0; i < count; i++ ) {
+			close( received[i] );
+		}
+		close( fd );
+		throw string("Daemon at ") + path + string(" sent a garbled handover");
+	}
+	for( size_t i = 0; i < count; i++ ) {
+		handed[ports[i]] = received[i];
+	}
+
+	//Hold on to the connection until we confirm
+	upstreamFd = fd;
+	return true;
+}
+
+int Upgrade::take( int port ) {
+	map<int, int>::iterator it = handed.find( port );
+	if( it == handed.end() ) {
+		return -1;
+	}
+	int fd = it->second;
+	handed.erase( it );
+	return fd;
+}
+
+void Upgrade::confirm() {
+	//Ports that were dropped from the settings
+	for( map<int, int>::iterator it = handed.begin(); it != handed.end(); ++it ) {
+		Logger::info() << "Not listening on port " << it->first << " any more" << endl;
+		close( it->second );
+	}
+	handed.clear();
+
+	if( upstreamFd == -1 ) {
+		return;
+	}
+
+	if( send(upstreamFd, confirmMsg, sizeof(confirmMsg)-1, MSG_NOSIGNAL) == -1 ) {
+		Logger::info() << "Could not confirm the upgrade to the old daemon, errno " << errno << endl;
+	}
+	close( upstreamFd );
+	upstreamFd = -1;
+}
+
+void Upgrade::listen( string path, const vector<int>& useListenFds, void (*useOnHandoff)() ) {
+	sockaddr_un addr;
+	if( !fillAddress(path, addr) ) {
+		throw string("upgrade_socket path is too long: ") + path;
+	}
+
+	serverFd = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+	if( serverFd == -1 ) {
+		throw string("Could not create upgrade socket");
+	}
+
+	//Replace whatever the previous daemon left behind
+	unlink( path.c_str() );
+	if( bind(serverFd, (sockaddr*)&addr, sizeof(addr)) == -1 || ::listen(serverFd, 1) == -1 ) {
+		close( serverFd );
+		serverFd = -1;
+		throw string("Could not listen on upgrade socket ") + path;
+	}
+
+	//Tag every socket with its port, which is how the new daemon tells them apart
+	listenFds.clear();
+	listenPorts.clear();
+	for( size_t i = 0; i < useListenFds.size() && i < maxListeners; i++ ) {
+		sockaddr_in local;
+		socklen_t localLength = sizeof(local);
+		if( getsockname(useListenFds[i], (sockaddr*) &local, &localLength) == -1 ) {
+			continue;
+		}
+		listenFds.push_back( useListenFds[i] );
+		listenPorts.push_back( ntohs(local.sin_port) );
+	}
+	onHandoff = useOnHandoff;
+
+	pthread_t thread;
+	if( pthread_create(&thread, NULL, &Upgrade::serve, NULL) != 0 ) {
+		throw string("Could not start the upgrade thread");
+	}
+	pthread_detach( thread );
+}
+
+void* Upgrade::serve( void* ) {
+	while( true ) {
+		int conn = accept4( serverFd, NULL, NULL, SOCK_CLOEXEC );
+		if( conn == -1 ) {
+			if( errno == EINTR ) {
+				continue;
+			}
+			Logger::info() << "Upgrade socket failed, errno " << errno << ", hot upgrades disabled" << endl;
+			return NULL;
+		}
+
+		Logger::info() << "New daemon connected on the upgrade socket, handing over " << listenFds.size() << " listening sockets" << endl;
+
+		//Pass all the listening sockets along in one message, their ports in the greeting
+		stringstream greeting;
+		greeting << handoffMsg;
+		for( size_t i = 0; i < listenPorts.size(); i++ ) {
+			greeting << " " << listenPorts[i];
+		}
+		greeting << "\n";
+		string text = greeting.str();
+		iovec iov;
+		iov.iov_base = (void*)text.data();
+		iov.iov_len = text.size();
+
+		char control[CMSG_SPACE(sizeof(int) * maxListeners)];
+		memset( control, 0, sizeof(control) );
+		msghdr msg;
+		memset( &msg, 0, sizeof(msg) );
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = CMSG_SPACE( sizeof(int) * listenFds.size() );
+
+		cmsghdr* cmsg = CMSG_FIRSTHDR( &msg );
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN( sizeof(int) * listenFds.size() );
+		memcpy( CMSG_DATA(cmsg), listenFds.data(), sizeof(int) * listenFds.size() );
+
+		if( sendmsg(conn, &msg, MSG_NOSIGNAL) == -1 ) {
+			Logger::info() << "Could not hand over the listening sockets, errno " << errno << endl;
+			close( conn );
+			continue;
+		}
+
+		//Keep accepting until the new daemon says it is, if it dies first we carry on
+		pollfd pfd;
+		pfd.fd = conn;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		char buf[sizeof(confirmMsg)];
+		ssize_t len = 0;
+		if( poll(&pfd, 1, confirmTimeoutMs) == 1 ) {
+			len = recv( conn, buf, sizeof(confirmMsg)-1, MSG_WAITALL );
+		}
+		close( conn );
+
+		if( len != (ssize_t)sizeof(confirmMsg)-1 || memcmp(buf, confirmMsg, len) != 0 ) {
+			Logger::info() << "New daemon did not confirm the upgrade, still accepting" << endl;
+			continue;
+		}
+
+		//The new daemon owns the upgrade socket path now
+		close( serverFd );
+		serverFd = -1;
+
+		Logger::info() << "New daemon is accepting, handing over" << endl;
+		onHandoff();
+		return NULL;
+	}
+}
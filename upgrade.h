@@ -0,0 +1,45 @@
+#ifndef __UPGRADE_H
+#define __UPGRADE_H
+
+#include <string>
+#include <vector>
+#include <map>
+using namespace std;
+
+//Hot upgrades: a freshly started daemon connects to the running one over a
+//	unix socket and is handed all of its listening sockets with SCM_RIGHTS,
+//	so no port ever closes and nothing waiting to be accepted is lost. Once
+//	the new daemon confirms it is accepting, the old one stops accepting and
+//	drains its sessions.
+//
+//	The greeting lists the port of every socket, in the order they come:
+//	  faketelnetd-listeners <port> <port> ...\n
+class Upgrade {
+    public:
+	//Ask a running daemon at path for its listening sockets. Returns false
+	//	when nobody is listening there.
+	static bool receiveListeners( string path );
+
+	//The socket handed over for port, -1 if there was none. The caller owns it.
+	static int take( int port );
+
+	//Tell the daemon we took the sockets from that we're accepting now, and
+	//	close the ones for ports we no longer listen on
+	static void confirm();
+
+	//Serve the listening sockets to the next upgrade from a background
+	//	thread. onHandoff is called once the new daemon has confirmed.
+	static void listen( string path, const vector<int>& listenFds, void (*onHandoff)() );
+
+    protected:
+	static void* serve( void* );
+
+	static int upstreamFd;
+	static int serverFd;
+	static map<int, int> handed;
+	static vector<int> listenFds;
+	static vector<int> listenPorts;
+	static void (*onHandoff)();
+};
+
+#endif
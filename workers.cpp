@@ -0,0 +1,207 @@
+#include "workers.h"
+
+#include <new>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "logger.h"
+#include "stats.h"
+#include "events.h"
+#include "sessiontable.h"
+#include "trace.h"
+
+//A worker that dies sooner than this after starting waits out the rest
+//	before it's restarted, so a crash loop doesn't become a fork loop
+static const long long RESTART_DELAY_MS = 1000;
+
+vector<Workers::Worker> Workers::workers;
+void (*Workers::run)() = NULL;
+char* Workers::shared = NULL;
+size_t Workers::slotBytes = 0;
+size_t Workers::countersBytes = 0;
+size_t Workers::ringStride = 0;
+size_t Workers::ringCapacity = 0;
+int Workers::logPipe[2] = { -1, -1 };
+string Workers::logPending;
+int Workers::index = -1;
+bool Workers::stopping = false;
+
+static long long monotonicMs() {
+	timespec now;
+	clock_gettime( CLOCK_MONOTONIC, &now );
+	return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+static size_t alignUp( size_t n ) {
+	return ( n + 63 ) & ~(size_t)63;
+}
+
+void Workers::start( int count, size_t ringBytes, void (*useRun)() ) {
+	run = useRun;
+	ringCapacity = 4096;
+	while( ringCapacity < ringBytes ) {
+		ringCapacity *= 2;
+	}
+
+	//The counter and histogram slots of all workers, then their rings
+	countersBytes = alignUp( Stats::NumCounters * sizeof(long) );
+	slotBytes = countersBytes + alignUp( Trace::HistogramLongs * sizeof(long) );
+	ringStride = alignUp( SpscRing::bytesFor(ringCapacity) );
+	size_t length = count * ( slotBytes + ringStride );
+	shared = (char*) mmap( NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+	if( shared == MAP_FAILED ) {
+		throw string("Could not map the memory shared with the workers");
+	}
+	for( int i = 0; i < count; i++ ) {
+		new( shared + count * slotBytes + i * ringStride ) SpscRing( ringCapacity );
+		Stats::include( (const long*)( shared + i * slotBytes ) );
+		Trace::include( (const long*)( shared + i * slotBytes + countersBytes ) );
+	}
+
+	//Lines written to a pipe in one go arrive whole, a bigger pipe rides out a slow disk
+	if( pipe2(logPipe, O_CLOEXEC) == -1 ) {
+		throw string("Could not create the log pipe for the workers");
+	}
+	fcntl( logPipe[0], F_SETFL, O_NONBLOCK );
+	fcntl( logPipe[1], F_SETPIPE_SZ, 1 << 20 );
+
+	workers.resize( count );
+	for( int i = 0; i < count; i++ ) {
+		spawn( i );
+	}
+	Logger::info() << "Started " << count << " workers with " << ringCapacity << " byte event rings" << endl;
+}
+
+void Workers::spawn( int i ) {
+	Worker& worker = workers[i];
+	worker.startedMs = monotonicMs();
+	worker.pid = fork();
+	if( worker.pid == 0 ) {
+		index = i;
+		close( logPipe[0] );
+		run();
+		_exit( 0 );
+	}
+	if( worker.pid == -1 ) {
+		Logger::info() << "Could not fork worker " << i << ", errno " << errno << endl;
+	}
+}
+
+int Workers::supervise( int wakeFd, int timeoutMs ) {
+	pollfd pfd[2];
+	pfd[0].fd = wakeFd;
+	pfd[0].events = POLLIN;
+	pfd[0].revents = 0;
+	pfd[1].fd = logPipe[0];
+	pfd[1].events = POLLIN;
+	pfd[1].revents = 0;
+	poll( pfd, 2, timeoutMs );
+
+	//Reap first, whatever a worker wrote before it exited is relayed below
+	reap();
+	relayLogs();
+	relayEvents();
+
+	int running = 0;
+	long long now = monotonicMs();
+	for( size_t i = 0; i < workers.size(); i++ ) {
+		if( workers[i].pid == -1 && !stopping && now - workers[i].startedMs >= RESTART_DELAY_MS ) {
+			workers[i].restarts++;
+			spawn( i );
+			Logger::info() << "Restarted worker " << i << " as pid " << workers[i].pid << ", restart number "
+				<< workers[i].restarts << endl;
+		}
+		if( workers[i].pid > 0 ) {
+			running++;
+		}
+	}
+	return running;
+}
+
+void Workers::reap() {
+	//Only our own children, the log rotation waits for its gzip itself
+	for( size_t i = 0; i < workers.size(); i++ ) {
+		int status;
+		if( workers[i].pid <= 0 || waitpid(workers[i].pid, &status, WNOHANG) != workers[i].pid ) {
+			continue;
+		}
+		if( WIFSIGNALED(status) ) {
+			Logger::info() << "Worker " << i << " (pid " << workers[i].pid << ") was killed by signal " << WTERMSIG(status) << endl;
+		} else if( !stopping || WEXITSTATUS(status) != 0 ) {
+			Logger::info() << "Worker " << i << " (pid " << workers[i].pid << ") exited with status " << WEXITSTATUS(status) << endl;
+		}
+		//The tarpit connections and sessions it held went with it
+		long* counters = (long*)( shared + i * slotBytes );
+		counters[Stats::TarpitHeld] = 0;
+		SessionTable::releaseOwner( workers[i].pid );
+		workers[i].pid = -1;
+	}
+}
+
+void Workers::relayLogs() {
+	char buf[65536];
+	ssize_t length;
+	while( ( length = read(logPipe[0], buf, sizeof(buf)) ) > 0 ) {
+		logPending.append( buf, length );
+	}
+
+	//Only whole lines, so they don't get mixed up with the supervisor's own
+	size_t end = logPending.rfind( '\n' );
+	if( end != string::npos ) {
+		Logger::write( logPending.data(), end + 1 );
+		logPending.erase( 0, end + 1 );
+	}
+}
+
+void Workers::relayEvents() {
+	static char record[65536 * 6];
+	for( size_t i = 0; i < workers.size(); i++ ) {
+		SpscRing* ring = (SpscRing*)( shared + workers.size() * slotBytes + i * ringStride );
+		size_t length;
+		while( ( length = ring->pop(record, sizeof(record)) ) > 0 ) {
+			if( length <= sizeof(record) ) {
+				Events::relay( record, length );
+			}
+		}
+	}
+}
+
+void Workers::signalAll( int sig ) {
+	for( size_t i = 0; i < workers.size(); i++ ) {
+		if( workers[i].pid > 0 ) {
+			kill( workers[i].pid, sig );
+		}
+	}
+}
+
+void Workers::stop( int sig ) {
+	stopping = true;
+	signalAll( sig );
+}
+
+int Workers::current() {
+	return index;
+}
+
+SpscRing* Workers::ring() {
+	return (SpscRing*)( shared + workers.size() * slotBytes + index * ringStride );
+}
+
+long* Workers::stats() {
+	return (long*)( shared + index * slotBytes );
+}
+
+long* Workers::histograms() {
+	return (long*)( shared + index * slotBytes + countersBytes );
+}
+
+int Workers::logFd() {
+	return logPipe[1];
+}
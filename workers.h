@@ -0,0 +1,77 @@
+#ifndef __WORKERS_H
+#define __WORKERS_H
+
+#include <string>
+#include <vector>
+#include <sys/types.h>
+using namespace std;
+
+#include "spscring.h"
+
+//Pre-forked worker processes serving sessions on the listening sockets
+//	they inherit, each its own failure domain with its own threads, locks
+//	and session list. The process that forked them only supervises: it
+//	keeps the sockets open, restarts a worker that dies, and owns the log
+//	file and the collector connection.
+//
+//	Everything workers report reaches the supervisor through one shared
+//	memory mapping made before forking. Each worker has
+//	  a slot for its Stats counters and Trace histograms, which the
+//	    supervisor sums up
+//	  a SpscRing its event exporter thread writes and the supervisor drains
+//	    into Events::relay()
+//	Log lines go to the supervisor through a pipe instead, so only it ever
+//	writes the log file and rotation keeps working. A worker that dies
+//	leaves its counters behind for the next one in its slot.
+class Workers {
+    public:
+	//Map the shared memory and fork count workers, each running run, which
+	//	must not return. Every worker gets a ring of ringBytes, rounded up
+	//	to a power of two. Call before starting any thread.
+	static void start( int count, size_t ringBytes, void (*run)() );
+
+	//One round of supervising: wait up to timeoutMs or until wakeFd is
+	//	readable, restart workers that died, unless stopping, and relay
+	//	what the workers logged and emitted. Returns how many are running.
+	static int supervise( int wakeFd, int timeoutMs );
+
+	//Send sig to every running worker. stop() also lets no worker be
+	//	restarted from now on.
+	static void signalAll( int sig );
+	static void stop( int sig );
+
+	//Which worker the calling process is, -1 in the supervisor
+	static int current();
+
+	//The calling worker's event ring, counter and histogram slots and log pipe
+	static SpscRing* ring();
+	static long* stats();
+	static long* histograms();
+	static int logFd();
+
+    protected:
+	struct Worker {
+		pid_t pid;
+		long long startedMs;
+		int restarts;
+	};
+
+	static void spawn( int index );
+	static void reap();
+	static void relayLogs();
+	static void relayEvents();
+
+	static vector<Worker> workers;
+	static void (*run)();
+	static char* shared;
+	static size_t slotBytes;
+	static size_t countersBytes;
+	static size_t ringStride;
+	static size_t ringCapacity;
+	static int logPipe[2];
+	static string logPending;
+	static int index;
+	static bool stopping;
+};
+
+#endif